@@ -28,18 +28,24 @@
 #include "esp_system.h"
 #include "esp_err.h"
 #include "esp_task_wdt.h"
+#include "esp_timer.h"
 
 #include "driver/i2c.h"
+#include "nvs_flash.h"
 
 #include "ahrs.h"
 #include "mpu9250.h"
+#include "ak8963.h"
 #include "calibrate.h"
+#include "bias_tracker.h"
+#include "calstore.h"
 #include "common.h"
 
 static const char *TAG = "main";
 
 #define I2C_MASTER_NUM I2C_NUM_0 /*!< I2C port number for master dev */
 
+// Used when nothing is stored for this unit, see load_calibration().
 calibration_t cal = {
     .mag_offset = {.x = 25.183594, .y = 57.519531, .z = -62.648438},
     .mag_scale = {.x = 1.513449, .y = 1.557811, .z = 1.434039},
@@ -49,62 +55,99 @@ calibration_t cal = {
     .gyro_bias_offset = {.x = 0.303956, .y = -1.049768, .z = -0.403782}};
 
 /**
- * Transformation:
- *  - Rotate around Z axis 180 degrees
- *  - Rotate around X axis -90 degrees
- * @param  {object} s {x,y,z} sensor
- * @return {object}   {x,y,z} transformed
+ * Replace the compiled-in calibration with the one stored for this unit, if there is one.
  */
-static void transform_accel_gyro(vector_t *v)
+static void load_calibration(void)
 {
-  float x = v->x;
-  float y = v->y;
-  float z = v->z;
+  char id[CALSTORE_ID_LEN];
+  calstore_data_t stored;
+  ESP_ERROR_CHECK(calstore_device_id(id));
 
-  v->x = -x;
-  v->y = -z;
-  v->z = -y;
+  esp_err_t ret = calstore_load(id, &stored);
+  if (ret == ESP_OK && (stored.sections & CALSTORE_HAS_IMU))
+  {
+    cal = stored.imu;
+  }
+  else
+  {
+    ESP_LOGW(TAG, "No stored calibration for %s (%s), using the defaults", id, esp_err_to_name(ret));
+  }
 }
 
 /**
- * Transformation: to get magnetometer aligned
- * @param  {object} s {x,y,z} sensor
- * @return {object}   {x,y,z} transformed
+ * Keep what calibration mode found, so the next boot picks it up.
  */
-static void transform_mag(vector_t *v)
+static void save_calibration(void)
 {
-  float x = v->x;
-  float y = v->y;
-  float z = v->z;
+  char id[CALSTORE_ID_LEN];
+  calstore_data_t stored;
+  ESP_ERROR_CHECK(calstore_device_id(id));
+
+  // Keep any other sections already stored for this unit.
+  if (calstore_load(id, &stored) != ESP_OK)
+  {
+    memset(&stored, 0, sizeof(stored));
+  }
+  calibrate_get_calibration(&stored.imu);
+  stored.sections |= CALSTORE_HAS_IMU;
 
-  v->x = -y;
-  v->y = z;
-  v->z = -x;
+  ESP_ERROR_CHECK(calstore_save(id, &stored));
 }
 
 void run_imu(void)
 {
 
+  load_calibration();
   i2c_mpu9250_init(&cal);
-  ahrs_init(SAMPLE_FREQ_Hz, 0.8);
+
+  // Mounting of the board in our device, folded into the calibration by the driver.
+  //  - accel / gyro: rotate around Z axis 180 degrees, then around X axis -90 degrees
+  //  - mag: the AK8963 axes are different again
+  float mount_accel_gyro[3][3];
+  float mount_mag[3][3];
+  mpu9250_mounting_from_axes(-MPU9250_AXIS_X, -MPU9250_AXIS_Z, -MPU9250_AXIS_Y, mount_accel_gyro);
+  mpu9250_mounting_from_axes(-MPU9250_AXIS_Y, MPU9250_AXIS_Z, -MPU9250_AXIS_X, mount_mag);
+  ESP_ERROR_CHECK(mpu9250_set_mounting(mount_accel_gyro));
+  ESP_ERROR_CHECK(ak8963_set_mounting(mount_mag));
+
+  // Drops and impacts clip at the default ranges, let the driver range up and back down.
+  mpu9250_autorange_config_t autorange = MPU9250_AUTORANGE_DEFAULT_CONFIG(SAMPLE_FREQ_Hz);
+  ESP_ERROR_CHECK(mpu9250_set_autorange(&autorange));
+  // A low steady gain for a smooth output, the schedule converges at 20x that after boot, or when
+  // the estimate has been off by more than the threshold for a few seconds while not turning.
+  ahrs_init(SAMPLE_FREQ_Hz, 0.1f);
+  ahrs_gain_schedule_t schedule = AHRS_GAIN_SCHEDULE_DEFAULT_CONFIG();
+  ahrs_filter_set_gain_schedule(ahrs_default(), &schedule);
+
+  // Hold the heading on the gyro while a motor or steel nearby bends the field.
+  ahrs_mag_rejection_t mag_rejection = AHRS_MAG_REJECTION_DEFAULT_CONFIG();
+  ahrs_filter_set_mag_rejection(ahrs_default(), &mag_rejection);
+
+  // Keep the gyro bias up to date whenever the device is left still.
+  bias_tracker_t bias_tracker;
+  bias_tracker_config_t bias_config = BIAS_TRACKER_DEFAULT_CONFIG(SAMPLE_FREQ_Hz);
+  bias_tracker_init(&bias_tracker, &cal, &bias_config);
 
   uint64_t i = 0;
   while (true)
   {
     vector_t va, vg, vm;
 
-    // Get the Accelerometer, Gyroscope and Magnetometer values.
-    ESP_ERROR_CHECK(get_accel_gyro_mag(&va, &vg, &vm));
-
-    // Transform these values to the orientation of our device.
-    transform_accel_gyro(&va);
-    transform_accel_gyro(&vg);
-    transform_mag(&vm);
+    // Get the Accelerometer, Gyroscope and Magnetometer values.  A magnetometer overflow leaves vm
+    // zero, and the AHRS does an IMU only update.
+    esp_err_t ret = get_accel_gyro_mag(&va, &vg, &vm);
+    int64_t timestamp_us = esp_timer_get_time();
+    if (ret != ESP_ERR_INVALID_RESPONSE)
+    {
+      ESP_ERROR_CHECK(ret);
+    }
+    bias_tracker_update(&bias_tracker, &va, &vg);
 
-    // Apply the AHRS algorithm
-    ahrs_update(DEG2RAD(vg.x), DEG2RAD(vg.y), DEG2RAD(vg.z),
-                va.x, va.y, va.z,
-                vm.x, vm.y, vm.z);
+    // Apply the AHRS algorithm, over the actual time since the last sample
+    ahrs_filter_update_timestamp(ahrs_default(), timestamp_us,
+                                 DEG2RAD(vg.x), DEG2RAD(vg.y), DEG2RAD(vg.z),
+                                 va.x, va.y, va.z,
+                                 vm.x, vm.y, vm.z);
 
     // Print the data out every 10 items
     if (i++ % 10 == 0)
@@ -114,7 +157,8 @@ void run_imu(void)
 
       float heading, pitch, roll;
       ahrs_get_euler_in_degrees(&heading, &pitch, &roll);
-      ESP_LOGI(TAG, "heading: %2.3f°, pitch: %2.3f°, roll: %2.3f°, Temp %2.3f°C", heading, pitch, roll, temp);
+      ESP_LOGI(TAG, "heading: %2.3f°, pitch: %2.3f°, roll: %2.3f°, Temp %2.3f°C%s", heading, pitch, roll, temp,
+               ahrs_filter_get_mag_disturbed(ahrs_default()) ? ", mag disturbed" : "");
 
       // Make the WDT happy
       vTaskDelay(0);
@@ -131,6 +175,7 @@ static void imu_task(void *arg)
   calibrate_gyro();
   calibrate_accel();
   calibrate_mag();
+  save_calibration();
 #else
   run_imu();
 #endif
@@ -144,6 +189,14 @@ static void imu_task(void *arg)
 
 void app_main(void)
 {
+  esp_err_t ret = nvs_flash_init();
+  if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+  {
+    ESP_ERROR_CHECK(nvs_flash_erase());
+    ret = nvs_flash_init();
+  }
+  ESP_ERROR_CHECK(ret);
+
   // start i2c task
   xTaskCreate(imu_task, "imu_task", 4096, NULL, 10, NULL);
 }
\ No newline at end of file
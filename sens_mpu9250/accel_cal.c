@@ -0,0 +1,254 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "accel_cal.h"
+
+static const char *TAG = "accel_cal";
+
+#define N_TERMS (4) // Three gains and an offset per output axis
+
+void accel_cal_init(accel_cal_t *ac, const accel_cal_config_t *config)
+{
+  memset(ac, 0, sizeof(accel_cal_t));
+  ac->config = *config;
+  ac->current_pose = -1;
+  if (ac->config.window < 2)
+  {
+    ac->config.window = 2;
+  }
+}
+
+static void stats_add(accel_cal_stats_t *s, const vector_t *v)
+{
+  s->n += 1;
+
+  float dx = v->x - s->mean.x;
+  float dy = v->y - s->mean.y;
+  float dz = v->z - s->mean.z;
+  s->mean.x += dx / s->n;
+  s->mean.y += dy / s->n;
+  s->mean.z += dz / s->n;
+  s->m2.x += dx * (v->x - s->mean.x);
+  s->m2.y += dy * (v->y - s->mean.y);
+  s->m2.z += dz * (v->z - s->mean.z);
+}
+
+/**
+ * Combine two sets of Welford statistics (Chan et al.).
+ */
+static void stats_merge(accel_cal_stats_t *a, const accel_cal_stats_t *b)
+{
+  uint32_t n = a->n + b->n;
+  float fa = (float)a->n / n;
+  float fb = (float)b->n / n;
+  float k = (float)a->n * b->n / n;
+
+  float dx = b->mean.x - a->mean.x;
+  float dy = b->mean.y - a->mean.y;
+  float dz = b->mean.z - a->mean.z;
+
+  a->m2.x += b->m2.x + dx * dx * k;
+  a->m2.y += b->m2.y + dy * dy * k;
+  a->m2.z += b->m2.z + dz * dz * k;
+  a->mean.x = a->mean.x * fa + b->mean.x * fb;
+  a->mean.y = a->mean.y * fa + b->mean.y * fb;
+  a->mean.z = a->mean.z * fa + b->mean.z * fb;
+  a->n = n;
+}
+
+/**
+ * Which face is down, from the mean of a still window.  -1 if it is not close to any.
+ */
+static int detect_pose(const accel_cal_t *ac, const vector_t *m)
+{
+  float ax = fabsf(m->x);
+  float ay = fabsf(m->y);
+  float az = fabsf(m->z);
+
+  if (ax > ay && ax > az && ax > ac->config.min_alignment)
+    return m->x > 0 ? ACCEL_CAL_X_UP : ACCEL_CAL_X_DOWN;
+  if (ay > az && ay > ac->config.min_alignment)
+    return m->y > 0 ? ACCEL_CAL_Y_UP : ACCEL_CAL_Y_DOWN;
+  if (az > ac->config.min_alignment)
+    return m->z > 0 ? ACCEL_CAL_Z_UP : ACCEL_CAL_Z_DOWN;
+  return -1;
+}
+
+int accel_cal_add_sample(accel_cal_t *ac, const vector_t *raw)
+{
+  stats_add(&ac->window, raw);
+  if (ac->window.n < ac->config.window)
+  {
+    return -1;
+  }
+
+  accel_cal_stats_t w = ac->window;
+  memset(&ac->window, 0, sizeof(accel_cal_stats_t));
+
+  float var = (w.m2.x + w.m2.y + w.m2.z) / (w.n - 1);
+  int pose = var < ac->config.still_var_max ? detect_pose(ac, &w.mean) : -1;
+
+  // Moving, or on a different face: drop any partial pose.
+  if (pose != ac->current_pose && ac->current_pose >= 0 && !(ac->captured & (1 << ac->current_pose)))
+  {
+    memset(&ac->pose[ac->current_pose], 0, sizeof(accel_cal_stats_t));
+  }
+  ac->current_pose = pose;
+  if (pose < 0 || (ac->captured & (1 << pose)))
+  {
+    return -1;
+  }
+
+  stats_merge(&ac->pose[pose], &w);
+  if (ac->pose[pose].n < ac->config.pose_samples)
+  {
+    return -1;
+  }
+
+  ac->captured |= 1 << pose;
+  ESP_LOGD(TAG, "Pose %d: (%f, %f, %f)", pose, ac->pose[pose].mean.x, ac->pose[pose].mean.y, ac->pose[pose].mean.z);
+  return pose;
+}
+
+bool accel_cal_is_complete(const accel_cal_t *ac)
+{
+  return ac->captured == (1 << ACCEL_CAL_NUM_POSES) - 1;
+}
+
+/**
+ * Solve A x = b in place, Gaussian elimination with partial pivoting.
+ */
+static bool solve(double a[N_TERMS][N_TERMS], double b[N_TERMS])
+{
+  for (int c = 0; c < N_TERMS; c++)
+  {
+    int pivot = c;
+    for (int r = c + 1; r < N_TERMS; r++)
+    {
+      if (fabs(a[r][c]) > fabs(a[pivot][c]))
+        pivot = r;
+    }
+    if (fabs(a[pivot][c]) < 1e-9)
+      return false;
+
+    for (int k = 0; k < N_TERMS; k++)
+    {
+      double t = a[c][k];
+      a[c][k] = a[pivot][k];
+      a[pivot][k] = t;
+    }
+    double t = b[c];
+    b[c] = b[pivot];
+    b[pivot] = t;
+
+    for (int r = c + 1; r < N_TERMS; r++)
+    {
+      double m = a[r][c] / a[c][c];
+      for (int k = c; k < N_TERMS; k++)
+        a[r][k] -= m * a[c][k];
+      b[r] -= m * b[c];
+    }
+  }
+
+  for (int r = N_TERMS - 1; r >= 0; r--)
+  {
+    for (int k = r + 1; k < N_TERMS; k++)
+      b[r] -= a[r][k] * b[k];
+    b[r] /= a[r][r];
+  }
+  return true;
+}
+
+esp_err_t accel_cal_solve(const accel_cal_t *ac, calibration_t *cal)
+{
+  if (!accel_cal_is_complete(ac))
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Design rows [x y z 1] for each pose, and where gravity should read for it.
+  double x[ACCEL_CAL_NUM_POSES][N_TERMS];
+  double g[ACCEL_CAL_NUM_POSES][3];
+  for (int p = 0; p < ACCEL_CAL_NUM_POSES; p++)
+  {
+    x[p][0] = ac->pose[p].mean.x;
+    x[p][1] = ac->pose[p].mean.y;
+    x[p][2] = ac->pose[p].mean.z;
+    x[p][3] = 1.0;
+
+    g[p][0] = g[p][1] = g[p][2] = 0.0;
+    g[p][p / 2] = (p % 2 == 0) ? 1.0 : -1.0;
+  }
+
+  // Each output axis is its own least squares problem: g_i = A_i . raw + c_i
+  double a[3][3], c[3];
+  for (int i = 0; i < 3; i++)
+  {
+    double xtx[N_TERMS][N_TERMS] = {{0}};
+    double xtg[N_TERMS] = {0};
+    for (int p = 0; p < ACCEL_CAL_NUM_POSES; p++)
+    {
+      for (int r = 0; r < N_TERMS; r++)
+      {
+        for (int k = 0; k < N_TERMS; k++)
+          xtx[r][k] += x[p][r] * x[p][k];
+        xtg[r] += x[p][r] * g[p][i];
+      }
+    }
+    if (!solve(xtx, xtg))
+    {
+      ESP_LOGE(TAG, "The poses don't span all three axes");
+      return ESP_ERR_INVALID_STATE;
+    }
+    a[i][0] = xtg[0];
+    a[i][1] = xtg[1];
+    a[i][2] = xtg[2];
+    c[i] = xtg[3];
+  }
+
+  // g = A raw + c = A (raw - bias), so bias = -A^-1 c
+  double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) -
+               a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+               a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+  if (fabs(det) < 1e-9)
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  double inv[3][3] = {
+      {(a[1][1] * a[2][2] - a[1][2] * a[2][1]) / det, (a[0][2] * a[2][1] - a[0][1] * a[2][2]) / det, (a[0][1] * a[1][2] - a[0][2] * a[1][1]) / det},
+      {(a[1][2] * a[2][0] - a[1][0] * a[2][2]) / det, (a[0][0] * a[2][2] - a[0][2] * a[2][0]) / det, (a[0][2] * a[1][0] - a[0][0] * a[1][2]) / det},
+      {(a[1][0] * a[2][1] - a[1][1] * a[2][0]) / det, (a[0][1] * a[2][0] - a[0][0] * a[2][1]) / det, (a[0][0] * a[1][1] - a[0][1] * a[1][0]) / det}};
+
+  cal->accel_bias.x = -(inv[0][0] * c[0] + inv[0][1] * c[1] + inv[0][2] * c[2]);
+  cal->accel_bias.y = -(inv[1][0] * c[0] + inv[1][1] * c[1] + inv[1][2] * c[2]);
+  cal->accel_bias.z = -(inv[2][0] * c[0] + inv[2][1] * c[1] + inv[2][2] * c[2]);
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      cal->accel_matrix[i][j] = a[i][j];
+    }
+  }
+
+  return ESP_OK;
+}
@@ -16,6 +16,9 @@
  *                                                                           *
  *****************************************************************************/
 
+#include <math.h>
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
@@ -27,18 +30,110 @@ static const char *TAG = "ak8963";
 
 static bool initialised = false;
 static uint8_t i2c_num;
+static bool via_master = false; // Through the MPU9250 internal I2C master, see ak8963_init_slave()
 static calibration_t *cal;
 static vector_t asa;
 
-esp_err_t ak8963_init(i2c_port_t i2c_number, calibration_t *c)
+// Mounting, calibration and sensitivity adjustment in one, see ak8963_update_calibration()
+static float mounting[3][3] = {{1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, 1.0}};
+static conversion_t mag_conv;
+
+// Tracked from the last measurement mode set, see ak8963_set_cntl()
+static uint8_t output_bit = 0; // 0 or AK8963_CNTL_BIT_16
+static bool single_mode = false;
+
+#define SLV4_POLLS (20)
+#define MAG_DATA_LENGTH (8) // ST1, HXL to HZH, ST2
+
+// Start a one byte transfer over the MPU9250 I2C master, SLV4 runs once per sample.
+static esp_err_t slv4_start(bool read, uint8_t reg, uint8_t data)
+{
+  esp_err_t ret;
+  uint8_t addr = AK8963_ADDRESS | (read ? 1 << MPU9250_I2C_SLV_READ_BIT : 0);
+  if ((ret = mpu9250_write_byte(MPU9250_RA_I2C_SLV4_ADDR, addr)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_I2C_SLV4_REG, reg)) != ESP_OK)
+    return ret;
+  if (!read && (ret = mpu9250_write_byte(MPU9250_RA_I2C_SLV4_DO, data)) != ESP_OK)
+    return ret;
+  return mpu9250_write_byte(MPU9250_RA_I2C_SLV4_CTRL, 1 << MPU9250_I2C_SLV_EN_BIT);
+}
+
+// One byte over the MPU9250 I2C master, this takes up to a sample period.
+static esp_err_t slv4_transfer(bool read, uint8_t reg, uint8_t *data)
+{
+  esp_err_t ret = slv4_start(read, reg, *data);
+  if (ret != ESP_OK)
+    return ret;
+
+  for (int i = 0; i < SLV4_POLLS; i++)
+  {
+    vTaskDelay(1);
+
+    uint8_t status; // Clears on read
+    if ((ret = mpu9250_read_byte(MPU9250_RA_I2C_MST_STATUS, &status)) != ESP_OK)
+      return ret;
+    if (status & (1 << MPU9250_I2C_MST_SLV4_NACK_BIT))
+      return ESP_FAIL;
+    if (status & (1 << MPU9250_I2C_MST_SLV4_DONE_BIT))
+      return read ? mpu9250_read_byte(MPU9250_RA_I2C_SLV4_DI, data) : ESP_OK;
+  }
+
+  return ESP_ERR_TIMEOUT;
+}
+
+static esp_err_t read_bytes(uint8_t reg, uint8_t *data, size_t len)
 {
+  if (!via_master)
+  {
+    return i2c_read_bytes(i2c_num, AK8963_ADDRESS, reg, data, len);
+  }
+
+  for (size_t i = 0; i < len; i++)
+  {
+    esp_err_t ret = slv4_transfer(true, reg + i, &data[i]);
+    if (ret != ESP_OK)
+      return ret;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t read_byte(uint8_t reg, uint8_t *data)
+{
+  return read_bytes(reg, data, 1);
+}
+
+static esp_err_t write_byte(uint8_t reg, uint8_t data)
+{
+  if (!via_master)
+  {
+    return i2c_write_byte(i2c_num, AK8963_ADDRESS, reg, data);
+  }
+  return slv4_transfer(false, reg, &data);
+}
+
+// Continuous read of ST1 to ST2 into EXT_SENS_DATA_00, every sample.  Reading ST2 releases the data.
+static esp_err_t set_slv0_enabled(bool state)
+{
+  esp_err_t ret;
+  if (state)
+  {
+    if ((ret = mpu9250_write_byte(MPU9250_RA_I2C_SLV0_ADDR, AK8963_ADDRESS | 1 << MPU9250_I2C_SLV_READ_BIT)) != ESP_OK)
+      return ret;
+    if ((ret = mpu9250_write_byte(MPU9250_RA_I2C_SLV0_REG, AK8963_ST1)) != ESP_OK)
+      return ret;
+    return mpu9250_write_byte(MPU9250_RA_I2C_SLV0_CTRL, 1 << MPU9250_I2C_SLV_EN_BIT | MAG_DATA_LENGTH);
+  }
+  return mpu9250_write_byte(MPU9250_RA_I2C_SLV0_CTRL, 0);
+}
 
+static esp_err_t init(calibration_t *c)
+{
   if (initialised)
   {
     ESP_LOGE(TAG, "ak8963_init has already been called");
     return ESP_ERR_INVALID_STATE;
   }
-  i2c_num = i2c_number;
   cal = c;
 
   // connection with magnetometer
@@ -49,8 +144,13 @@ esp_err_t ak8963_init(i2c_port_t i2c_number, calibration_t *c)
   {
     ak8963_get_sensitivity_adjustment_values();
     vTaskDelay(10 / portTICK_PERIOD_MS);
-    ak8963_set_cntl(AK8963_CNTL_MODE_CONTINUE_MEASURE_2);
+    ak8963_set_mode(AK8963_MODE_CONTINUOUS_100HZ, AK8963_OUTPUT_14_BIT);
+    if (via_master)
+    {
+      set_slv0_enabled(true);
+    }
     initialised = true;
+    ak8963_update_calibration();
     return ESP_OK;
   }
   else
@@ -60,22 +160,88 @@ esp_err_t ak8963_init(i2c_port_t i2c_number, calibration_t *c)
   }
 }
 
+esp_err_t ak8963_init(i2c_port_t i2c_number, calibration_t *c)
+{
+  if (!initialised)
+  {
+    i2c_num = i2c_number;
+    via_master = false;
+  }
+  return init(c);
+}
+
+esp_err_t ak8963_init_slave(calibration_t *c)
+{
+  if (!initialised)
+  {
+    via_master = true;
+  }
+  return init(c);
+}
+
+esp_err_t ak8963_set_mounting(const float r[3][3])
+{
+  float det = r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1]) -
+              r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0]) +
+              r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+  if (fabsf(det) < 1e-6f)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  memcpy(mounting, r, sizeof(mounting));
+  ak8963_update_calibration();
+  return ESP_OK;
+}
+
+void ak8963_update_calibration(void)
+{
+  if (!initialised)
+  {
+    return;
+  }
+
+  // 16 bit output is 4 times the resolution, keep everything in 14 bit units so the calibration
+  // holds for either.
+  vector_t in_scale = asa;
+  if (output_bit)
+  {
+    in_scale.x *= 0.25f;
+    in_scale.y *= 0.25f;
+    in_scale.z *= 0.25f;
+  }
+
+  // mag = mounting * soft_iron * (raw * asa - mag_offset)
+  if (cal->mag_soft_iron[0][0] != 0.0f || cal->mag_soft_iron[1][1] != 0.0f || cal->mag_soft_iron[2][2] != 0.0f)
+  {
+    conversion_init(&mag_conv, mounting, cal->mag_soft_iron, &in_scale, &cal->mag_offset);
+  }
+  else
+  {
+    const float scale[3][3] = {
+        {cal->mag_scale.x, 0.0f, 0.0f},
+        {0.0f, cal->mag_scale.y, 0.0f},
+        {0.0f, 0.0f, cal->mag_scale.z}};
+    conversion_init(&mag_conv, mounting, scale, &in_scale, &cal->mag_offset);
+  }
+}
+
 esp_err_t ak8963_get_data_ready(bool *val)
 {
-  uint8_t bit;
-  esp_err_t ret = i2c_read_bit(i2c_num, AK8963_ADDRESS, AK8963_ST1, AK8963_ST1_DRDY_BIT, &bit);
+  uint8_t st1;
+  esp_err_t ret = via_master ? mpu9250_read_byte(MPU9250_RA_EXT_SENS_DATA_00, &st1) : read_byte(AK8963_ST1, &st1);
   if (ret != ESP_OK)
   {
     return ret;
   }
-  *val = (bit == 0x01);
+  *val = (st1 >> AK8963_ST1_DRDY_BIT) & 1;
 
   return ESP_OK;
 }
 
 esp_err_t ak8963_get_device_id(uint8_t *val)
 {
-  return i2c_read_byte(i2c_num, AK8963_ADDRESS, AK8963_WHO_AM_I, val);
+  return read_byte(AK8963_WHO_AM_I, val);
 }
 
 esp_err_t ak8963_get_sensitivity_adjustment_values()
@@ -96,15 +262,15 @@ esp_err_t ak8963_get_sensitivity_adjustment_values()
   vTaskDelay(20 / portTICK_PERIOD_MS);
 
   uint8_t xi, yi, zi;
-  ret = i2c_read_byte(i2c_num, AK8963_ADDRESS, AK8963_ASAX, &xi);
+  ret = read_byte(AK8963_ASAX, &xi);
   if (ret != ESP_OK)
     return ret;
 
-  ret = i2c_read_byte(i2c_num, AK8963_ADDRESS, AK8963_ASAY, &yi);
+  ret = read_byte(AK8963_ASAY, &yi);
   if (ret != ESP_OK)
     return ret;
 
-  ret = i2c_read_byte(i2c_num, AK8963_ADDRESS, AK8963_ASAZ, &zi);
+  ret = read_byte(AK8963_ASAZ, &zi);
   if (ret != ESP_OK)
     return ret;
 
@@ -125,16 +291,12 @@ esp_err_t ak8963_get_mag(vector_t *v)
   ret = ak8963_get_mag_raw(bytes);
   if (ret != ESP_OK)
   {
+    // A zero vector is skipped by the AHRS
+    v->x = v->y = v->z = 0.0f;
     return ret;
   }
 
-  float xi = (float)BYTE_2_INT_LE(bytes, 0);
-  float yi = (float)BYTE_2_INT_LE(bytes, 2);
-  float zi = (float)BYTE_2_INT_LE(bytes, 4);
-
-  v->x = (xi * asa.x - cal->mag_offset.x) * cal->mag_scale.x;
-  v->y = (yi * asa.y - cal->mag_offset.y) * cal->mag_scale.y;
-  v->z = (zi * asa.z - cal->mag_offset.z) * cal->mag_scale.z;
+  conversion_apply(&mag_conv, BYTE_2_INT_LE(bytes, 0), BYTE_2_INT_LE(bytes, 2), BYTE_2_INT_LE(bytes, 4), v);
   // ESP_LOGW(TAG, "mag     -> %0.4f %0.4f %0.4f", v->x, v->y, v->z);
 
   return ESP_OK;
@@ -142,28 +304,216 @@ esp_err_t ak8963_get_mag(vector_t *v)
 
 esp_err_t ak8963_get_mag_raw(uint8_t bytes[6])
 {
-  i2c_read_bytes(i2c_num, AK8963_ADDRESS, AK8963_XOUT_L, bytes, 6);
-  // ESP_LOGW(TAG, "mag raw -> %02x %02x %02x %02x %02x %02x", bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+  // ST1, HXL to HZH, ST2 in one burst.  Reading ST2 tells the AK8963 the read is done.
+  uint8_t data[MAG_DATA_LENGTH];
+  esp_err_t ret;
+  if (via_master)
+  {
+    // SLV0 keeps this fresh
+    ret = mpu9250_read_bytes(MPU9250_RA_EXT_SENS_DATA_00, data, MAG_DATA_LENGTH);
+  }
+  else
+  {
+    ret = i2c_read_bytes(i2c_num, AK8963_ADDRESS, AK8963_ST1, data, MAG_DATA_LENGTH);
+  }
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  // ESP_LOGW(TAG, "mag raw -> %02x %02x %02x %02x %02x %02x", data[1], data[2], data[3], data[4], data[5], data[6]);
+  memcpy(bytes, &data[1], 6);
 
-  // For some reason when we read ST2 (Status 2) just after reading byte, this ensures the
-  // next reading is fresh.  If we do it before without a pause, only 1 in 15 readings will
-  // be fresh.  The setTimeout ensures this read goes to the back of the queue, once all other
-  // computation is done.
-  vTaskDelay(1 / portTICK_PERIOD_MS);
-  uint8_t b;
-  i2c_read_byte(i2c_num, AK8963_ADDRESS, AK8963_ST2, &b);
+  if (single_mode)
+  {
+    // SLV0 reads ST2 every sample, so DRDY can only be checked on a direct read.
+    if (!via_master && !(data[0] & (1 << AK8963_ST1_DRDY_BIT)))
+    {
+      return ESP_ERR_NOT_FINISHED;
+    }
+
+    ret = ak8963_trigger_measurement();
+    if (ret != ESP_OK)
+    {
+      return ret;
+    }
+  }
+
+  if (data[MAG_DATA_LENGTH - 1] & (1 << AK8963_ST2_HOFL_BIT))
+  {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
 
   return ESP_OK;
 }
 
 esp_err_t ak8963_get_cntl(uint8_t *mode)
 {
-  return i2c_read_byte(i2c_num, AK8963_ADDRESS, AK8963_CNTL, mode);
+  return read_byte(AK8963_CNTL, mode);
 }
 
 esp_err_t ak8963_set_cntl(uint8_t mode)
 {
-  return i2c_write_byte(i2c_num, AK8963_ADDRESS, AK8963_CNTL, mode);
+  esp_err_t ret = write_byte(AK8963_CNTL, mode);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  // Power down, fuse ROM and self-test don't change what the next measurement mode will be.
+  uint8_t m = mode & 0x0F;
+  if (m == AK8963_CNTL_MODE_OFF || m == AK8963_CNTL_MODE_FUSE_ROM_ACCESS || m == AK8963_CNTL_MODE_SELF_TEST_MODE)
+  {
+    return ESP_OK;
+  }
+
+  single_mode = (m == AK8963_CNTL_MODE_SINGLE_MEASURE);
+  if ((mode & AK8963_CNTL_BIT_16) != output_bit)
+  {
+    output_bit = mode & AK8963_CNTL_BIT_16;
+    ak8963_update_calibration();
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t ak8963_set_mode(ak8963_mode_t mode, ak8963_output_t output)
+{
+  // The datasheet wants power down, and 100 us, between any two modes.
+  esp_err_t ret = ak8963_set_cntl(AK8963_CNTL_MODE_OFF | output);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  vTaskDelay(1);
+
+  return ak8963_set_cntl(mode | output);
+}
+
+esp_err_t ak8963_trigger_measurement(void)
+{
+  uint8_t cntl = AK8963_CNTL_MODE_SINGLE_MEASURE | output_bit;
+  if (via_master)
+  {
+    // Don't wait on it, the write goes out after the next sample.
+    return slv4_start(false, AK8963_CNTL, cntl);
+  }
+  return write_byte(AK8963_CNTL, cntl);
+}
+
+#define SELF_TEST_POLL_MS (2)
+#define SELF_TEST_POLLS (10)
+
+// AK8963 datasheet, self-test judgement, 14 bit output: {min, max} for x, y, z.  x4 for 16 bit.
+static const int16_t self_test_limits[3][2] = {{-50, 50}, {-50, 50}, {-800, -200}};
+
+esp_err_t ak8963_self_test(vector_t *field, bool pass[3])
+{
+  esp_err_t ret;
+  uint8_t mode;
+  ret = ak8963_get_cntl(&mode);
+  if (ret != ESP_OK)
+    return ret;
+  uint8_t bit = mode & AK8963_CNTL_BIT_16;
+
+  // SLV0 reads ST2, which would clear data ready before we see it.
+  if (via_master && (ret = set_slv0_enabled(false)) != ESP_OK)
+    return ret;
+
+  // Datasheet sequence: power down, set SELF, self-test mode, wait for data ready, read, clear SELF.
+  ret = ak8963_set_cntl(AK8963_CNTL_MODE_OFF | bit);
+  if (ret != ESP_OK)
+    return ret;
+  ret = write_byte(AK8963_ASTC, 1 << AK8963_ASTC_SELF_BIT);
+  if (ret != ESP_OK)
+    return ret;
+  ret = ak8963_set_cntl(AK8963_CNTL_MODE_SELF_TEST_MODE | bit);
+  if (ret != ESP_OK)
+    return ret;
+
+  bool ready = false;
+  for (int i = 0; i < SELF_TEST_POLLS && !ready; i++)
+  {
+    vTaskDelay(pdMS_TO_TICKS(SELF_TEST_POLL_MS) + 1);
+    uint8_t st1;
+    ret = read_byte(AK8963_ST1, &st1);
+    if (ret != ESP_OK)
+      break;
+    ready = (st1 >> AK8963_ST1_DRDY_BIT) & 1;
+  }
+
+  uint8_t bytes[7]; // HXL to HZH, then ST2 to finish the read
+  if (ready)
+  {
+    ret = read_bytes(AK8963_XOUT_L, bytes, 7);
+  }
+
+  // Always put it back.
+  esp_err_t ret2 = write_byte(AK8963_ASTC, 0);
+  if (ret2 == ESP_OK)
+    ret2 = ak8963_set_cntl(AK8963_CNTL_MODE_OFF | bit);
+  if (ret2 == ESP_OK)
+    ret2 = ak8963_set_cntl(mode);
+  if (ret2 == ESP_OK && via_master)
+    ret2 = set_slv0_enabled(true);
+
+  if (ret != ESP_OK)
+    return ret;
+  if (!ready)
+    return ESP_ERR_TIMEOUT;
+  if (ret2 != ESP_OK)
+    return ret2;
+
+  field->x = BYTE_2_INT_LE(bytes, 0) * asa.x;
+  field->y = BYTE_2_INT_LE(bytes, 2) * asa.y;
+  field->z = BYTE_2_INT_LE(bytes, 4) * asa.z;
+
+  int scale = bit ? 4 : 1;
+  float f[3] = {field->x, field->y, field->z};
+  for (int i = 0; i < 3; i++)
+  {
+    pass[i] = f[i] >= self_test_limits[i][0] * scale && f[i] <= self_test_limits[i][1] * scale;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t ak8963_get_config(ak8963_config_t *config)
+{
+  esp_err_t ret = read_byte(AK8963_WHO_AM_I, &config->wia);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  return read_bytes(AK8963_CNTL, &config->cntl1, 3);
+}
+
+int ak8963_config_diff(const ak8963_config_t *expected, const ak8963_config_t *actual, uint8_t *reg)
+{
+  const struct
+  {
+    uint8_t reg;
+    uint8_t e, a;
+  } regs[] = {
+      {AK8963_WHO_AM_I, expected->wia, actual->wia},
+      {AK8963_CNTL, expected->cntl1, actual->cntl1},
+      {AK8963_ASTC, expected->astc, actual->astc},
+  };
+
+  int count = 0;
+  for (int i = 0; i < sizeof(regs) / sizeof(regs[0]); i++)
+  {
+    if (regs[i].e == regs[i].a)
+    {
+      continue;
+    }
+    if (count == 0 && reg != NULL)
+    {
+      *reg = regs[i].reg;
+    }
+    count++;
+  }
+
+  return count;
 }
 
 void ak8963_print_settings(void)
@@ -183,20 +533,20 @@ void ak8963_print_settings(void)
                         "0x0C Invalid mode",
                         "0x0D Invalid mode",
                         "0x0E Invalid mode",
-                        "0x0F Invalid mode",
                         "0x0F (Fuse ROM access mode)"};
 
-  uint8_t device_id;
-  ESP_ERROR_CHECK(ak8963_get_device_id(&device_id));
-
-  uint8_t cntl;
-  ESP_ERROR_CHECK(ak8963_get_cntl(&cntl));
+  ak8963_config_t config;
+  ESP_ERROR_CHECK(ak8963_get_config(&config));
 
   ESP_LOGI(TAG, "Magnetometer (Compass):");
-  ESP_LOGI(TAG, "--> i2c address: 0x%02d", i2c_num);
+  if (via_master)
+    ESP_LOGI(TAG, "--> Bus: MPU9250 I2C master");
+  else
+    ESP_LOGI(TAG, "--> i2c address: 0x%02d", i2c_num);
   ESP_LOGI(TAG, "--> initialised: %s", initialised ? "true" : "false");
-  ESP_LOGI(TAG, "--> Device ID: 0x%02x", device_id);
-  ESP_LOGI(TAG, "--> Mode: %s", cntl_modes[cntl]);
+  ESP_LOGI(TAG, "--> Device ID: 0x%02x", config.wia);
+  ESP_LOGI(TAG, "--> Mode: %s", cntl_modes[config.cntl1 & 0x0F]);
+  ESP_LOGI(TAG, "--> Output: %s", (config.cntl1 & AK8963_CNTL_BIT_16) ? "16 bit" : "14 bit");
   ESP_LOGI(TAG, "--> ASA Scalars:");
   ESP_LOGI(TAG, "  --> x: %f", asa.x);
   ESP_LOGI(TAG, "  --> y: %f", asa.y);
@@ -209,4 +559,9 @@ void ak8963_print_settings(void)
   ESP_LOGI(TAG, "  --> x: %f", cal->mag_scale.x);
   ESP_LOGI(TAG, "  --> y: %f", cal->mag_scale.y);
   ESP_LOGI(TAG, "  --> z: %f", cal->mag_scale.z);
+  ESP_LOGI(TAG, "--> Soft Iron:");
+  for (int i = 0; i < 3; i++)
+  {
+    ESP_LOGI(TAG, "  --> %f %f %f", cal->mag_soft_iron[i][0], cal->mag_soft_iron[i][1], cal->mag_soft_iron[i][2]);
+  }
 }
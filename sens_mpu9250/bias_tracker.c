@@ -0,0 +1,124 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "bias_tracker.h"
+
+static const char *TAG = "bias_tracker";
+
+void bias_tracker_init(bias_tracker_t *bt, calibration_t *cal, const bias_tracker_config_t *config)
+{
+  memset(bt, 0, sizeof(bias_tracker_t));
+  bt->config = *config;
+  bt->cal = cal;
+
+  // The variance needs at least two samples
+  if (bt->config.window < 2)
+  {
+    bt->config.window = 2;
+  }
+}
+
+static void welford(float x, uint32_t n, float *mean, float *m2)
+{
+  float delta = x - *mean;
+  *mean += delta / n;
+  *m2 += delta * (x - *mean);
+}
+
+static void welford_vector(const vector_t *v, uint32_t n, vector_t *mean, vector_t *m2)
+{
+  welford(v->x, n, &mean->x, &m2->x);
+  welford(v->y, n, &mean->y, &m2->y);
+  welford(v->z, n, &mean->z, &m2->z);
+}
+
+bool bias_tracker_update(bias_tracker_t *bt, const vector_t *va, const vector_t *vg)
+{
+  bt->n += 1;
+  welford_vector(vg, bt->n, &bt->g_mean, &bt->g_m2);
+  welford_vector(va, bt->n, &bt->a_mean, &bt->a_m2);
+
+  if (bt->n < bt->config.window)
+  {
+    return false;
+  }
+
+  float g_var = (bt->g_m2.x + bt->g_m2.y + bt->g_m2.z) / (bt->n - 1);
+  float a_var = (bt->a_m2.x + bt->a_m2.y + bt->a_m2.z) / (bt->n - 1);
+  float a_norm = sqrtf(bt->a_mean.x * bt->a_mean.x + bt->a_mean.y * bt->a_mean.y + bt->a_mean.z * bt->a_mean.z);
+  vector_t residual = bt->g_mean;
+
+  bool steady = g_var < bt->config.gyro_var_max &&
+                a_var < bt->config.accel_var_max &&
+                fabsf(a_norm - 1.0f) < bt->config.accel_norm_tol;
+
+  // A slow tilt keeps the variance low but moves gravity from one window to the next.
+  bool level = false;
+  if (steady && bt->a_last_valid)
+  {
+    float dot = bt->a_mean.x * bt->a_last.x + bt->a_mean.y * bt->a_last.y + bt->a_mean.z * bt->a_last.z;
+    float last_norm = sqrtf(bt->a_last.x * bt->a_last.x + bt->a_last.y * bt->a_last.y + bt->a_last.z * bt->a_last.z);
+    level = dot > cosf(bt->config.accel_dir_tol_deg * (float)M_PI / 180.0f) * a_norm * last_norm;
+  }
+  bt->still = steady && level;
+  bt->a_last = bt->a_mean;
+  bt->a_last_valid = steady;
+
+  // Start the next window
+  bt->n = 0;
+  memset(&bt->g_mean, 0, sizeof(vector_t));
+  memset(&bt->g_m2, 0, sizeof(vector_t));
+  memset(&bt->a_mean, 0, sizeof(vector_t));
+  memset(&bt->a_m2, 0, sizeof(vector_t));
+
+  if (!bt->still)
+  {
+    return false;
+  }
+  bt->still_windows += 1;
+
+  if (fabsf(residual.x) > bt->config.max_residual_dps ||
+      fabsf(residual.y) > bt->config.max_residual_dps ||
+      fabsf(residual.z) > bt->config.max_residual_dps)
+  {
+    ESP_LOGD(TAG, "Still, but residual (%f, %f, %f) is too large for bias", residual.x, residual.y, residual.z);
+    return false;
+  }
+
+  // The samples already had the bias applied, so move the bias against what is left.
+  // The samples are in body axes if a mounting is set, the bias is in sensor axes.
+  // Unlocked, see bias_tracker.h: a reader in another task may see the axes half updated.
+  mpu9250_body_to_sensor(&residual);
+  bt->cal->gyro_bias_offset.x -= bt->config.alpha * residual.x;
+  bt->cal->gyro_bias_offset.y -= bt->config.alpha * residual.y;
+  bt->cal->gyro_bias_offset.z -= bt->config.alpha * residual.z;
+  bt->updates += 1;
+
+  ESP_LOGD(TAG, "Bias offset now (%f, %f, %f)", bt->cal->gyro_bias_offset.x, bt->cal->gyro_bias_offset.y, bt->cal->gyro_bias_offset.z);
+  return true;
+}
+
+bool bias_tracker_is_still(const bias_tracker_t *bt)
+{
+  return bt->still;
+}
@@ -25,7 +25,14 @@
 #include "esp_err.h"
 #include "esp_task_wdt.h"
 
+#include <math.h>
+#include <string.h>
+
+#include "magcal.h"
+
 #include "mpu9250.h"
+#include "calibrate.h"
+#include "accel_cal.h"
 #include "common.h"
 
 const char *TAG = "calibrate";
@@ -39,6 +46,11 @@ static calibration_t cal = {
     .accel_scale_hi = {.x = 1.0, .y = 1.0, .z = 1.0},
     .gyro_bias_offset = {.x = 0.0, .y = 0.0, .z = 0.0}};
 
+void calibrate_get_calibration(calibration_t *c)
+{
+  *c = cal;
+}
+
 void wait(void)
 {
   for (int i = 10; i >= 0; i -= 1)
@@ -79,6 +91,9 @@ void calibrate_gyro(void)
   init_imu(false);
 
   ESP_LOGI(TAG, "--- GYRO CALIBRATION ---");
+
+  // Measure without any earlier result applied.
+  cal.gyro_bias_offset.x = cal.gyro_bias_offset.y = cal.gyro_bias_offset.z = 0.0f;
   ESP_LOGW(TAG, "Keep the MPU very still.  Calculating gyroscope bias");
   wait();
 
@@ -107,147 +122,397 @@ void calibrate_gyro(void)
   vg_sum.x /= -NUM_GYRO_READS;
   vg_sum.y /= -NUM_GYRO_READS;
   vg_sum.z /= -NUM_GYRO_READS;
+  cal.gyro_bias_offset = vg_sum;
 
   printf("    .gyro_bias_offset = {.x = %f, .y = %f, .z = %f}\n", vg_sum.x, vg_sum.y, vg_sum.z);
 }
 
 /**
- * 
- * ACCELEROMETER 
- * 
- * 
- * Calibrate the Accelerometer.  This device will need to be rotated with the X, Y and Z axes up and down.  The axis
- * you point up/down will be calibrated against gravity (so you must have it vertical).  You may want to hold it against
- * a wall or similar.  While the one axis is being calibrated against gravity, the other two axes will be perpendicular
- * to gravity, so will read near zero, this value will be used as the offset.
  *
- * The scaling is simple linear scaling, based on the common formular for a line, y = m * x + c, where y is our scaled
- * and offset result, while x is the raw value.  This formular is actually applied in the main mpu9250.js file.  But
- * this calibration process outputs those values.
+ * GYROSCOPE, FAST
+ *
+ *
+ * Runs the gyro at its 1 kHz DLPF rate and drains the FIFO in bursts, rather than pacing single
+ * reads with mpu_pause().  Only the gyro goes into the FIFO (6 bytes a sample) so the 512 byte FIFO
+ * holds 85 ms, plenty of margin for the poll interval.
  */
 
-#define NUM_ACCEL_READS (1000.0)
+#define FAST_GYRO_RATE_Hz (1000)
+#define FAST_GYRO_BYTES_PER_SAMPLE (6)
+#define FAST_GYRO_SETTLE_SAMPLES (50) // Let the DLPF settle after the rate change
+#define FAST_GYRO_POLL_MS (20)
+#define FAST_GYRO_CHUNK_SAMPLES (32)
 
-#define X_AXIS (0)
-#define Y_AXIS (1)
-#define Z_AXIS (2)
-const char *axes[] = {"X", "Y", "Z"};
+typedef struct
+{
+  uint8_t smplrt_div;
+  uint8_t config;
+  uint8_t fifo_en;
+  uint8_t user_ctrl;
+} fifo_settings_t;
 
-#define DIR_UP (0)
-#define DIR_DOWN (1)
-const char *directions[] = {
-    "up",
-    "down"};
+static esp_err_t fast_gyro_capture(const gyro_fast_cal_config_t *config, gyro_fast_cal_result_t *result, double mean[3], double m2[3])
+{
+  uint8_t buf[FAST_GYRO_CHUNK_SAMPLES * FAST_GYRO_BYTES_PER_SAMPLE];
+  uint32_t skip = FAST_GYRO_SETTLE_SAMPLES;
+  uint32_t n = 0;
 
-vector_t offset = {.x = 0, .y = 0, .z = 0};
-vector_t scale_lo = {.x = 0, .y = 0, .z = 0};
-vector_t scale_hi = {.x = 0, .y = 0, .z = 0};
+  // Allow twice the nominal time before deciding the FIFO has stalled.
+  TickType_t start = xTaskGetTickCount();
+  TickType_t timeout = pdMS_TO_TICKS(2 * (config->samples + skip) * 1000 / FAST_GYRO_RATE_Hz) + 2;
 
-/**
- * This will syncronuously read the accel data from MPU9250.  It will gather the offset and scalar values.
- */
-void calibrate_accel_axis(int axis, int dir)
-{
-  vector_t va;
+  esp_err_t ret = mpu9250_fifo_reset();
+  if (ret != ESP_OK)
+    return ret;
 
-  ESP_LOGI(TAG, "Reading values - hold still");
-  for (int i = 0; i < NUM_ACCEL_READS; i++)
+  while (n < config->samples)
   {
-    get_accel(&va);
+    if (xTaskGetTickCount() - start > timeout)
+      return ESP_ERR_TIMEOUT;
 
-    if (axis == X_AXIS)
-    {
-      if (dir == DIR_UP)
-      {
-        scale_lo.x += va.x;
-      }
-      else
-      {
-        scale_hi.x += va.x;
-      }
-    }
-    else
+    vTaskDelay(pdMS_TO_TICKS(FAST_GYRO_POLL_MS) + 1);
+
+    uint16_t count;
+    ret = mpu9250_fifo_count(&count);
+    if (ret != ESP_OK)
+      return ret;
+
+    // A full FIFO has dropped samples and may be misaligned, start again from empty.
+    if (count > MPU9250_FIFO_SIZE - FAST_GYRO_BYTES_PER_SAMPLE)
     {
-      offset.y += va.y;
-      offset.z += va.z;
+      result->overflows += 1;
+      ret = mpu9250_fifo_reset();
+      if (ret != ESP_OK)
+        return ret;
+      continue;
     }
 
-    if (axis == Y_AXIS)
+    uint32_t available = count / FAST_GYRO_BYTES_PER_SAMPLE;
+    while (available > 0 && n < config->samples)
     {
-      if (dir == DIR_UP)
-      {
-        scale_lo.y += va.y;
-      }
-      else
+      uint32_t chunk = available < FAST_GYRO_CHUNK_SAMPLES ? available : FAST_GYRO_CHUNK_SAMPLES;
+      ret = mpu9250_fifo_read(buf, chunk * FAST_GYRO_BYTES_PER_SAMPLE);
+      if (ret != ESP_OK)
+        return ret;
+      available -= chunk;
+
+      for (uint32_t i = 0; i < chunk && n < config->samples; i++)
       {
-        scale_hi.y += va.y;
+        if (skip > 0)
+        {
+          skip -= 1;
+          continue;
+        }
+
+        // Welford, in raw counts
+        n += 1;
+        for (int axis = 0; axis < 3; axis++)
+        {
+          double x = BYTE_2_INT_BE(buf, i * FAST_GYRO_BYTES_PER_SAMPLE + 2 * axis);
+          double d = x - mean[axis];
+          mean[axis] += d / n;
+          m2[axis] += d * (x - mean[axis]);
+        }
       }
     }
-    else
+  }
+
+  result->samples = n;
+  return ESP_OK;
+}
+
+static esp_err_t fifo_settings_save(fifo_settings_t *saved)
+{
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_SMPLRT_DIV, &saved->smplrt_div);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_read_byte(MPU9250_RA_CONFIG, &saved->config);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_read_byte(MPU9250_RA_FIFO_EN, &saved->fifo_en);
+  if (ret != ESP_OK)
+    return ret;
+  return mpu9250_read_byte(MPU9250_RA_USER_CTRL, &saved->user_ctrl);
+}
+
+/**
+ * Every register is written even if an earlier one fails, the first error is returned.
+ */
+static esp_err_t fifo_settings_restore(const fifo_settings_t *saved)
+{
+  esp_err_t ret = ESP_OK;
+  esp_err_t err;
+
+  err = mpu9250_write_byte(MPU9250_RA_FIFO_EN, saved->fifo_en);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_USER_CTRL, saved->user_ctrl);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_fifo_reset();
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_CONFIG, saved->config);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_SMPLRT_DIV, saved->smplrt_div);
+  ret = ret != ESP_OK ? ret : err;
+
+  return ret;
+}
+
+/**
+ * 1 kHz, 184 Hz bandwidth, gyro only into the FIFO.  FIFO_MODE = 0 so a full FIFO keeps the newest
+ * data, which an overflow flush then throws away anyway.
+ */
+static esp_err_t fast_gyro_setup(void)
+{
+  esp_err_t ret = mpu9250_write_byte(MPU9250_RA_SMPLRT_DIV, 0);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_CONFIG, MPU9250_DLPF_CFG_184HZ);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_FIFO_EN, (1 << MPU9250_FIFO_GYRO_XOUT_BIT) | (1 << MPU9250_FIFO_GYRO_YOUT_BIT) | (1 << MPU9250_FIFO_GYRO_ZOUT_BIT));
+  if (ret != ESP_OK)
+    return ret;
+  return mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_FIFO_EN_BIT, 1, 1);
+}
+
+esp_err_t calibrate_gyro_fast(const gyro_fast_cal_config_t *config, gyro_fast_cal_result_t *result)
+{
+  if (config->samples < 2)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  init_imu(false);
+  memset(result, 0, sizeof(gyro_fast_cal_result_t));
+
+  uint8_t range;
+  esp_err_t ret = get_full_scale_gyro_range(&range);
+  if (ret != ESP_OK)
+    return ret;
+  float inv_scale = get_gyro_inv_scale(range);
+
+  fifo_settings_t saved;
+  ret = fifo_settings_save(&saved);
+  if (ret != ESP_OK)
+    return ret;
+
+  double mean[3] = {0.0, 0.0, 0.0};
+  double m2[3] = {0.0, 0.0, 0.0};
+  TickType_t start = xTaskGetTickCount();
+  ret = fast_gyro_setup();
+  if (ret == ESP_OK)
+  {
+    ret = fast_gyro_capture(config, result, mean, m2);
+  }
+  result->elapsed_ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+
+  // Put everything back, whatever happened.  A failed setup may have changed some registers.
+  esp_err_t restore_ret = fifo_settings_restore(&saved);
+  if (ret == ESP_OK)
+  {
+    ret = restore_ret;
+  }
+  if (ret == ESP_OK)
+  {
+    ret = get_temperature_celsius(&result->temperature);
+  }
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  uint32_t n = result->samples;
+  result->bias_offset.x = -mean[0] * inv_scale;
+  result->bias_offset.y = -mean[1] * inv_scale;
+  result->bias_offset.z = -mean[2] * inv_scale;
+  result->std_dps.x = sqrt(m2[0] / (n - 1)) * inv_scale;
+  result->std_dps.y = sqrt(m2[1] / (n - 1)) * inv_scale;
+  result->std_dps.z = sqrt(m2[2] / (n - 1)) * inv_scale;
+
+  result->still = result->std_dps.x < config->max_std_dps &&
+                  result->std_dps.y < config->max_std_dps &&
+                  result->std_dps.z < config->max_std_dps;
+
+  ESP_LOGD(TAG, "Fast gyro: %u samples in %u ms, std (%f, %f, %f)", (unsigned)n, (unsigned)result->elapsed_ms,
+           result->std_dps.x, result->std_dps.y, result->std_dps.z);
+
+  return result->still ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+/**
+ *
+ * GYROSCOPE TEMPERATURE MODEL
+ *
+ *
+ * Fit g(T) = c0 + c1 * dT + c2 * dT^2 + c3 * dT^3 per axis, with dT = T - t_ref.  Only the sums for
+ * the normal equations are kept, so a sweep of any length can be streamed through.  The bias is the
+ * negative of the fitted rate.
+ */
+
+void gyro_temp_fit_init(gyro_temp_fit_t *f, float t_ref)
+{
+  memset(f, 0, sizeof(gyro_temp_fit_t));
+  f->t_ref = t_ref;
+}
+
+void gyro_temp_fit_add(gyro_temp_fit_t *f, float temp, const vector_t *vg)
+{
+  double dt = temp - f->t_ref;
+  double p = 1.0;
+  for (int k = 0; k <= 2 * GYRO_TEMP_POLY_ORDER; k++)
+  {
+    f->s[k] += p;
+    if (k <= GYRO_TEMP_POLY_ORDER)
     {
-      offset.x += va.x;
-      offset.z += va.z;
+      f->sx[k] += vg->x * p;
+      f->sy[k] += vg->y * p;
+      f->sz[k] += vg->z * p;
     }
+    p *= dt;
+  }
+  f->n += 1;
+}
+
+#define N_TEMP_TERMS (GYRO_TEMP_POLY_ORDER + 1)
+
+/**
+ * Solve A x = b in place, Gaussian elimination with partial pivoting.
+ */
+static bool solve_normal_equations(double a[N_TEMP_TERMS][N_TEMP_TERMS], double b[N_TEMP_TERMS])
+{
+  double scale = 0.0;
+  for (int r = 0; r < N_TEMP_TERMS; r++)
+    for (int c = 0; c < N_TEMP_TERMS; c++)
+      scale = fmax(scale, fabs(a[r][c]));
 
-    if (axis == Z_AXIS)
+  for (int c = 0; c < N_TEMP_TERMS; c++)
+  {
+    int pivot = c;
+    for (int r = c + 1; r < N_TEMP_TERMS; r++)
     {
-      if (dir == DIR_UP)
-      {
-        scale_lo.z += va.z;
-      }
-      else
-      {
-        scale_hi.z += va.z;
-      }
+      if (fabs(a[r][c]) > fabs(a[pivot][c]))
+        pivot = r;
     }
-    else
+    if (fabs(a[pivot][c]) <= 1e-12 * scale)
+      return false;
+
+    for (int k = 0; k < N_TEMP_TERMS; k++)
     {
-      offset.x += va.x;
-      offset.y += va.y;
+      double t = a[c][k];
+      a[c][k] = a[pivot][k];
+      a[pivot][k] = t;
     }
+    double t = b[c];
+    b[c] = b[pivot];
+    b[pivot] = t;
 
-    vTaskDelay(5 / portTICK_PERIOD_MS);
+    for (int r = c + 1; r < N_TEMP_TERMS; r++)
+    {
+      double m = a[r][c] / a[c][c];
+      for (int k = c; k < N_TEMP_TERMS; k++)
+        a[r][k] -= m * a[c][k];
+      b[r] -= m * b[c];
+    }
   }
+
+  for (int r = N_TEMP_TERMS - 1; r >= 0; r--)
+  {
+    for (int k = r + 1; k < N_TEMP_TERMS; k++)
+      b[r] -= a[r][k] * b[k];
+    b[r] /= a[r][r];
+  }
+  return true;
 }
 
-/**
- * Set up the next capture for an axis and a direction (up / down).
- */
-void run_next_capture(int axis, int dir)
+static bool fit_axis(const gyro_temp_fit_t *f, const double *sg, double coeff[N_TEMP_TERMS])
 {
-  ESP_LOGW(TAG, "Point the %s axis arrow %s.", axes[axis], directions[dir]);
+  double a[N_TEMP_TERMS][N_TEMP_TERMS];
+  for (int r = 0; r < N_TEMP_TERMS; r++)
+  {
+    for (int c = 0; c < N_TEMP_TERMS; c++)
+      a[r][c] = f->s[r + c];
+    coeff[r] = sg[r];
+  }
+  return solve_normal_equations(a, coeff);
+}
 
-  wait();
-  calibrate_accel_axis(axis, dir);
+esp_err_t gyro_temp_fit_solve(const gyro_temp_fit_t *f, calibration_t *cal)
+{
+  double cx[N_TEMP_TERMS], cy[N_TEMP_TERMS], cz[N_TEMP_TERMS];
+
+  if (f->n < N_TEMP_TERMS || !fit_axis(f, f->sx, cx) || !fit_axis(f, f->sy, cy) || !fit_axis(f, f->sz, cz))
+  {
+    ESP_LOGE(TAG, "Not enough temperature range to fit the gyro bias model");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  cal->gyro_temp_ref = f->t_ref;
+  cal->gyro_bias_offset.x = -cx[0];
+  cal->gyro_bias_offset.y = -cy[0];
+  cal->gyro_bias_offset.z = -cz[0];
+  for (int k = 0; k < GYRO_TEMP_POLY_ORDER; k++)
+  {
+    cal->gyro_temp_coeff[k].x = -cx[k + 1];
+    cal->gyro_temp_coeff[k].y = -cy[k + 1];
+    cal->gyro_temp_coeff[k].z = -cz[k + 1];
+  }
+
+  return ESP_OK;
 }
 
+/**
+ * 
+ * ACCELEROMETER 
+ * 
+ * 
+ * Calibrate the Accelerometer.  Place the device on each of its six faces, in any order, and hold it still.  You may
+ * want to hold it against a wall or similar.  Each face is picked up automatically once the readings settle, so there
+ * is no countdown; just move on to the next face once it is logged.
+ *
+ * The six averages are fitted with least squares (see accel_cal.h), which gives a bias and a full 3x3 matrix, so
+ * cross-axis misalignment is corrected as well as the offset and scale of each axis:
+ *   accel = accel_matrix * (raw - accel_bias)
+ */
+
+static const char *pose_names[] = {"X up", "X down", "Y up", "Y down", "Z up", "Z down"};
+
 void calibrate_accel(void)
 {
   init_imu(false);
 
   ESP_LOGI(TAG, "--- ACCEL CALIBRATION ---");
+  ESP_LOGW(TAG, "Place the device on each of its six faces and hold it still.");
+
+  accel_cal_config_t config = ACCEL_CAL_DEFAULT_CONFIG(SAMPLE_FREQ_Hz);
+  accel_cal_t ac;
+  accel_cal_init(&ac, &config);
+
+  vector_t va;
+  while (!accel_cal_is_complete(&ac))
+  {
+    ESP_ERROR_CHECK(get_accel_raw(&va));
+
+    int pose = accel_cal_add_sample(&ac, &va);
+    if (pose >= 0)
+    {
+      ESP_LOGI(TAG, "Got %s, %d to go.", pose_names[pose], ACCEL_CAL_NUM_POSES - __builtin_popcount(ac.captured));
+    }
+
+    mpu_pause();
+  }
+
+  if (accel_cal_solve(&ac, &cal) != ESP_OK)
+  {
+    ESP_LOGE(TAG, "The accel fit failed, try again.");
+    return;
+  }
+  mpu9250_update_calibration();
 
-  run_next_capture(X_AXIS, DIR_UP);
-  run_next_capture(X_AXIS, DIR_DOWN);
-  run_next_capture(Y_AXIS, DIR_UP);
-  run_next_capture(Y_AXIS, DIR_DOWN);
-  run_next_capture(Z_AXIS, DIR_UP);
-  run_next_capture(Z_AXIS, DIR_DOWN);
-
-  offset.x /= (NUM_ACCEL_READS * 4.0);
-  offset.y /= (NUM_ACCEL_READS * 4.0);
-  offset.z /= (NUM_ACCEL_READS * 4.0);
-  scale_lo.x /= NUM_ACCEL_READS;
-  scale_lo.y /= NUM_ACCEL_READS;
-  scale_lo.z /= NUM_ACCEL_READS;
-  scale_hi.x /= NUM_ACCEL_READS;
-  scale_hi.y /= NUM_ACCEL_READS;
-  scale_hi.z /= NUM_ACCEL_READS;
-
-  printf("    .accel_offset = {.x = %f, .y = %f, .z = %f},\n    .accel_scale_lo = {.x = %f, .y = %f, .z = %f},\n    .accel_scale_hi = {.x = %f, .y = %f, .z = %f},\n",
-         offset.x, offset.y, offset.z,
-         scale_lo.x, scale_lo.y, scale_lo.z,
-         scale_hi.x, scale_hi.y, scale_hi.z);
+  printf("    .accel_bias = {.x = %f, .y = %f, .z = %f},\n    .accel_matrix = {{%f, %f, %f}, {%f, %f, %f}, {%f, %f, %f}},\n",
+         cal.accel_bias.x, cal.accel_bias.y, cal.accel_bias.z,
+         cal.accel_matrix[0][0], cal.accel_matrix[0][1], cal.accel_matrix[0][2],
+         cal.accel_matrix[1][0], cal.accel_matrix[1][1], cal.accel_matrix[1][2],
+         cal.accel_matrix[2][0], cal.accel_matrix[2][1], cal.accel_matrix[2][2]);
 }
 
 /**
@@ -255,62 +520,70 @@ void calibrate_accel(void)
  * MAGNETOMETER
  * 
  * 
- * Once the calibration is started you will want to move the sensor around all axes.  What we want is to find the
- * extremes (min/max) of the x, y, z values such that we can find the offset and scale values.
- *
- * These calibration calculations are based on this page:
- * http://www.camelsoftware.com/2016/03/13/imu-maths-calculate-orientation-pt3/
+ * Once the calibration is started you will want to move the sensor around all axes.  The samples are
+ * fitted to an ellipsoid (see magcal.h), which gives the hard iron offset and a full soft iron
+ * matrix.  Samples far from the current fit are rejected, so a single bad reading can't spoil it.
  */
 
-#define MIN(a, b) (a < b ? a : b)
-#define MAX(a, b) (a > b ? a : b)
+#define MAG_OUTLIER_GATE (0.25f) // Reject samples more than 25% off the fitted radius
+#define MAG_SOLVE_EVERY (100)
 
 void calibrate_mag(void)
 {
-
-  vector_t v_min = {
-      .x = 9.9e99,
-      .y = 9.9e99,
-      .z = 9.9e99};
-  vector_t v_max = {
-      .x = -9.9e99,
-      .y = -9.9e99,
-      .z = -9.9e99};
-
   const int NUM_MAG_READS = 2000;
 
+  magcal_t mc;
+  magcal_result_t result = {0};
+  magcal_init(&mc, MAG_OUTLIER_GATE);
+
   init_imu(true);
 
-  ESP_LOGW(TAG, "Rotate the magnometer around all 3 axes, until the min and max values don't change anymore.");
+  // Measure without any earlier result applied.
+  cal.mag_offset.x = cal.mag_offset.y = cal.mag_offset.z = 0.0f;
+  cal.mag_scale.x = cal.mag_scale.y = cal.mag_scale.z = 1.0f;
+  memset(cal.mag_soft_iron, 0, sizeof(cal.mag_soft_iron));
+  mpu9250_update_calibration();
 
-  printf("    x        y        z      min x     min y     min z     max x     max y     max z\n");
+  ESP_LOGW(TAG, "Rotate the magnometer around all 3 axes, until the fit error doesn't change anymore.");
+
+  printf("    x        y        z      radius    fit error  rejected\n");
   for (int i = 0; i < NUM_MAG_READS; i += 1)
   {
     vector_t vm;
-    get_mag(&vm);
-    v_min.x = MIN(v_min.x, vm.x);
-    v_min.y = MIN(v_min.y, vm.y);
-    v_min.z = MIN(v_min.z, vm.z);
-    v_max.x = MAX(v_max.x, vm.x);
-    v_max.y = MAX(v_max.y, vm.y);
-    v_max.z = MAX(v_max.z, vm.z);
+    if (get_mag(&vm) == ESP_OK)
+    {
+      magcal_add_sample(&mc, vm.x, vm.y, vm.z);
+    }
 
-    printf(" %0.3f    %0.3f    %0.3f    %0.3f   %0.3f   %0.3f   %0.3f   %0.3f   %0.3f       \r", vm.x, vm.y, vm.z, v_min.x, v_min.y, v_min.z, v_max.x, v_max.y, v_max.z);
+    if (i % MAG_SOLVE_EVERY == MAG_SOLVE_EVERY - 1)
+    {
+      magcal_solve(&mc, &result);
+    }
+
+    printf(" %0.3f    %0.3f    %0.3f    %0.3f   %0.4f   %u       \r", vm.x, vm.y, vm.z, result.field_strength, result.fit_error, (unsigned)mc.rejected);
 
     vTaskDelay(10 / portTICK_PERIOD_MS);
   }
 
-  vector_t v_avg = {
-      .x = (v_max.x - v_min.x) / 2.0,
-      .y = (v_max.y - v_min.y) / 2.0,
-      .z = (v_max.z - v_min.z) / 2.0};
-  float avg_radius = (v_avg.x + v_avg.y + v_avg.z) / 3.0;
-  vector_t v_scale = {
-      .x = avg_radius / v_avg.x,
-      .y = avg_radius / v_avg.y,
-      .z = avg_radius / v_avg.z};
-
   printf("\n");
-  printf("    .mag_offset = {.x = %f, .y = %f, .z = %f},\n", (v_min.x + v_max.x) / 2, (v_min.y + v_max.y) / 2, (v_min.z + v_max.z) / 2);
-  printf("    .mag_scale = {.x = %f, .y = %f, .z = %f},\n", v_scale.x, v_scale.y, v_scale.z);
+  if (!magcal_solve(&mc, &result))
+  {
+    ESP_LOGE(TAG, "Magnetometer fit failed, rotate the device through more orientations.");
+    return;
+  }
+
+  cal.mag_offset.x = result.offset[0];
+  cal.mag_offset.y = result.offset[1];
+  cal.mag_offset.z = result.offset[2];
+  cal.mag_scale.x = cal.mag_scale.y = cal.mag_scale.z = 1.0f;
+  memcpy(cal.mag_soft_iron, result.soft_iron, sizeof(cal.mag_soft_iron));
+  mpu9250_update_calibration();
+
+  ESP_LOGI(TAG, "Fit error %0.2f%%, %u samples, %u rejected", result.fit_error * 100.0f, (unsigned)result.samples, (unsigned)result.rejected);
+  printf("    .mag_offset = {.x = %f, .y = %f, .z = %f},\n", result.offset[0], result.offset[1], result.offset[2]);
+  printf("    .mag_scale = {.x = 1.0, .y = 1.0, .z = 1.0},\n");
+  printf("    .mag_soft_iron = {{%f, %f, %f}, {%f, %f, %f}, {%f, %f, %f}},\n",
+         result.soft_iron[0][0], result.soft_iron[0][1], result.soft_iron[0][2],
+         result.soft_iron[1][0], result.soft_iron[1][1], result.soft_iron[1][2],
+         result.soft_iron[2][0], result.soft_iron[2][1], result.soft_iron[2][2]);
 }
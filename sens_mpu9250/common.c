@@ -18,24 +18,48 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_log.h"
 
 #include "common.h"
 
-void mpu_pause(void)
-{
+static const char *TAG = "mpu_pause";
 
-  static uint64_t start = 0;
-  uint64_t end = xTaskGetTickCount() * 1000 / configTICK_RATE_HZ;
+static sampler_t sampler;
+static bool sampler_started = false;
 
-  if (start == 0)
+void mpu_pause(void)
+{
+  if (!sampler_started)
   {
-    start = xTaskGetTickCount() / configTICK_RATE_HZ;
+    esp_err_t ret = sampler_init(&sampler, SAMPLE_FREQ_Hz);
+    if (ret == ESP_OK)
+    {
+      ret = sampler_start(&sampler);
+      if (ret != ESP_OK)
+      {
+        sampler_deinit(&sampler);
+      }
+    }
+    if (ret != ESP_OK)
+    {
+      // Keep the caller running at roughly the right rate, and try again next time.
+      ESP_LOGE(TAG, "Failed to start the sampler: %s", esp_err_to_name(ret));
+      vTaskDelay(SAMPLE_INTERVAL_MS / portTICK_PERIOD_MS > 0 ? SAMPLE_INTERVAL_MS / portTICK_PERIOD_MS : 1);
+      return;
+    }
+    sampler_started = true;
   }
 
-  int32_t elapsed = end - start;
-  if (elapsed < SAMPLE_INTERVAL_MS)
+  // A timeout (the timer stopped, or this isn't the task that started the sampler) has already
+  // waited a few periods, so carry on.
+  esp_err_t ret = sampler_wait(&sampler);
+  if (ret != ESP_OK)
   {
-    vTaskDelay((SAMPLE_INTERVAL_MS - elapsed) / portTICK_PERIOD_MS);
+    ESP_LOGW(TAG, "sampler_wait: %s", esp_err_to_name(ret));
   }
-  start = xTaskGetTickCount() * 1000 / configTICK_RATE_HZ;
+}
+
+void mpu_pause_get_stats(sampler_stats_t *stats)
+{
+  sampler_get_stats(&sampler, stats);
 }
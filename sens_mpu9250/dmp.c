@@ -0,0 +1,265 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "mpu9250.h"
+#include "dmp.h"
+
+static const char *TAG = "dmp";
+
+#define DMP_MAX_PACKET_SIZE (32)
+#define DMP_RESET_MS (50)
+#define Q30 (1073741824.0f)
+
+static const mpu9250_dmp_firmware_t *firmware = NULL;
+
+static esp_err_t set_mem_addr(uint16_t addr)
+{
+  // BANK_SEL and MEM_START_ADDR are next to each other
+  uint8_t bytes[2] = {addr >> 8, addr & 0xFF};
+  return mpu9250_write_bytes(MPU9250_RA_BANK_SEL, bytes, 2);
+}
+
+/**
+ * Bytes that can be transferred from `addr` in one go, without crossing a bank.
+ */
+static size_t chunk_len(uint16_t addr, size_t remaining)
+{
+  size_t len = MPU9250_DMP_MEMORY_BANK_SIZE - (addr & 0xFF);
+  if (len > MPU9250_DMP_MEMORY_CHUNK_SIZE)
+    len = MPU9250_DMP_MEMORY_CHUNK_SIZE;
+  if (len > remaining)
+    len = remaining;
+  return len;
+}
+
+esp_err_t mpu9250_dmp_write_mem(uint16_t addr, const uint8_t *data, size_t len)
+{
+  while (len > 0)
+  {
+    size_t n = chunk_len(addr, len);
+    esp_err_t ret = set_mem_addr(addr);
+    if (ret != ESP_OK)
+      return ret;
+    ret = mpu9250_write_bytes(MPU9250_RA_MEM_R_W, data, n);
+    if (ret != ESP_OK)
+      return ret;
+
+    addr += n;
+    data += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+esp_err_t mpu9250_dmp_read_mem(uint16_t addr, uint8_t *data, size_t len)
+{
+  while (len > 0)
+  {
+    size_t n = chunk_len(addr, len);
+    esp_err_t ret = set_mem_addr(addr);
+    if (ret != ESP_OK)
+      return ret;
+    ret = mpu9250_read_bytes(MPU9250_RA_MEM_R_W, data, n);
+    if (ret != ESP_OK)
+      return ret;
+
+    addr += n;
+    data += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+/**
+ * Write and read back, a chunk at a time.
+ */
+static esp_err_t write_verified(uint16_t addr, const uint8_t *data, size_t len)
+{
+  uint8_t check[MPU9250_DMP_MEMORY_CHUNK_SIZE];
+
+  while (len > 0)
+  {
+    size_t n = chunk_len(addr, len);
+    esp_err_t ret = mpu9250_dmp_write_mem(addr, data, n);
+    if (ret != ESP_OK)
+      return ret;
+    ret = mpu9250_dmp_read_mem(addr, check, n);
+    if (ret != ESP_OK)
+      return ret;
+    if (memcmp(data, check, n) != 0)
+    {
+      ESP_LOGE(TAG, "Verify failed at 0x%04x", addr);
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    addr += n;
+    data += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+esp_err_t mpu9250_dmp_load_firmware(const mpu9250_dmp_firmware_t *fw)
+{
+  if (fw->image == NULL || fw->size == 0 || fw->size > 0x10000 ||
+      fw->packet_size > DMP_MAX_PACKET_SIZE || fw->quat_offset + 16 > fw->packet_size || fw->base_rate_hz == 0)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  firmware = NULL;
+  esp_err_t ret = write_verified(0, fw->image, fw->size);
+  if (ret != ESP_OK)
+    return ret;
+
+  uint8_t start[2] = {fw->start_addr >> 8, fw->start_addr & 0xFF};
+  ret = mpu9250_write_bytes(MPU9250_RA_DMP_CFG_1, start, 2);
+  if (ret != ESP_OK)
+    return ret;
+
+  firmware = fw;
+  ESP_LOGI(TAG, "Loaded %u bytes", (unsigned)fw->size);
+  return ESP_OK;
+}
+
+esp_err_t mpu9250_dmp_configure(const mpu9250_dmp_config_t *config)
+{
+  if (firmware == NULL)
+    return ESP_ERR_INVALID_STATE;
+  if (config->rate_hz == 0 || config->rate_hz > firmware->base_rate_hz || firmware->base_rate_hz % config->rate_hz != 0)
+    return ESP_ERR_INVALID_ARG;
+
+  for (size_t i = 0; i < config->num_features; i++)
+  {
+    const mpu9250_dmp_patch_t *p = &config->features[i];
+    esp_err_t ret = write_verified(p->addr, p->data, p->len);
+    if (ret != ESP_OK)
+      return ret;
+  }
+
+  uint16_t div = firmware->base_rate_hz / config->rate_hz - 1;
+  uint8_t bytes[2] = {div >> 8, div & 0xFF};
+  return write_verified(firmware->rate_addr, bytes, 2);
+}
+
+esp_err_t mpu9250_dmp_enable(bool enable)
+{
+  if (firmware == NULL)
+    return ESP_ERR_INVALID_STATE;
+
+  esp_err_t ret;
+  if (!enable)
+  {
+    if ((ret = mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_DMP_EN_BIT, 1, 0)) != ESP_OK)
+      return ret;
+    if ((ret = mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_FIFO_EN_BIT, 1, 0)) != ESP_OK)
+      return ret;
+    if ((ret = mpu9250_write_byte(MPU9250_RA_INT_ENABLE, 0)) != ESP_OK)
+      return ret;
+    return mpu9250_fifo_reset();
+  }
+
+  if ((ret = mpu9250_set_autorange(NULL)) != ESP_OK)
+    return ret;
+  if ((ret = set_full_scale_gyro_range(MPU9250_GYRO_FS_2000)) != ESP_OK)
+    return ret;
+  if ((ret = set_full_scale_accel_range(MPU9250_ACCEL_FS_2)) != ESP_OK)
+    return ret;
+
+  // DLPF on (42 Hz), so the 1 kHz internal rate divides down to the DMP rate.
+  if ((ret = mpu9250_write_bits(MPU9250_RA_CONFIG, MPU9250_CONFIG_DLPF_CFG_BIT, MPU9250_CONFIG_DLPF_CFG_LENGTH, 3)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_SMPLRT_DIV, 1000 / firmware->base_rate_hz - 1)) != ESP_OK)
+    return ret;
+
+  // The DMP writes the FIFO itself, no raw sensor data.
+  if ((ret = mpu9250_write_byte(MPU9250_RA_FIFO_EN, 0)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_INT_ENABLE, 1 << MPU9250_INT_DMP_BIT)) != ESP_OK)
+    return ret;
+
+  if ((ret = mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_DMP_RESET_BIT, 1, 1)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_fifo_reset()) != ESP_OK)
+    return ret;
+  vTaskDelay(pdMS_TO_TICKS(DMP_RESET_MS) + 1);
+
+  if ((ret = mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_FIFO_EN_BIT, 1, 1)) != ESP_OK)
+    return ret;
+  return mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_DMP_EN_BIT, 1, 1);
+}
+
+static int32_t q30_be(const uint8_t *b)
+{
+  return (int32_t)(((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3]);
+}
+
+esp_err_t mpu9250_dmp_read_quat(mpu9250_dmp_quat_t *q, size_t max, size_t *count)
+{
+  *count = 0;
+  if (firmware == NULL)
+    return ESP_ERR_INVALID_STATE;
+
+  uint16_t bytes;
+  esp_err_t ret = mpu9250_fifo_count(&bytes);
+  if (ret != ESP_OK)
+    return ret;
+
+  // A full FIFO has dropped data and may be misaligned.
+  if (bytes > MPU9250_FIFO_SIZE - firmware->packet_size)
+  {
+    ESP_LOGW(TAG, "FIFO overflow");
+    mpu9250_fifo_reset();
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  uint8_t packet[DMP_MAX_PACKET_SIZE];
+  size_t packets = bytes / firmware->packet_size;
+  while (packets > 0 && *count < max)
+  {
+    ret = mpu9250_fifo_read(packet, firmware->packet_size);
+    if (ret != ESP_OK)
+      return ret;
+    packets -= 1;
+
+    const uint8_t *p = &packet[firmware->quat_offset];
+    mpu9250_dmp_quat_t *out = &q[*count];
+    out->w = q30_be(&p[0]) / Q30;
+    out->x = q30_be(&p[4]) / Q30;
+    out->y = q30_be(&p[8]) / Q30;
+    out->z = q30_be(&p[12]) / Q30;
+
+    float mag_sq = out->w * out->w + out->x * out->x + out->y * out->y + out->z * out->z;
+    if (mag_sq < 0.75f || mag_sq > 1.25f)
+    {
+      ESP_LOGW(TAG, "Bad quaternion, resetting the FIFO");
+      mpu9250_fifo_reset();
+      return ESP_ERR_INVALID_RESPONSE;
+    }
+    *count += 1;
+  }
+
+  return ESP_OK;
+}
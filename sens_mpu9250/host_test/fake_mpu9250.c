@@ -0,0 +1,268 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <string.h>
+
+#include "mpu9250.h"
+#include "ak8963.h"
+#include "fake_mpu9250.h"
+
+#define MPU9250_WHO_AM_I_RESPONSE (0x71)
+
+static bool master_enabled(const fake_mpu9250_t *f)
+{
+  return (f->regs[MPU9250_RA_USER_CTRL] >> MPU9250_USERCTRL_I2C_MST_EN_BIT) & 1;
+}
+
+static void log_access(fake_mpu9250_t *f, bool write, uint8_t reg, const uint8_t *data, size_t len)
+{
+  if (f->log_len == FAKE_LOG_SIZE)
+  {
+    f->log_full = true;
+    return;
+  }
+  fake_access_t *a = &f->log[f->log_len++];
+  a->write = write;
+  a->reg = reg;
+  a->len = len;
+  memcpy(a->data, data, len < FAKE_LOG_DATA ? len : FAKE_LOG_DATA);
+}
+
+static uint8_t ak_read(fake_mpu9250_t *f, uint8_t reg)
+{
+  f->ak_reads += 1;
+  if (reg >= sizeof(f->ak))
+  {
+    return 0;
+  }
+  uint8_t value = f->ak[reg];
+  if (reg == AK8963_ST2)
+  {
+    // Reading ST2 ends the data read
+    f->ak[AK8963_ST1] &= ~(1 << AK8963_ST1_DRDY_BIT);
+  }
+  return value;
+}
+
+static void ak_write(fake_mpu9250_t *f, uint8_t reg, uint8_t value)
+{
+  f->ak_writes += 1;
+  if (reg == AK8963_CNTL || reg == AK8963_CNTL2 || reg == AK8963_ASTC)
+  {
+    f->ak[reg] = value;
+  }
+}
+
+static bool ak_addressed(const fake_mpu9250_t *f, uint8_t addr)
+{
+  return (addr & ~(1 << MPU9250_I2C_SLV_READ_BIT)) == AK8963_ADDRESS && !f->ak_nack;
+}
+
+static void run_slv4(fake_mpu9250_t *f)
+{
+  f->slv4_pending = false;
+  f->slv4_transfers += 1;
+  f->regs[MPU9250_RA_I2C_SLV4_CTRL] &= ~(1 << MPU9250_I2C_SLV_EN_BIT);
+
+  uint8_t addr = f->regs[MPU9250_RA_I2C_SLV4_ADDR];
+  uint8_t reg = f->regs[MPU9250_RA_I2C_SLV4_REG];
+  if (!ak_addressed(f, addr))
+  {
+    f->regs[MPU9250_RA_I2C_MST_STATUS] |= 1 << MPU9250_I2C_MST_SLV4_NACK_BIT;
+  }
+  else if (addr & (1 << MPU9250_I2C_SLV_READ_BIT))
+  {
+    f->regs[MPU9250_RA_I2C_SLV4_DI] = ak_read(f, reg);
+  }
+  else
+  {
+    ak_write(f, reg, f->regs[MPU9250_RA_I2C_SLV4_DO]);
+  }
+  f->regs[MPU9250_RA_I2C_MST_STATUS] |= 1 << MPU9250_I2C_MST_SLV4_DONE_BIT;
+}
+
+static void run_slv0(fake_mpu9250_t *f)
+{
+  uint8_t ctrl = f->regs[MPU9250_RA_I2C_SLV0_CTRL];
+  uint8_t addr = f->regs[MPU9250_RA_I2C_SLV0_ADDR];
+  if (!(ctrl & (1 << MPU9250_I2C_SLV_EN_BIT)) || !(addr & (1 << MPU9250_I2C_SLV_READ_BIT)) || !ak_addressed(f, addr))
+  {
+    return;
+  }
+
+  uint8_t reg = f->regs[MPU9250_RA_I2C_SLV0_REG];
+  for (int i = 0; i < (ctrl & 0x0F); i++)
+  {
+    f->regs[MPU9250_RA_EXT_SENS_DATA_00 + i] = ak_read(f, reg + i);
+  }
+}
+
+static uint16_t mem_addr(const fake_mpu9250_t *f)
+{
+  return f->regs[MPU9250_RA_BANK_SEL] << 8 | f->regs[MPU9250_RA_MEM_START_ADDR];
+}
+
+static void reset(fake_mpu9250_t *f)
+{
+  memset(f->regs, 0, sizeof(f->regs));
+  f->regs[MPU9250_WHO_AM_I] = MPU9250_WHO_AM_I_RESPONSE;
+  f->regs[MPU9250_RA_PWR_MGMT_1] = 0x01;
+  f->slv4_pending = false;
+}
+
+static void write_reg(fake_mpu9250_t *f, uint8_t reg, uint8_t value)
+{
+  switch (reg)
+  {
+  case MPU9250_RA_PWR_MGMT_1:
+    if (value & (1 << MPU9250_PWR1_DEVICE_RESET_BIT))
+    {
+      reset(f);
+      return;
+    }
+    break;
+  case MPU9250_RA_MEM_R_W:
+    f->mem[mem_addr(f)] = value;
+    f->regs[MPU9250_RA_MEM_START_ADDR] += 1; // Wraps within the bank
+    return;
+  case MPU9250_RA_I2C_SLV4_CTRL:
+    if (value & (1 << MPU9250_I2C_SLV_EN_BIT))
+    {
+      f->slv4_pending = true;
+      f->slv4_wait = f->slv4_latency;
+    }
+    break;
+  case MPU9250_RA_I2C_MST_STATUS:
+  case MPU9250_WHO_AM_I:
+    return; // Read only
+  }
+  f->regs[reg & 0x7F] = value;
+}
+
+static uint8_t read_reg(fake_mpu9250_t *f, uint8_t reg)
+{
+  uint8_t value;
+  switch (reg)
+  {
+  case MPU9250_RA_MEM_R_W:
+    value = f->mem[mem_addr(f)];
+    if (mem_addr(f) == f->mem_corrupt_addr)
+    {
+      value ^= 0x01;
+    }
+    f->regs[MPU9250_RA_MEM_START_ADDR] += 1;
+    return value;
+  case MPU9250_RA_I2C_MST_STATUS:
+    f->status_reads += 1;
+    if (f->slv4_pending && !f->slv4_stuck && master_enabled(f))
+    {
+      if (f->slv4_wait > 0)
+      {
+        f->slv4_wait -= 1;
+      }
+      else
+      {
+        run_slv4(f);
+      }
+    }
+    value = f->regs[reg];
+    f->regs[reg] = 0;
+    return value;
+  }
+  return f->regs[reg & 0x7F];
+}
+
+static esp_err_t fake_read(void *ctx, uint8_t reg, uint8_t *data, size_t len)
+{
+  fake_mpu9250_t *f = ctx;
+  for (size_t i = 0; i < len; i++)
+  {
+    // A burst increments the register, except on MEM_R_W where the memory address increments
+    data[i] = read_reg(f, reg == MPU9250_RA_MEM_R_W ? reg : reg + i);
+  }
+  log_access(f, false, reg, data, len);
+  return ESP_OK;
+}
+
+static esp_err_t fake_write(void *ctx, uint8_t reg, const uint8_t *data, size_t len)
+{
+  fake_mpu9250_t *f = ctx;
+  log_access(f, true, reg, data, len);
+  for (size_t i = 0; i < len; i++)
+  {
+    write_reg(f, reg == MPU9250_RA_MEM_R_W ? reg : reg + i, data[i]);
+  }
+  return ESP_OK;
+}
+
+void fake_mpu9250_init(fake_mpu9250_t *f)
+{
+  memset(f, 0, sizeof(*f));
+  reset(f);
+  f->mem_corrupt_addr = -1;
+
+  f->ak[AK8963_WHO_AM_I] = AK8963_WHO_AM_I_RESPONSE;
+  f->ak[AK8963_ASAX] = 128;
+  f->ak[AK8963_ASAY] = 128;
+  f->ak[AK8963_ASAZ] = 128;
+}
+
+void fake_mpu9250_transport(fake_mpu9250_t *f, mpu9250_bus_t bus, mpu9250_transport_t *t)
+{
+  t->bus = bus;
+  t->read = fake_read;
+  t->write = fake_write;
+  t->ctx = f;
+}
+
+void fake_mpu9250_sample(fake_mpu9250_t *f)
+{
+  if (!master_enabled(f))
+  {
+    return;
+  }
+  run_slv0(f);
+  if (f->slv4_pending && !f->slv4_stuck)
+  {
+    run_slv4(f);
+  }
+}
+
+void fake_ak8963_measure(fake_mpu9250_t *f, int16_t x, int16_t y, int16_t z, bool overflow)
+{
+  int16_t v[3] = {x, y, z};
+  for (int i = 0; i < 3; i++)
+  {
+    f->ak[AK8963_XOUT_L + 2 * i] = (uint16_t)v[i] & 0xFF;
+    f->ak[AK8963_XOUT_H + 2 * i] = (uint16_t)v[i] >> 8;
+  }
+  f->ak[AK8963_ST1] |= 1 << AK8963_ST1_DRDY_BIT;
+  f->ak[AK8963_ST2] = (overflow ? 1 << AK8963_ST2_HOFL_BIT : 0) |
+                      (f->ak[AK8963_CNTL] & AK8963_CNTL_BIT_16 ? 1 << AK8963_ST2_BITM_BIT : 0);
+
+  if ((f->ak[AK8963_CNTL] & 0x0F) == AK8963_CNTL_MODE_SINGLE_MEASURE)
+  {
+    f->ak[AK8963_CNTL] &= AK8963_CNTL_BIT_16;
+  }
+}
+
+void fake_mpu9250_clear_log(fake_mpu9250_t *f)
+{
+  f->log_len = 0;
+  f->log_full = false;
+}
@@ -0,0 +1,99 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __FAKE_MPU9250_H
+#define __FAKE_MPU9250_H
+
+#include "transport.h"
+
+/**
+ * A register level MPU9250 behind an mpu9250_transport_t, for host tests.  It models what the
+ * driver relies on:
+ *
+ *   - the register file, with the address incrementing over a burst and DEVICE_RESET;
+ *   - DMP memory through BANK_SEL / MEM_START_ADDR / MEM_R_W, the start address increments
+ *     within the bank like the real part;
+ *   - an AK8963 on the auxiliary bus, reached by the internal I2C master.  SLV4 runs a single byte
+ *     transfer and reports DONE or NACK in I2C_MST_STATUS (cleared on read), SLV0 copies AK8963
+ *     registers into EXT_SENS_DATA_00.  Both run in fake_mpu9250_sample(), SLV4 also completes
+ *     when I2C_MST_STATUS is polled.
+ *
+ * Every transaction is logged so a test can check the sequence.
+ */
+
+#define FAKE_LOG_SIZE (4096)
+#define FAKE_LOG_DATA (16)
+
+typedef struct
+{
+  bool write;
+  uint8_t reg;
+  size_t len;
+  uint8_t data[FAKE_LOG_DATA]; // The first FAKE_LOG_DATA bytes
+} fake_access_t;
+
+typedef struct
+{
+  uint8_t regs[128];
+  uint8_t mem[0x10000]; // DMP memory, 256 banks
+  uint8_t ak[0x13];     // AK8963 registers, WIA to ASAZ
+
+  // Faults
+  bool ak_nack;         // The AK8963 doesn't acknowledge
+  bool slv4_stuck;      // SLV4 never finishes
+  int slv4_latency;     // I2C_MST_STATUS reads before a started SLV4 transfer is done
+  int mem_corrupt_addr; // Flip a bit when this DMP address is read, -1 for none
+
+  // What happened
+  bool slv4_pending;
+  int slv4_wait;
+  int slv4_transfers;
+  int status_reads;
+  int ak_reads; // Single AK8963 register accesses, over SLV4 or by SLV0
+  int ak_writes;
+
+  fake_access_t log[FAKE_LOG_SIZE];
+  size_t log_len;
+  bool log_full; // Later transactions were not logged
+} fake_mpu9250_t;
+
+/**
+ * Power on state, WHO_AM_I 0x71 and an AK8963 with WIA 0x48.
+ */
+void fake_mpu9250_init(fake_mpu9250_t *f);
+
+/**
+ * A transport on `f` that claims to be `bus`.  MPU9250_BUS_SPI makes the driver use the internal
+ * I2C master for the AK8963.
+ */
+void fake_mpu9250_transport(fake_mpu9250_t *f, mpu9250_bus_t bus, mpu9250_transport_t *t);
+
+/**
+ * One sample period: run SLV0 then SLV4, like the I2C master does after each sample.
+ */
+void fake_mpu9250_sample(fake_mpu9250_t *f);
+
+/**
+ * A new AK8963 measurement, in raw counts.  Sets DRDY, and HOFL if `overflow`.  A single
+ * measurement puts the AK8963 back into power down.
+ */
+void fake_ak8963_measure(fake_mpu9250_t *f, int16_t x, int16_t y, int16_t z, bool overflow);
+
+void fake_mpu9250_clear_log(fake_mpu9250_t *f);
+
+#endif // __FAKE_MPU9250_H
@@ -0,0 +1,143 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * The ESP-IDF functions the driver links against, for host tests.  There is no I2C or SPI hardware,
+ * register access goes through the fake transport in fake_mpu9250.c instead.
+ */
+
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "driver/spi_master.h"
+
+static TickType_t ticks = 0;
+
+void vTaskDelay(TickType_t t)
+{
+  ticks += t;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  return ticks;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+  return code == ESP_OK ? "ESP_OK" : "ERROR";
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+  return malloc(size);
+}
+
+void heap_caps_free(void *ptr)
+{
+  free(ptr);
+}
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+  return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level)
+{
+  return ESP_OK;
+}
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode, size_t rx_buf, size_t tx_buf, int flags)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+i2c_cmd_handle_t i2c_cmd_link_create(void)
+{
+  return NULL;
+}
+
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd)
+{
+}
+
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd)
+{
+  return ESP_OK;
+}
+
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd)
+{
+  return ESP_OK;
+}
+
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, bool ack_en)
+{
+  return ESP_OK;
+}
+
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, const uint8_t *data, size_t len, bool ack_en)
+{
+  return ESP_OK;
+}
+
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t *data, size_t len, int ack)
+{
+  return ESP_OK;
+}
+
+// Every I2C transaction fails, nothing is on the bus
+esp_err_t i2c_master_cmd_begin(i2c_port_t port, i2c_cmd_handle_t cmd, TickType_t t)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *config, spi_device_handle_t *handle)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+  return ESP_OK;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *trans)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t spi_device_acquire_bus(spi_device_handle_t handle, TickType_t wait)
+{
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+void spi_device_release_bus(spi_device_handle_t handle)
+{
+}
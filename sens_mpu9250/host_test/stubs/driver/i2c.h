@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+
+typedef int i2c_port_t;
+#define I2C_NUM_0 (0)
+#define I2C_NUM_1 (1)
+
+typedef void *i2c_cmd_handle_t;
+typedef enum
+{
+  I2C_MODE_SLAVE,
+  I2C_MODE_MASTER
+} i2c_mode_t;
+
+#define I2C_MASTER_WRITE (0)
+#define I2C_MASTER_READ (1)
+
+typedef struct
+{
+  i2c_mode_t mode;
+  int sda_io_num;
+  int scl_io_num;
+  int sda_pullup_en;
+  int scl_pullup_en;
+  struct
+  {
+    uint32_t clk_speed;
+  } master;
+} i2c_config_t;
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *config);
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode, size_t rx_buf, size_t tx_buf, int flags);
+i2c_cmd_handle_t i2c_cmd_link_create(void);
+void i2c_cmd_link_delete(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, bool ack_en);
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, const uint8_t *data, size_t len, bool ack_en);
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t *data, size_t len, int ack);
+esp_err_t i2c_master_cmd_begin(i2c_port_t port, i2c_cmd_handle_t cmd, TickType_t ticks);
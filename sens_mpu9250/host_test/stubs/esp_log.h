@@ -0,0 +1,16 @@
+#pragma once
+#include <stdio.h>
+
+// Errors and warnings are printed, the rest only checked against the format
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOG_QUIET(tag, format, ...)   \
+  do                                      \
+  {                                       \
+    if (0)                                \
+      printf(format, ##__VA_ARGS__);      \
+    (void)(tag);                          \
+  } while (0)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_QUIET(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_QUIET(tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_QUIET(tag, format, ##__VA_ARGS__)
@@ -0,0 +1,6 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+// There is no scheduler, a delay only moves the tick count on
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
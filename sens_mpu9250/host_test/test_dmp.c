@@ -0,0 +1,186 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * Host test of the DMP firmware upload in dmp.c, against the fake MPU9250 in fake_mpu9250.c.
+ * Built by the host branch of sens_mpu9250/CMakeLists.txt.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mpu9250.h"
+#include "dmp.h"
+#include "transport.h"
+#include "fake_mpu9250.h"
+
+#define IMAGE_SIZE (3062) // As the MotionDriver 6.12 image, the last chunk is short
+#define START_ADDR (0x0400)
+#define RATE_ADDR (0x0AC6)
+
+static fake_mpu9250_t fake;
+static uint8_t image[IMAGE_SIZE];
+static int failures = 0;
+
+static const mpu9250_dmp_firmware_t firmware = {
+    .image = image,
+    .size = IMAGE_SIZE,
+    .start_addr = START_ADDR,
+    .rate_addr = RATE_ADDR,
+    .base_rate_hz = 200,
+    .packet_size = 32,
+    .quat_offset = 0,
+};
+
+static void check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+  {
+    failures++;
+  }
+}
+
+// Small deterministic generator, so the image is the same on every host.
+static uint32_t rng_state = 1;
+
+static uint8_t random_byte(void)
+{
+  rng_state = rng_state * 1664525u + 1013904223u;
+  return rng_state >> 24;
+}
+
+static void reset_fake(void)
+{
+  fake_mpu9250_init(&fake);
+  mpu9250_transport_t t;
+  fake_mpu9250_transport(&fake, MPU9250_BUS_I2C, &t);
+  mpu9250_set_transport(&t);
+}
+
+static bool is_access(const fake_access_t *a, bool write, uint8_t reg, size_t len)
+{
+  return a->write == write && a->reg == reg && a->len == len;
+}
+
+static bool is_mem_addr(const fake_access_t *a, uint16_t addr)
+{
+  return is_access(a, true, MPU9250_RA_BANK_SEL, 2) && a->data[0] == addr >> 8 && a->data[1] == (addr & 0xFF);
+}
+
+/**
+ * Check the log from `*i` holds a verified write of `data` to `addr`: for each chunk, BANK_SEL and
+ * MEM_START_ADDR then MEM_R_W written, then the same address set and MEM_R_W read back.  Chunks
+ * must be no more than 16 bytes and not cross `boundary`.
+ */
+static bool check_upload(size_t *i, uint16_t addr, const uint8_t *data, size_t len, size_t boundary)
+{
+  while (len > 0)
+  {
+    if (*i + 4 > fake.log_len)
+      return false;
+    const fake_access_t *a = &fake.log[*i];
+    size_t n = a[1].len;
+    if (n == 0 || n > len || n > MPU9250_DMP_MEMORY_CHUNK_SIZE || addr / boundary != (addr + n - 1) / boundary)
+      return false;
+    if (!is_mem_addr(&a[0], addr) || !is_access(&a[1], true, MPU9250_RA_MEM_R_W, n) || memcmp(a[1].data, data, n) != 0 ||
+        !is_mem_addr(&a[2], addr) || !is_access(&a[3], false, MPU9250_RA_MEM_R_W, n))
+      return false;
+
+    *i += 4;
+    addr += n;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void test_load(void)
+{
+  reset_fake();
+  check(mpu9250_dmp_load_firmware(&firmware) == ESP_OK, "load the firmware");
+  check(!fake.log_full, "every transaction was logged");
+  check(memcmp(fake.mem, image, IMAGE_SIZE) == 0, "the image is in DMP memory");
+
+  size_t i = 0;
+  check(check_upload(&i, 0, image, IMAGE_SIZE, MPU9250_DMP_MEMORY_CHUNK_SIZE),
+        "written and read back in chunks that don't cross 16 bytes");
+  check(i == 4 * ((IMAGE_SIZE + 15) / 16), "one chunk per 16 bytes");
+
+  const fake_access_t *a = &fake.log[i];
+  check(i + 1 == fake.log_len && is_access(a, true, MPU9250_RA_DMP_CFG_1, 2) && a->data[0] == START_ADDR >> 8 &&
+            a->data[1] == (START_ADDR & 0xFF),
+        "then the start address to DMP_CFG_1 and DMP_CFG_2");
+  check(fake.regs[MPU9250_RA_DMP_CFG_1] == START_ADDR >> 8 && fake.regs[MPU9250_RA_DMP_CFG_2] == (START_ADDR & 0xFF),
+        "the start address is set");
+
+  // A patch across a bank is split there
+  static const uint8_t data[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+  const mpu9250_dmp_patch_t patch = {.addr = 0x01F8, .len = sizeof(data), .data = data};
+  const mpu9250_dmp_config_t config = {.rate_hz = 50, .features = &patch, .num_features = 1};
+  fake_mpu9250_clear_log(&fake);
+  check(mpu9250_dmp_configure(&config) == ESP_OK, "configure a feature and the rate");
+  i = 0;
+  check(check_upload(&i, patch.addr, data, sizeof(data), MPU9250_DMP_MEMORY_BANK_SIZE) && i == 8,
+        "the patch is split at the bank");
+  static const uint8_t divider[2] = {0, 3};
+  check(check_upload(&i, RATE_ADDR, divider, 2, MPU9250_DMP_MEMORY_BANK_SIZE) && i == fake.log_len,
+        "then the 200 / (3 + 1) Hz rate divider");
+}
+
+static void test_verify(void)
+{
+  reset_fake();
+  fake.mem_corrupt_addr = 0x0123;
+  check(mpu9250_dmp_load_firmware(&firmware) == ESP_ERR_INVALID_RESPONSE, "a corrupted byte fails the load");
+
+  // Stopped at the chunk that didn't read back, and the DMP doesn't get a start address
+  const fake_access_t *last = &fake.log[fake.log_len - 1];
+  check(is_access(last, false, MPU9250_RA_MEM_R_W, 16) && is_mem_addr(last - 1, 0x0120), "the load stops at that chunk");
+  check(fake.regs[MPU9250_RA_DMP_CFG_1] == 0 && fake.regs[MPU9250_RA_DMP_CFG_2] == 0, "no start address is set");
+
+  const mpu9250_dmp_config_t config = {.rate_hz = 50};
+  check(mpu9250_dmp_configure(&config) == ESP_ERR_INVALID_STATE, "the DMP can't be configured after a failed load");
+}
+
+static void test_invalid(void)
+{
+  reset_fake();
+  mpu9250_dmp_firmware_t fw = firmware;
+  fw.size = 0;
+  check(mpu9250_dmp_load_firmware(&fw) == ESP_ERR_INVALID_ARG, "an empty image is rejected");
+  fw = firmware;
+  fw.quat_offset = 20;
+  check(mpu9250_dmp_load_firmware(&fw) == ESP_ERR_INVALID_ARG, "a quaternion past the packet is rejected");
+  check(fake.log_len == 0, "without touching the bus");
+}
+
+int main(void)
+{
+  for (size_t i = 0; i < IMAGE_SIZE; i++)
+  {
+    image[i] = random_byte();
+  }
+
+  test_load();
+  test_verify();
+  test_invalid();
+
+  printf("%d failure(s)\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+/**
+ * Host test of the SPI wiring, where the AK8963 is reached through the MPU9250 internal I2C master
+ * (see ak8963_init_slave()), against the fake MPU9250 in fake_mpu9250.c.  Built by the host branch
+ * of sens_mpu9250/CMakeLists.txt:
+ *
+ *   cmake -S sens_mpu9250 -B build && cmake --build build && ctest --test-dir build
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "mpu9250.h"
+#include "ak8963.h"
+#include "transport.h"
+#include "fake_mpu9250.h"
+
+#define SLV4_POLLS (20) // As ak8963.c
+
+static fake_mpu9250_t fake;
+static calibration_t cal;
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+  {
+    failures++;
+  }
+}
+
+static bool near(const vector_t *v, float x, float y, float z)
+{
+  return fabsf(v->x - x) < 1e-3f && fabsf(v->y - y) < 1e-3f && fabsf(v->z - z) < 1e-3f;
+}
+
+static void test_init(void)
+{
+  fake_mpu9250_init(&fake);
+  fake.ak[AK8963_ASAX] = 192; // Sensitivity adjustment 1.25
+  fake.ak[AK8963_ASAY] = 64;  // 0.75
+  fake.slv4_latency = 2;
+
+  mpu9250_transport_t t;
+  fake_mpu9250_transport(&fake, MPU9250_BUS_SPI, &t);
+  check(mpu9250_set_transport(&t) == ESP_OK, "set the transport");
+
+  cal.mag_scale.x = cal.mag_scale.y = cal.mag_scale.z = 1.0f;
+  check(i2c_mpu9250_init(&cal, true) == ESP_OK, "init over SPI with the magnetometer");
+  check(mpu9250_set_transport(&t) == ESP_ERR_INVALID_STATE, "the transport can't change after init");
+
+  uint8_t user_ctrl = fake.regs[MPU9250_RA_USER_CTRL];
+  check((user_ctrl >> MPU9250_USERCTRL_I2C_IF_DIS_BIT) & 1, "the I2C slave interface is off");
+  check((user_ctrl >> MPU9250_USERCTRL_I2C_MST_EN_BIT) & 1, "the I2C master is on");
+  check(fake.ak[AK8963_CNTL] == (AK8963_MODE_CONTINUOUS_100HZ | AK8963_OUTPUT_14_BIT),
+        "the AK8963 is in continuous 100 Hz mode");
+
+  // Nothing has sampled yet, so every AK8963 access so far went through SLV4
+  check(fake.slv4_transfers > 0 && fake.slv4_transfers == fake.ak_reads + fake.ak_writes,
+        "every AK8963 access is one single byte SLV4 transfer");
+  check(fake.status_reads == (fake.slv4_latency + 1) * fake.slv4_transfers,
+        "each transfer polls I2C_MST_STATUS until DONE");
+
+  check(fake.regs[MPU9250_RA_I2C_SLV0_ADDR] == (AK8963_ADDRESS | 1 << MPU9250_I2C_SLV_READ_BIT) &&
+            fake.regs[MPU9250_RA_I2C_SLV0_REG] == AK8963_ST1 &&
+            fake.regs[MPU9250_RA_I2C_SLV0_CTRL] == (1 << MPU9250_I2C_SLV_EN_BIT | 8),
+        "SLV0 reads the 8 bytes ST1 to ST2");
+
+  fake.slv4_latency = 0;
+}
+
+static void test_slv0(void)
+{
+  bool ready;
+  vector_t v;
+
+  fake_ak8963_measure(&fake, 100, -200, 300, false);
+  check(ak8963_get_data_ready(&ready) == ESP_OK && !ready, "no data before the I2C master has run");
+
+  fake_mpu9250_sample(&fake);
+  check(ak8963_get_data_ready(&ready) == ESP_OK && ready, "ST1 is mirrored into EXT_SENS_DATA_00");
+  check(memcmp(&fake.regs[MPU9250_RA_EXT_SENS_DATA_00 + 1], &fake.ak[AK8963_XOUT_L], 6) == 0 &&
+            fake.regs[MPU9250_RA_EXT_SENS_DATA_00 + 7] == fake.ak[AK8963_ST2],
+        "HXL to ST2 are mirrored after it");
+  check(!(fake.ak[AK8963_ST1] & (1 << AK8963_ST1_DRDY_BIT)), "reading ST2 released the AK8963 data");
+
+  check(ak8963_get_mag(&v) == ESP_OK && near(&v, 125.0f, -150.0f, 300.0f),
+        "the mirrored data is scaled by the ASA values read over SLV4");
+
+  fake_mpu9250_sample(&fake);
+  check(ak8963_get_data_ready(&ready) == ESP_OK && !ready, "no data ready until the next measurement");
+
+  fake_ak8963_measure(&fake, 4000, 4000, 4000, true);
+  fake_mpu9250_sample(&fake);
+  check(ak8963_get_mag(&v) == ESP_ERR_INVALID_RESPONSE && near(&v, 0.0f, 0.0f, 0.0f),
+        "an overflow in the mirrored ST2 is reported");
+}
+
+static void test_slv4(void)
+{
+  uint8_t mode;
+  int transfers = fake.slv4_transfers;
+  check(ak8963_set_cntl(AK8963_CNTL_MODE_CONTINUE_MEASURE_1) == ESP_OK &&
+            fake.ak[AK8963_CNTL] == AK8963_CNTL_MODE_CONTINUE_MEASURE_1,
+        "write a register over SLV4");
+  check(fake.slv4_transfers == transfers + 1 && fake.regs[MPU9250_RA_I2C_SLV4_ADDR] == AK8963_ADDRESS &&
+            fake.regs[MPU9250_RA_I2C_SLV4_DO] == AK8963_CNTL_MODE_CONTINUE_MEASURE_1,
+        "the write is one transfer, with the byte in I2C_SLV4_DO");
+
+  check(ak8963_get_cntl(&mode) == ESP_OK && mode == AK8963_CNTL_MODE_CONTINUE_MEASURE_1 &&
+            fake.regs[MPU9250_RA_I2C_SLV4_ADDR] == (AK8963_ADDRESS | 1 << MPU9250_I2C_SLV_READ_BIT),
+        "read a register over SLV4");
+
+  fake.slv4_latency = 5;
+  int reads = fake.status_reads;
+  check(ak8963_get_cntl(&mode) == ESP_OK && mode == AK8963_CNTL_MODE_CONTINUE_MEASURE_1, "read a slow transfer");
+  check(fake.status_reads - reads == 6, "I2C_MST_STATUS is polled until DONE");
+  fake.slv4_latency = 0;
+
+  fake.ak_nack = true;
+  reads = fake.status_reads;
+  check(ak8963_get_cntl(&mode) == ESP_FAIL, "a NACK fails the read");
+  check(fake.status_reads - reads == 1, "polling stops at the NACK");
+  check(ak8963_set_cntl(AK8963_CNTL_MODE_CONTINUE_MEASURE_2) == ESP_FAIL &&
+            fake.ak[AK8963_CNTL] == AK8963_CNTL_MODE_CONTINUE_MEASURE_1,
+        "a NACK fails the write");
+  fake.ak_nack = false;
+
+  fake.slv4_stuck = true;
+  reads = fake.status_reads;
+  TickType_t start = xTaskGetTickCount();
+  check(ak8963_get_cntl(&mode) == ESP_ERR_TIMEOUT, "a transfer that never finishes times out");
+  check(fake.status_reads - reads == SLV4_POLLS, "after SLV4_POLLS polls");
+  check(xTaskGetTickCount() - start == SLV4_POLLS, "with a tick between polls");
+  fake.slv4_stuck = false;
+
+  check(ak8963_get_cntl(&mode) == ESP_OK && mode == AK8963_CNTL_MODE_CONTINUE_MEASURE_1,
+        "the next transfer works after a timeout");
+}
+
+static void test_single_measurement(void)
+{
+  vector_t v;
+  check(ak8963_set_mode(AK8963_MODE_SINGLE, AK8963_OUTPUT_16_BIT) == ESP_OK &&
+            fake.ak[AK8963_CNTL] == (AK8963_MODE_SINGLE | AK8963_OUTPUT_16_BIT),
+        "single measurement mode, 16 bit");
+
+  fake_ak8963_measure(&fake, 400, -400, 800, false);
+  fake_mpu9250_sample(&fake);
+  check(ak8963_get_mag(&v) == ESP_OK && near(&v, 125.0f, -75.0f, 200.0f), "16 bit output in 14 bit units");
+  check(fake.ak[AK8963_CNTL] == AK8963_OUTPUT_16_BIT && fake.slv4_pending,
+        "the next measurement is started without waiting");
+
+  fake_mpu9250_sample(&fake);
+  check(fake.ak[AK8963_CNTL] == (AK8963_MODE_SINGLE | AK8963_OUTPUT_16_BIT),
+        "the trigger reaches the AK8963 after the next sample");
+}
+
+int main(void)
+{
+  test_init();
+  test_slv0();
+  test_slv4();
+  test_single_measurement();
+
+  printf("%d failure(s)\n", failures);
+  return failures == 0 ? 0 : 1;
+}
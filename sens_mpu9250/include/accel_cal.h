@@ -0,0 +1,96 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __ACCEL_CAL_H
+#define __ACCEL_CAL_H
+
+#include "esp_err.h"
+
+#include "mpu9250.h"
+
+/**
+ * Six position accelerometer calibration.
+ *
+ * Feed uncalibrated samples (get_accel_raw()) in while the device is placed on each of its six
+ * faces, in any order.  Stillness and the face are detected from the data, no countdowns.  Each
+ * face is averaged with Welford accumulators, then a least squares fit over the six faces gives the
+ * full offset, scale and misalignment:
+ *   accel = accel_matrix * (raw - accel_bias)
+ */
+
+typedef enum
+{
+  ACCEL_CAL_X_UP = 0,
+  ACCEL_CAL_X_DOWN,
+  ACCEL_CAL_Y_UP,
+  ACCEL_CAL_Y_DOWN,
+  ACCEL_CAL_Z_UP,
+  ACCEL_CAL_Z_DOWN,
+  ACCEL_CAL_NUM_POSES
+} accel_cal_pose_t;
+
+typedef struct
+{
+  uint32_t window;       // Samples per stillness window
+  uint32_t pose_samples; // Still samples to average per pose
+  float still_var_max;   // Max accel variance in a window, summed over the axes (g^2)
+  float min_alignment;   // The up/down axis must read at least this much of 1 g
+} accel_cal_config_t;
+
+#define ACCEL_CAL_DEFAULT_CONFIG(rate_hz) \
+  {                                       \
+    .window = (rate_hz) / 4,              \
+    .pose_samples = 2 * (rate_hz),        \
+    .still_var_max = 1e-4f,               \
+    .min_alignment = 0.8f,                \
+  }
+
+typedef struct
+{
+  uint32_t n;
+  vector_t mean;
+  vector_t m2;
+} accel_cal_stats_t;
+
+typedef struct
+{
+  accel_cal_config_t config;
+
+  accel_cal_stats_t window;
+  accel_cal_stats_t pose[ACCEL_CAL_NUM_POSES];
+  int current_pose; // Pose being collected, -1 for none
+  uint8_t captured; // Bit mask of finished poses
+} accel_cal_t;
+
+void accel_cal_init(accel_cal_t *ac, const accel_cal_config_t *config);
+
+/**
+ * @param raw Uncalibrated accel sample, in g
+ * @return The pose that was just completed, or -1
+ */
+int accel_cal_add_sample(accel_cal_t *ac, const vector_t *raw);
+
+bool accel_cal_is_complete(const accel_cal_t *ac);
+
+/**
+ * Fit and write accel_bias and accel_matrix into `cal`.  Call mpu9250_update_calibration() after
+ * if `cal` is the live calibration.
+ */
+esp_err_t accel_cal_solve(const accel_cal_t *ac, calibration_t *cal);
+
+#endif // __ACCEL_CAL_H
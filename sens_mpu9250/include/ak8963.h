@@ -35,6 +35,7 @@
 #define AK8963_ZOUT_H (0x08)
 #define AK8963_ST2 (0x09)    // Data overflow bit 3 and data read error status bit 2
 #define AK8963_CNTL (0x0a)   // Power down (0000), single-measurement (0001), self-test (1000) and Fuse ROM (1111) modes on bits 3:0
+#define AK8963_CNTL2 (0x0b)  // Soft reset bit 0
 #define AK8963_ASTC (0x0c)   // Self test control
 #define AK8963_I2CDIS (0x0f) // I2C disable
 #define AK8963_ASAX (0x10)   // Fuse ROM x-axis sensitivity adjustment value
@@ -43,6 +44,11 @@
 
 #define AK8963_ST1_DRDY_BIT (0)
 #define AK8963_ST1_DOR_BIT (1)
+#define AK8963_ST2_HOFL_BIT (3) // Magnetic sensor overflow, |X| + |Y| + |Z| >= 4912 uT
+#define AK8963_ST2_BITM_BIT (4) // Mirrors CNTL1 BIT
+
+#define AK8963_ASTC_SELF_BIT (6)
+#define AK8963_CNTL_BIT_16 (1 << 4) // Output bit setting: 0 = 14 bit, 1 = 16 bit
 
 #define AK8963_CNTL_MODE_OFF (0x00)                // Power-down mode
 #define AK8963_CNTL_MODE_SINGLE_MEASURE (0x01)     // Single measurement mode
@@ -52,8 +58,58 @@
 #define AK8963_CNTL_MODE_SELF_TEST_MODE (0x08)     // Self-test mode
 #define AK8963_CNTL_MODE_FUSE_ROM_ACCESS (0x0f)    // Fuse ROM access mode
 
+typedef enum
+{
+  AK8963_MODE_CONTINUOUS_8HZ = AK8963_CNTL_MODE_CONTINUE_MEASURE_1,
+  AK8963_MODE_CONTINUOUS_100HZ = AK8963_CNTL_MODE_CONTINUE_MEASURE_2,
+  AK8963_MODE_SINGLE = AK8963_CNTL_MODE_SINGLE_MEASURE,
+} ak8963_mode_t;
+
+typedef enum
+{
+  AK8963_OUTPUT_14_BIT = 0,                  // 0.6 uT per LSB
+  AK8963_OUTPUT_16_BIT = AK8963_CNTL_BIT_16, // 0.15 uT per LSB
+} ak8963_output_t;
+
 esp_err_t ak8963_init(i2c_port_t i2c_number, calibration_t *c);
 
+/**
+ * Initialise the AK8963 behind the MPU9250 internal I2C master, for when the MPU9250 is on SPI.  The
+ * master must already be enabled.  SLV0 then copies ST1 to ST2 into EXT_SENS_DATA every sample, so
+ * ak8963_get_mag() is a single MPU9250 read.  Register access uses SLV4, a byte per sample period.
+ */
+esp_err_t ak8963_init_slave(calibration_t *c);
+
+/**
+ * Mounting rotation of the magnetometer, body = r * sensor, see mpu9250_set_mounting().  The AK8963
+ * axes are not the same as the MPU9250 accel / gyro axes, so this is usually a different matrix.
+ * @return ESP_ERR_INVALID_ARG if `r` is singular.
+ */
+esp_err_t ak8963_set_mounting(const float r[3][3]);
+
+/**
+ * Rebuild the magnetometer conversion from the calibration, called by mpu9250_update_calibration().
+ */
+void ak8963_update_calibration(void);
+
+/**
+ * Set the measurement mode and output resolution, init sets AK8963_MODE_CONTINUOUS_100HZ and
+ * AK8963_OUTPUT_14_BIT.  ak8963_get_mag() always returns 14 bit units, so the calibration holds for
+ * either resolution.
+ *
+ * In AK8963_MODE_SINGLE each ak8963_get_mag() reads the last measurement and triggers the next one,
+ * so calling it at the fusion rate (at most 100 Hz, a measurement takes up to 9 ms) never returns
+ * stale data.  It returns ESP_ERR_NOT_FINISHED if called again before the measurement is done.
+ * Through the MPU9250 I2C master data ready can't be seen, the data is the last completed measurement.
+ */
+esp_err_t ak8963_set_mode(ak8963_mode_t mode, ak8963_output_t output);
+
+/**
+ * Start a single measurement, at the current output resolution.  Only needed to start one by hand,
+ * ak8963_get_mag() does this in AK8963_MODE_SINGLE.
+ */
+esp_err_t ak8963_trigger_measurement(void);
+
 /**
  * @name ak8963_get_data_ready
  */
@@ -72,7 +128,9 @@ esp_err_t ak8963_get_device_id(uint8_t *val);
 esp_err_t ak8963_get_sensitivity_adjustment_values();
 
 /**
- * Get the raw magnetometer values
+ * Get the magnetometer values.  On an error `v` is set to zero, which the AHRS skips.
+ * @return ESP_ERR_INVALID_RESPONSE if the sensor overflowed (HOFL), the sample must not be used.
+ *         ESP_ERR_NOT_FINISHED in AK8963_MODE_SINGLE if the measurement isn't done yet.
  * @name ak8963_get_mag_raw
  */
 esp_err_t ak8963_get_mag(vector_t *v);
@@ -98,6 +156,33 @@ esp_err_t ak8963_get_cntl(uint8_t *mode);
  */
 esp_err_t ak8963_set_cntl(uint8_t mode);
 
+/**
+ * Run the AK8963 self-test (internal field generator) and check the result against the datasheet
+ * limits.  The current mode is restored afterwards.  Takes about 10 ms.
+ * @param field The self-test field, sensitivity adjusted, in LSB of the current output resolution
+ * @param pass Per axis pass / fail
+ */
+esp_err_t ak8963_self_test(vector_t *field, bool pass[3]);
+
+/**
+ * The AK8963 configuration, read by ak8963_get_config() in two bursts: WIA and CNTL1 to ASTC.  Through
+ * the MPU9250 I2C master this is a byte per sample period instead, see ak8963_init_slave().
+ */
+typedef struct
+{
+  uint8_t wia;
+  uint8_t cntl1;
+  uint8_t cntl2;
+  uint8_t astc;
+} ak8963_config_t;
+
+esp_err_t ak8963_get_config(ak8963_config_t *config);
+
+/**
+ * As mpu9250_config_diff(), CNTL2 (soft reset, self clearing) is ignored.
+ */
+int ak8963_config_diff(const ak8963_config_t *expected, const ak8963_config_t *actual, uint8_t *reg);
+
 void ak8963_print_settings(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,97 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __BIAS_TRACKER_H
+#define __BIAS_TRACKER_H
+
+#include "mpu9250.h"
+
+/**
+ * Online gyro bias estimation.  Samples are grouped into windows; when the gyro and accel variance
+ * over a window are low, the accel reads 1 g and its mean direction has not moved since the last
+ * window the device is taken to be still, and whatever rate is left on the gyro is bias.  That
+ * residual is blended into calibration_t.gyro_bias_offset with an exponential moving average, so
+ * the live calibration is corrected in the field.
+ *
+ * A slow rotation has low variance too.  Tilting shows up as the accel direction moving between
+ * windows, but a turn about the vertical does not, so the residual gate is the only guard against
+ * a slow yaw; keep max_residual_dps small and calibrate the gyro first.
+ *
+ * There is no lock around the calibration.  bias_tracker_update() writes cal->gyro_bias_offset one
+ * axis at a time, and the driver reads it on every gyro read, so a read from another task can see
+ * a mix of the old and new offset.  Call bias_tracker_update() from the task that reads the
+ * samples, or hold your own mutex around both.
+ */
+
+typedef struct
+{
+  uint32_t window;          // Samples per stillness window
+  float gyro_var_max;       // Max gyro variance over a window, summed over the axes (dps^2)
+  float accel_var_max;      // Max accel variance over a window, summed over the axes (g^2)
+  float accel_norm_tol;     // Max difference of the mean accel magnitude from 1 g
+  float accel_dir_tol_deg;  // Max change of the mean accel direction from the last window
+  float max_residual_dps;   // Residual rates above this are taken as slow rotation, not bias
+  float alpha;              // Weight of each still window in the bias average, (0, 1]
+} bias_tracker_config_t;
+
+#define BIAS_TRACKER_DEFAULT_CONFIG(rate_hz) \
+  {                                          \
+    .window = (rate_hz),                     \
+    .gyro_var_max = 0.1f,                    \
+    .accel_var_max = 1e-4f,                  \
+    .accel_norm_tol = 0.05f,                 \
+    .accel_dir_tol_deg = 0.25f,              \
+    .max_residual_dps = 1.0f,                \
+    .alpha = 0.2f,                           \
+  }
+
+typedef struct
+{
+  bias_tracker_config_t config;
+  calibration_t *cal;
+
+  // Welford accumulators for the current window
+  uint32_t n;
+  vector_t g_mean, g_m2;
+  vector_t a_mean, a_m2;
+
+  // Mean accel of the last window, if that window was steady
+  vector_t a_last;
+  bool a_last_valid;
+
+  bool still;
+  uint32_t still_windows;
+  uint32_t updates;
+} bias_tracker_t;
+
+void bias_tracker_init(bias_tracker_t *bt, calibration_t *cal, const bias_tracker_config_t *config);
+
+/**
+ * @param va Calibrated accel sample, in g
+ * @param vg Calibrated gyro sample, in dps (i.e. with the current bias already applied)
+ * @return true when the window ended still and cal->gyro_bias_offset was updated
+ */
+bool bias_tracker_update(bias_tracker_t *bt, const vector_t *va, const vector_t *vg);
+
+/**
+ * Whether the last complete window was still.  The first window after any movement is never
+ * still, as there is no earlier window to check the accel direction against.
+ */
+bool bias_tracker_is_still(const bias_tracker_t *bt);
+
+#endif // __BIAS_TRACKER_H
@@ -19,8 +19,76 @@
 #ifndef __CALIBRATE_H
 #define __CALIBRATE_H
 
+#include "esp_err.h"
+
+#include "mpu9250.h"
+
 void calibrate_gyro(void);
 void calibrate_accel(void);
 void calibrate_mag(void);
 
+/**
+ * Everything found by the calibrate_*() calls so far, e.g. to save with util_calstore.
+ */
+void calibrate_get_calibration(calibration_t *c);
+
+/**
+ * Non-interactive gyro bias calibration for production.  The gyro is captured through the FIFO at
+ * 1 kHz, so 2000 samples take about 2 s, and nothing is printed.  The device must be still; the
+ * capture is rejected if any axis is noisier than `max_std_dps`.
+ */
+typedef struct
+{
+  uint32_t samples;  // Number of 1 kHz samples to average
+  float max_std_dps; // Reject the capture if the std dev of any axis is above this
+} gyro_fast_cal_config_t;
+
+#define GYRO_FAST_CAL_DEFAULT_CONFIG \
+  {                                  \
+    .samples = 2000,                 \
+    .max_std_dps = 0.3f,             \
+  }
+
+typedef struct
+{
+  vector_t bias_offset; // The negated mean rate, ready for calibration_t.gyro_bias_offset
+  vector_t std_dps;     // Standard deviation of each axis
+  float temperature;    // Die temperature at the end of the capture
+  uint32_t samples;     // Samples used
+  uint32_t overflows;   // Times the FIFO filled up and was flushed
+  uint32_t elapsed_ms;
+  bool still;           // false if the device moved, the bias should not be used
+} gyro_fast_cal_result_t;
+
+/**
+ * The sample rate, filter and FIFO settings are restored afterwards, also when the capture fails.
+ * @return ESP_OK, ESP_ERR_INVALID_STATE if the device moved (the result is still filled in),
+ *         ESP_ERR_TIMEOUT if the FIFO stopped filling, or the bus error.
+ */
+esp_err_t calibrate_gyro_fast(const gyro_fast_cal_config_t *config, gyro_fast_cal_result_t *result);
+
+/**
+ * Least squares fit of the gyro bias temperature model.  Log the gyro and temperature (from
+ * get_accel_gyro_temp()) while the device is still and the temperature is swept, with the bias
+ * offset and temperature coefficients all set to zero, then feed the log through here.
+ */
+typedef struct
+{
+  float t_ref;
+  uint32_t n;
+  double s[2 * GYRO_TEMP_POLY_ORDER + 1]; // sum(dT^k)
+  double sx[GYRO_TEMP_POLY_ORDER + 1];    // sum(gx * dT^k)
+  double sy[GYRO_TEMP_POLY_ORDER + 1];    // sum(gy * dT^k)
+  double sz[GYRO_TEMP_POLY_ORDER + 1];    // sum(gz * dT^k)
+} gyro_temp_fit_t;
+
+void gyro_temp_fit_init(gyro_temp_fit_t *f, float t_ref);
+void gyro_temp_fit_add(gyro_temp_fit_t *f, float temp, const vector_t *vg);
+
+/**
+ * Write gyro_bias_offset, gyro_temp_ref and gyro_temp_coeff into `cal`.
+ * @return ESP_ERR_INVALID_STATE if the sweep did not cover enough temperatures to fit the model.
+ */
+esp_err_t gyro_temp_fit_solve(const gyro_temp_fit_t *f, calibration_t *cal);
+
 #endif
\ No newline at end of file
@@ -21,15 +21,28 @@
 
 #include <math.h>
 
+#include "sampler.h"
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 #define SAMPLE_FREQ_Hz (CONFIG_SAMPLE_RATE_Hz)
 #define SAMPLE_INTERVAL_MS (1000 / SAMPLE_FREQ_Hz) // Sample Rate in milliseconds
+#define SAMPLE_INTERVAL_US (1000000 / SAMPLE_FREQ_Hz) // Sample Rate in microseconds
 
 #define DEG2RAD(deg) (deg * M_PI / 180.0f)
 
+/**
+ * Block until the next sample deadline.  Deadlines are absolute, SAMPLE_INTERVAL_US apart, starting
+ * from the first call.  The task that makes the first call is the one that gets woken, a call from
+ * another task times out after a few periods.  Errors are logged, it never aborts.
+ */
 void mpu_pause(void);
 
+/**
+ * Get the measured deadline error of mpu_pause().
+ */
+void mpu_pause_get_stats(sampler_stats_t *stats);
+
 #endif
\ No newline at end of file
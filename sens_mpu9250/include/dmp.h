@@ -0,0 +1,109 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __DMP_H
+#define __DMP_H
+
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "mpu9250.h"
+
+/**
+ * Digital Motion Processor (DMP) support.  The DMP runs sensor fusion on the MPU9250 and writes
+ * quaternions into the FIFO, so the host doesn't need to run ahrs_update() at all.
+ *
+ * The DMP firmware is not part of this component (it is InvenSense's, e.g. the MotionDriver 6.12
+ * image for the MPU6500 / MPU9250).  The caller supplies the image, where its rate divider lives
+ * and the memory patches that turn its features on.  The upload is read back and compared chunk by
+ * chunk before the program start address is set.
+ *
+ * Usage:
+ *   mpu9250_dmp_load_firmware(&fw);
+ *   mpu9250_dmp_configure(&config);
+ *   mpu9250_dmp_enable(true);
+ *   while (...) mpu9250_dmp_read_quat(q, N, &count);
+ */
+
+typedef struct
+{
+  const uint8_t *image;  // Firmware image, loaded from DMP address 0
+  size_t size;
+  uint16_t start_addr;   // Program start address
+  uint16_t rate_addr;    // DMP address of the 16 bit FIFO rate divider in this image
+  uint16_t base_rate_hz; // DMP internal rate, the output rate is base_rate_hz / (divider + 1)
+  uint8_t packet_size;   // Bytes per FIFO packet with the features that will be enabled
+  uint8_t quat_offset;   // Offset of the quaternion (4 x Q30, big endian) in a packet
+} mpu9250_dmp_firmware_t;
+
+/**
+ * A write to DMP memory, e.g. to enable a feature in the loaded image.
+ */
+typedef struct
+{
+  uint16_t addr;
+  uint16_t len;
+  const uint8_t *data;
+} mpu9250_dmp_patch_t;
+
+typedef struct
+{
+  uint16_t rate_hz; // Quaternion output rate, a divisor of base_rate_hz
+  const mpu9250_dmp_patch_t *features;
+  size_t num_features;
+} mpu9250_dmp_config_t;
+
+typedef struct
+{
+  float w, x, y, z;
+} mpu9250_dmp_quat_t;
+
+/**
+ * Raw DMP memory access.  Writes are split into chunks that don't cross a memory bank.
+ */
+esp_err_t mpu9250_dmp_write_mem(uint16_t addr, const uint8_t *data, size_t len);
+esp_err_t mpu9250_dmp_read_mem(uint16_t addr, uint8_t *data, size_t len);
+
+/**
+ * Upload and verify the firmware, then set the program start address.  The DMP stays off.
+ * @return ESP_ERR_INVALID_RESPONSE if the read back doesn't match.
+ */
+esp_err_t mpu9250_dmp_load_firmware(const mpu9250_dmp_firmware_t *fw);
+
+/**
+ * Apply the feature patches (verified like the firmware) and the output rate.
+ */
+esp_err_t mpu9250_dmp_configure(const mpu9250_dmp_config_t *config);
+
+/**
+ * Turn the DMP on or off.  On: raw FIFO output and auto ranging are turned off, the gyro is set to
+ * +/-2000 dps and accel to +/-2 g as the DMP expects, and the sample rate to base_rate_hz.  Off: the
+ * FIFO is reset and left off, restore the ranges you want with set_full_scale_*_range().
+ */
+esp_err_t mpu9250_dmp_enable(bool enable);
+
+/**
+ * Read every complete quaternion packet waiting in the FIFO, up to `max`.
+ * @return ESP_ERR_INVALID_RESPONSE if a packet is not a unit quaternion (the FIFO lost alignment),
+ *         ESP_ERR_INVALID_SIZE if the FIFO overflowed.  In both cases the FIFO is reset and the
+ *         next call starts clean.
+ */
+esp_err_t mpu9250_dmp_read_quat(mpu9250_dmp_quat_t *q, size_t max, size_t *count);
+
+#endif // __DMP_H
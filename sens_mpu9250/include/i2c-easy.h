@@ -62,6 +62,11 @@ esp_err_t i2c_write_byte(i2c_port_t i2c_num, uint8_t periph_address, uint8_t reg
 esp_err_t i2c_read_bytes(i2c_port_t i2c_num, uint8_t periph_address, uint8_t reg_address, uint8_t *data, size_t data_len);
 esp_err_t i2c_read_byte(i2c_port_t i2c_num, uint8_t periph_address, uint8_t reg_address, uint8_t *data);
 
+/**
+ * The mask for `length` bits starting at bit `bit` and going up, as used by i2c_write_bits().
+ */
+uint8_t get_bit_mask(uint8_t bit, uint8_t length);
+
 /**
  * Write one bit.  Note, this will do a read to get the existing value, then a write.
  * @param  i2c_num  The i2c number
@@ -35,12 +35,56 @@
 #define MPU9250_I2C_ADDRESS_AD0_HIGH (0x69)
 #define MPU9250_WHO_AM_I (0x75)
 
+#define MPU9250_RA_SELF_TEST_X_GYRO (0x00)
+#define MPU9250_RA_SELF_TEST_Y_GYRO (0x01)
+#define MPU9250_RA_SELF_TEST_Z_GYRO (0x02)
+#define MPU9250_RA_SELF_TEST_X_ACCEL (0x0D)
+#define MPU9250_RA_SELF_TEST_Y_ACCEL (0x0E)
+#define MPU9250_RA_SELF_TEST_Z_ACCEL (0x0F)
+
+#define MPU9250_RA_SMPLRT_DIV (0x19)
 #define MPU9250_RA_CONFIG (0x1A)
 #define MPU9250_RA_GYRO_CONFIG (0x1B)
 #define MPU9250_RA_ACCEL_CONFIG_1 (0x1C)
 #define MPU9250_RA_ACCEL_CONFIG_2 (0x1D)
+#define MPU9250_RA_LP_ACCEL_ODR (0x1E)
+#define MPU9250_RA_WOM_THR (0x1F)
+#define MPU9250_RA_FIFO_EN (0x23)
+#define MPU9250_RA_I2C_MST_CTRL (0x24)
+#define MPU9250_RA_I2C_SLV0_ADDR (0x25)
+#define MPU9250_RA_I2C_SLV0_REG (0x26)
+#define MPU9250_RA_I2C_SLV0_CTRL (0x27)
+#define MPU9250_RA_I2C_SLV4_ADDR (0x31)
+#define MPU9250_RA_I2C_SLV4_REG (0x32)
+#define MPU9250_RA_I2C_SLV4_DO (0x33)
+#define MPU9250_RA_I2C_SLV4_CTRL (0x34)
+#define MPU9250_RA_I2C_SLV4_DI (0x35)
+#define MPU9250_RA_I2C_MST_STATUS (0x36)
 
 #define MPU9250_RA_INT_PIN_CFG (0x37)
+#define MPU9250_RA_INT_ENABLE (0x38)
+#define MPU9250_RA_INT_STATUS (0x3A)
+#define MPU9250_RA_EXT_SENS_DATA_00 (0x49)
+#define MPU9250_RA_EXT_SENS_DATA_23 (0x60)
+#define MPU9250_RA_I2C_MST_DELAY_CTRL (0x67)
+#define MPU9250_RA_SIGNAL_PATH_RESET (0x68)
+#define MPU9250_RA_MOT_DETECT_CTRL (0x69)
+
+#define MPU9250_RA_FIFO_COUNTH (0x72)
+#define MPU9250_RA_FIFO_COUNTL (0x73)
+#define MPU9250_RA_FIFO_R_W (0x74)
+#define MPU9250_FIFO_SIZE (512)
+
+#define MPU9250_CONFIG_FIFO_MODE_BIT (6)
+#define MPU9250_CONFIG_DLPF_CFG_BIT (0)
+#define MPU9250_CONFIG_DLPF_CFG_LENGTH (3)
+#define MPU9250_DLPF_CFG_184HZ (1) // Gyro 184 Hz bandwidth, 1 kHz internal rate
+
+#define MPU9250_FIFO_TEMP_OUT_BIT (7)
+#define MPU9250_FIFO_GYRO_XOUT_BIT (6)
+#define MPU9250_FIFO_GYRO_YOUT_BIT (5)
+#define MPU9250_FIFO_GYRO_ZOUT_BIT (4)
+#define MPU9250_FIFO_ACCEL_BIT (3)
 
 #define MPU9250_INTCFG_ACTL_BIT (7)
 #define MPU9250_INTCFG_OPEN_BIT (6)
@@ -51,6 +95,31 @@
 #define MPU9250_INTCFG_BYPASS_EN_BIT (1)
 #define MPU9250_INTCFG_NONE_BIT (0)
 
+#define MPU9250_INT_WOM_BIT (6)
+#define MPU9250_INT_FIFO_OFLOW_BIT (4)
+#define MPU9250_INT_FSYNC_BIT (3)
+#define MPU9250_INT_DMP_BIT (1)
+#define MPU9250_INT_RAW_RDY_BIT (0)
+
+#define MPU9250_MOTCTRL_ACCEL_INTEL_EN_BIT (7)
+#define MPU9250_MOTCTRL_ACCEL_INTEL_MODE_BIT (6)
+
+#define MPU9250_WOM_THR_MG_PER_LSB (4)
+
+// Low power accelerometer output data rates, written to LP_ACCEL_ODR
+#define MPU9250_LP_ACCEL_ODR_0_24HZ (0)
+#define MPU9250_LP_ACCEL_ODR_0_49HZ (1)
+#define MPU9250_LP_ACCEL_ODR_0_98HZ (2)
+#define MPU9250_LP_ACCEL_ODR_1_95HZ (3)
+#define MPU9250_LP_ACCEL_ODR_3_91HZ (4)
+#define MPU9250_LP_ACCEL_ODR_7_81HZ (5)
+#define MPU9250_LP_ACCEL_ODR_15_63HZ (6)
+#define MPU9250_LP_ACCEL_ODR_31_25HZ (7)
+#define MPU9250_LP_ACCEL_ODR_62_50HZ (8)
+#define MPU9250_LP_ACCEL_ODR_125HZ (9)
+#define MPU9250_LP_ACCEL_ODR_250HZ (10)
+#define MPU9250_LP_ACCEL_ODR_500HZ (11)
+
 #define MPU9250_ACCEL_XOUT_H (0x3B)
 #define MPU9250_ACCEL_XOUT_L (0x3C)
 #define MPU9250_ACCEL_YOUT_H (0x3D)
@@ -66,6 +135,14 @@
 #define MPU9250_GYRO_ZOUT_H (0x47)
 #define MPU9250_GYRO_ZOUT_L (0x48)
 
+#define MPU9250_RA_BANK_SEL (0x6D)
+#define MPU9250_RA_MEM_START_ADDR (0x6E)
+#define MPU9250_RA_MEM_R_W (0x6F)
+#define MPU9250_RA_DMP_CFG_1 (0x70) // Program start address, high byte
+#define MPU9250_RA_DMP_CFG_2 (0x71)
+#define MPU9250_DMP_MEMORY_BANK_SIZE (256)
+#define MPU9250_DMP_MEMORY_CHUNK_SIZE (16)
+
 #define MPU9250_RA_USER_CTRL (0x6A)
 #define MPU9250_RA_PWR_MGMT_1 (0x6B)
 #define MPU9250_RA_PWR_MGMT_2 (0x6C)
@@ -75,7 +152,13 @@
 #define MPU9250_PWR1_TEMP_DIS_BIT (3)
 #define MPU9250_PWR1_CLKSEL_BIT (0)
 #define MPU9250_PWR1_CLKSEL_LENGTH (3)
+#define MPU9250_PWR1_GYRO_STANDBY_BIT (4)
+#define MPU9250_PWR2_DISABLE_GYRO (0x07)
+#define MPU9250_PWR2_DISABLE_ACCEL (0x38)
 
+#define MPU9250_GCONFIG_XG_ST_BIT (7)
+#define MPU9250_GCONFIG_YG_ST_BIT (6)
+#define MPU9250_GCONFIG_ZG_ST_BIT (5)
 #define MPU9250_GCONFIG_FS_SEL_BIT (3)
 #define MPU9250_GCONFIG_FS_SEL_LENGTH (2)
 #define MPU9250_GYRO_FS_250 (0x00)
@@ -87,6 +170,9 @@
 #define MPU9250_GYRO_SCALE_FACTOR_2 (32.8)
 #define MPU9250_GYRO_SCALE_FACTOR_3 (16.4)
 
+#define MPU9250_ACONFIG_XA_ST_BIT (7)
+#define MPU9250_ACONFIG_YA_ST_BIT (6)
+#define MPU9250_ACONFIG_ZA_ST_BIT (5)
 #define MPU9250_ACONFIG_FS_SEL_BIT (3)
 #define MPU9250_ACONFIG_FS_SEL_LENGTH (2)
 #define MPU9250_ACCEL_FS_2 (0x00)
@@ -106,6 +192,12 @@
 #define MPU9250_CLOCK_PLL_EXT32K (0x04)
 #define MPU9250_CLOCK_PLL_EXT19M (0x05)
 
+#define MPU9250_I2C_MST_CTRL_400KHZ (0x0D)
+#define MPU9250_I2C_SLV_READ_BIT (7) // In I2C_SLVn_ADDR
+#define MPU9250_I2C_SLV_EN_BIT (7)   // In I2C_SLVn_CTRL, the low 4 bits are the length for SLV0-3
+#define MPU9250_I2C_MST_SLV4_DONE_BIT (6)
+#define MPU9250_I2C_MST_SLV4_NACK_BIT (4)
+
 #define MPU9250_I2C_SLV0_DO (0x63)
 #define MPU9250_I2C_SLV1_DO (0x64)
 #define MPU9250_I2C_SLV2_DO (0x65)
@@ -119,6 +211,11 @@
 #define MPU9250_USERCTRL_I2C_MST_RESET_BIT (1)
 #define MPU9250_USERCTRL_SIG_COND_RESET_BIT (0)
 
+#define MPU9250_TEMP_SENSITIVITY (333.87) // LSB per degree C
+#define MPU9250_TEMP_OFFSET (21.0)        // degree C at 0 LSB
+
+#define GYRO_TEMP_POLY_ORDER (3)
+
 #define BYTE_2_INT_BE(byte, i) ((int16_t)((byte[i] << 8) + (byte[i + 1])))
 #define BYTE_2_INT_LE(byte, i) ((int16_t)((byte[i + 1] << 8) + (byte[i])))
 
@@ -133,19 +230,150 @@ typedef struct
   vector_t mag_offset;
   vector_t mag_scale;
 
+  // Magnetometer soft iron matrix, from an ellipsoid fit.  When set (non-zero diagonal) it is used
+  // instead of mag_scale: mag = mag_soft_iron * (raw - mag_offset).
+  float mag_soft_iron[3][3];
+
   // Gryoscope
   vector_t gyro_bias_offset;
 
+  // Gyroscope bias temperature model.  The bias applied is:
+  //   gyro_bias_offset + sum(gyro_temp_coeff[k] * (T - gyro_temp_ref)^(k + 1))
+  // All zero coefficients (the default) give a constant bias.
+  float gyro_temp_ref;
+  vector_t gyro_temp_coeff[GYRO_TEMP_POLY_ORDER];
+
   // Accelerometer
   vector_t accel_offset;
   vector_t accel_scale_lo;
   vector_t accel_scale_hi;
 
+  // Accelerometer affine model from a six position fit, with raw in g:
+  //   accel = accel_matrix * (raw - accel_bias)
+  // When set (non-zero diagonal) it is used instead of accel_offset / accel_scale_lo / accel_scale_hi.
+  vector_t accel_bias;
+  float accel_matrix[3][3];
+
 } calibration_t;
 
+/**
+ * Precomputed conversion from raw counts to calibrated, mounted units: out = m * (raw - offset).
+ */
+typedef struct
+{
+  float m[3][3];
+  vector_t offset; // In raw counts
+} conversion_t;
+
+/**
+ * m = rotation * matrix * diag(in_scale), offset = offset / in_scale.  `matrix` may be NULL for the
+ * identity.
+ */
+void conversion_init(conversion_t *c, const float rotation[3][3], const float matrix[3][3], const vector_t *in_scale, const vector_t *offset);
+void conversion_apply(const conversion_t *c, float x, float y, float z, vector_t *v);
+
+// Axis codes for mpu9250_mounting_from_axes(), negate for the opposite direction
+#define MPU9250_AXIS_X (1)
+#define MPU9250_AXIS_Y (2)
+#define MPU9250_AXIS_Z (3)
+
+/**
+ * Build a permutation / sign mounting matrix.  Each argument is the sensor axis that lies along that
+ * body axis, e.g. (-MPU9250_AXIS_X, -MPU9250_AXIS_Z, -MPU9250_AXIS_Y) gives body x = -sensor x,
+ * body y = -sensor z, body z = -sensor y.
+ */
+void mpu9250_mounting_from_axes(int8_t body_x, int8_t body_y, int8_t body_z, float r[3][3]);
+
 esp_err_t i2c_mpu9250_init(calibration_t *cal,bool use_mag);
+
+// Flags for the last accel and gyro samples read, see mpu9250_get_sample_flags()
+#define MPU9250_SAMPLE_ACCEL_CLIPPED (1 << 0)   // At the limit of the range, the real value may be larger
+#define MPU9250_SAMPLE_GYRO_CLIPPED (1 << 1)
+#define MPU9250_SAMPLE_ACCEL_SWITCHING (1 << 2) // Taken while the range was switching, the scale may be wrong
+#define MPU9250_SAMPLE_GYRO_SWITCHING (1 << 3)
+
+/**
+ * Automatic full scale range switching.  A sample with any axis at or above `up_threshold` counts
+ * moves that sensor up one range for the next sample.  Once the peak over `hold_samples` samples is
+ * below `down_threshold` counts it moves back down one range.  The scale used to convert samples
+ * always matches the range the sample was taken at, except for the `settle_samples` samples after a
+ * switch, which are flagged MPU9250_SAMPLE_*_SWITCHING.
+ */
+typedef struct
+{
+  uint8_t gyro_min, gyro_max;   // MPU9250_GYRO_FS_*
+  uint8_t accel_min, accel_max; // MPU9250_ACCEL_FS_*
+  uint16_t up_threshold;        // Raw counts
+  uint16_t down_threshold;      // Raw counts at the current range
+  uint32_t hold_samples;
+  uint8_t settle_samples;
+} mpu9250_autorange_config_t;
+
+#define MPU9250_AUTORANGE_DEFAULT_CONFIG(rate_hz) \
+  {                                               \
+    .gyro_min = MPU9250_GYRO_FS_250,              \
+    .gyro_max = MPU9250_GYRO_FS_2000,             \
+    .accel_min = MPU9250_ACCEL_FS_4,              \
+    .accel_max = MPU9250_ACCEL_FS_16,             \
+    .up_threshold = 32000,                        \
+    .down_threshold = 9830,                       \
+    .hold_samples = (rate_hz),                    \
+    .settle_samples = 2,                          \
+  }
+
+/**
+ * Turn auto ranging on, or off with NULL.  The current ranges are clamped to the configured limits.
+ */
+esp_err_t mpu9250_set_autorange(const mpu9250_autorange_config_t *config);
+
+/**
+ * MPU9250_SAMPLE_* flags for the last accel and the last gyro sample read.
+ */
+uint32_t mpu9250_get_sample_flags(void);
+
+/**
+ * Mounting rotation of the MPU9250 accelerometer and gyroscope, body = r * sensor.  Any invertible
+ * 3x3 is accepted.  It is folded into the calibration, so get_accel() and get_gyro() (and friends)
+ * return body axes for the cost of the calibration alone.  The default is the identity.  The
+ * magnetometer has its own, see ak8963_set_mounting().
+ *
+ * Calibrate with the identity mounting, calibration_t is always in sensor axes.
+ * @return ESP_ERR_INVALID_ARG if `r` is singular.
+ */
+esp_err_t mpu9250_set_mounting(const float r[3][3]);
+
+/**
+ * Rotate a body axes vector back into sensor axes, e.g. to correct calibration_t from body data.
+ */
+void mpu9250_body_to_sensor(vector_t *v);
+
+/**
+ * Rebuild the precomputed conversions.  Call this after changing the accelerometer or magnetometer
+ * calibration in the calibration_t passed to i2c_mpu9250_init().
+ */
+void mpu9250_update_calibration(void);
+
+/**
+ * Raw register access to the MPU9250.
+ */
+esp_err_t mpu9250_read_bytes(uint8_t reg, uint8_t *data, size_t len);
+esp_err_t mpu9250_read_byte(uint8_t reg, uint8_t *data);
+esp_err_t mpu9250_write_byte(uint8_t reg, uint8_t data);
+esp_err_t mpu9250_write_bytes(uint8_t reg, const uint8_t *data, size_t len);
+esp_err_t mpu9250_write_bits(uint8_t reg, uint8_t bit, uint8_t length, uint8_t value);
+
+/**
+ * FIFO access.  mpu9250_fifo_read() reads `len` bytes from FIFO_R_W in one burst, so `len` must not
+ * be more than mpu9250_fifo_count() returned.
+ */
+esp_err_t mpu9250_fifo_reset(void);
+esp_err_t mpu9250_fifo_count(uint16_t *count);
+esp_err_t mpu9250_fifo_read(uint8_t *data, size_t len);
+
 esp_err_t set_clock_source(uint8_t adrs);
 esp_err_t set_full_scale_gyro_range(uint8_t adrs);
+esp_err_t get_full_scale_gyro_range(uint8_t *full_scale_gyro_range);
+float get_gyro_inv_scale(uint8_t scale_factor);
 esp_err_t set_full_scale_accel_range(uint8_t adrs);
 esp_err_t set_sleep_enabled(bool state);
 esp_err_t get_device_id(uint8_t *val);
@@ -158,12 +386,71 @@ esp_err_t get_i2c_master_mode(bool *state);
 esp_err_t set_i2c_master_mode(bool state);
 
 esp_err_t get_accel(vector_t *v);
+
+/**
+ * Accelerometer in g, with no calibration applied.
+ */
+esp_err_t get_accel_raw(vector_t *v);
 esp_err_t get_gyro(vector_t *v);
 esp_err_t get_mag(vector_t *v);
 esp_err_t get_accel_gyro(vector_t *va, vector_t *vg);
+
+/**
+ * Same bus read as get_accel_gyro(), the temperature comes from the same burst.  The temperature is
+ * also kept for the gyro bias temperature model.
+ */
+esp_err_t get_accel_gyro_temp(vector_t *va, vector_t *vg, float *temp);
+
+/**
+ * `vm` is zero with ESP_ERR_INVALID_RESPONSE on a magnetometer overflow, see ak8963_get_mag().
+ */
 esp_err_t get_accel_gyro_mag(vector_t *va, vector_t *vg, vector_t *vm);
 esp_err_t get_mag_raw(uint8_t bytes[6]);
 
+/**
+ * The configuration registers, as read by mpu9250_get_config() in four bursts: SMPLRT_DIV to
+ * I2C_SLV4_DI, INT_PIN_CFG to INT_ENABLE, I2C_MST_DELAY_CTRL to PWR_MGMT_2 and WHO_AM_I.
+ * I2C_MST_STATUS is skipped as it clears on read, as are the DMP memory registers.
+ */
+typedef struct
+{
+  uint8_t smplrt_div; // 0x19
+  uint8_t config;
+  uint8_t gyro_config;
+  uint8_t accel_config_1;
+  uint8_t accel_config_2;
+  uint8_t lp_accel_odr;
+  uint8_t wom_thr;
+  uint8_t reserved[3];
+  uint8_t fifo_en; // 0x23
+  uint8_t i2c_mst_ctrl;
+  uint8_t i2c_slv[4][3]; // ADDR, REG, CTRL for SLV0 to SLV3
+  uint8_t i2c_slv4[5];   // ADDR, REG, DO, CTRL, DI
+
+  uint8_t int_pin_cfg; // 0x37
+  uint8_t int_enable;
+
+  uint8_t i2c_mst_delay_ctrl; // 0x67
+  uint8_t signal_path_reset;
+  uint8_t mot_detect_ctrl;
+  uint8_t user_ctrl;
+  uint8_t pwr_mgmt_1;
+  uint8_t pwr_mgmt_2;
+
+  uint8_t who_am_i; // 0x75
+} mpu9250_config_t;
+
+esp_err_t mpu9250_get_config(mpu9250_config_t *config);
+
+/**
+ * Compare a snapshot with an expected one, ignoring the reserved bytes, I2C_SLV4_DI and
+ * SIGNAL_PATH_RESET.  This is a byte compare, cheap enough to run after every periodic
+ * mpu9250_get_config().
+ * @param reg If not NULL, set to the register address of the first difference
+ * @return The number of registers that differ, 0 if they match
+ */
+int mpu9250_config_diff(const mpu9250_config_t *expected, const mpu9250_config_t *actual, uint8_t *reg);
+
 void print_settings(bool use_mag);
 
 #endif // __MPU9250_H
@@ -0,0 +1,89 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __POWER_MODE_H
+#define __POWER_MODE_H
+
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+
+#include "mpu9250.h"
+
+/**
+ * Switch between full rate 9-axis sampling and an accelerometer-only, wake-on-motion idle mode.
+ *
+ * Typical supply current per mode (MPU-9250 product specification and AK8963 datasheet, not
+ * measured on our boards):
+ *
+ *   Mode                                      MPU9250        AK8963
+ *   Full rate (gyro + accel)                  3.2 mA + 450 uA
+ *   Magnetometer, continuous 8 Hz                            280 uA
+ *   Low power accel, LP_ACCEL_ODR 0.98 Hz     8.4 uA
+ *   Low power accel, LP_ACCEL_ODR 31.25 Hz    19.8 uA
+ *   Magnetometer power-down                                  ~0 (power-down)
+ *
+ * Wake latency is the time for the motion to be seen, plus the time to get back to full rate:
+ *
+ *   - detection: up to one LP_ACCEL_ODR period (e.g. 32 ms at 31.25 Hz, 1 s at 0.98 Hz).
+ *   - restart: the gyro needs 35 ms to start up from standby, this is waited for in
+ *     power_mode_enter_full_rate().
+ */
+
+typedef enum
+{
+  POWER_MODE_FULL_RATE = 0,
+  POWER_MODE_LOW_POWER
+} power_mode_t;
+
+typedef struct
+{
+  bool use_mag;               // Power the AK8963 down while idle
+  gpio_num_t int_gpio;        // GPIO wired to the MPU9250 INT pin, or GPIO_NUM_NC to poll INT_STATUS
+  uint8_t lp_accel_odr;       // One of MPU9250_LP_ACCEL_ODR_*
+  uint16_t wom_threshold_mg;  // Wake on motion threshold, 0 to 1020 mg
+  float still_gyro_dps;       // All gyro axes must be below this to count as still
+  float still_accel_g;        // The accel magnitude must be within this of 1 g to count as still
+  uint32_t idle_samples;      // Number of consecutive still samples before going to low power
+} power_mode_config_t;
+
+esp_err_t power_mode_init(const power_mode_config_t *config);
+
+/**
+ * Switch between modes.  On a bus error the error is returned and the device is left in the mode
+ * it was in: entering low power puts the saved full rate registers back, entering full rate stays
+ * in low power so it can be retried.
+ */
+esp_err_t power_mode_enter_low_power(void);
+esp_err_t power_mode_enter_full_rate(void);
+power_mode_t power_mode_get(void);
+
+/**
+ * Feed every full rate sample in here.  After `idle_samples` still samples in a row the device is
+ * put into low power mode and POWER_MODE_LOW_POWER is returned; the caller should then stop
+ * sampling and call power_mode_wait_for_motion().  If low power mode can't be entered the error is
+ * logged and the device stays at full rate.
+ */
+power_mode_t power_mode_update(const vector_t *va, const vector_t *vg);
+
+/**
+ * Block until the wake on motion interrupt fires, then return to full rate sampling.
+ * @return ESP_OK once back at full rate, ESP_ERR_TIMEOUT if there was no motion, or the bus error.
+ */
+esp_err_t power_mode_wait_for_motion(TickType_t timeout);
+
+#endif // __POWER_MODE_H
@@ -0,0 +1,62 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __SELF_TEST_H
+#define __SELF_TEST_H
+
+#include "esp_err.h"
+
+#include "mpu9250.h"
+
+/**
+ * Factory self-test, following InvenSense AN-MPU-9250A-03 (accel / gyro) and the AK8963 datasheet.
+ *
+ * The self-test response (self-test on minus self-test off, averaged over 200 samples at 1 kHz) is
+ * compared with the factory trim from the SELF_TEST_* registers.  Takes about 0.5 s, so it can run
+ * at every boot.  The device must be still.  All changed registers are restored.
+ */
+
+typedef struct
+{
+  float factory[3];  // Factory self-test response from the trim registers, in LSB (0 if not trimmed)
+  float response[3]; // Measured self-test response, in LSB
+  float ratio[3];    // response / factory, 0 if not trimmed
+  bool pass[3];
+} self_test_axes_t;
+
+typedef struct
+{
+  self_test_axes_t accel;
+  self_test_axes_t gyro;
+  vector_t gyro_offset_dps; // Gyro offset with self-test off, must be within 20 dps to pass
+
+  bool mag_tested;
+  vector_t mag_field; // AK8963 self-test field, see ak8963_self_test()
+  bool mag_pass[3];
+
+  bool pass; // Every axis of every sensor that was tested
+  uint32_t elapsed_ms;
+} self_test_result_t;
+
+/**
+ * @param test_mag Also run the AK8963 self-test, only if it was enabled in i2c_mpu9250_init()
+ * @return ESP_OK if the test ran (see result->pass), or the bus / timeout error.
+ */
+esp_err_t mpu9250_self_test(bool test_mag, self_test_result_t *result);
+
+#endif // __SELF_TEST_H
@@ -0,0 +1,98 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+#include "freertos/FreeRTOS.h"
+#include "driver/i2c.h"
+#include "driver/spi_master.h"
+#include "driver/gpio.h"
+
+#include "mpu9250.h"
+
+/**
+ * Register access to the MPU9250, over I2C or SPI.  Create one with mpu9250_transport_i2c() or
+ * mpu9250_transport_spi() and hand it to mpu9250_set_transport() before i2c_mpu9250_init().  Without
+ * that the driver uses I2C_NUM_0 at MPU9250_I2C_ADDR, as it always has.
+ *
+ * Over SPI the AK8963 can't be put on the host bus with bypass mode, so it is reached through the
+ * MPU9250 internal I2C master instead, see ak8963_init_slave().
+ *
+ * There is one transport for the whole driver, not one per device: the calibration, ranges, auto
+ * ranging, mounting and AK8963 state in mpu9250.c and ak8963.c are all file statics, so a second
+ * MPU9250 would need its own copy of those too.  The read / write pair is also the seam for host
+ * tests, see host_test/fake_mpu9250.h.
+ */
+
+typedef enum
+{
+  MPU9250_BUS_I2C = 0,
+  MPU9250_BUS_SPI
+} mpu9250_bus_t;
+
+typedef struct
+{
+  mpu9250_bus_t bus;
+  esp_err_t (*read)(void *ctx, uint8_t reg, uint8_t *data, size_t len);
+  esp_err_t (*write)(void *ctx, uint8_t reg, const uint8_t *data, size_t len);
+  void *ctx;
+} mpu9250_transport_t;
+
+/**
+ * The MPU9250 limits SPI to 1 MHz for the configuration registers, 20 MHz is only allowed for the
+ * sensor, interrupt and FIFO registers.  Two devices are added to the bus, one at each clock, with
+ * `cs` driven by hand so they can share it.
+ *
+ * The bus must already be initialised with spi_bus_initialize(), with a DMA channel and a
+ * max_transfer_sz of at least MPU9250_SPI_MAX_TRANSFER.
+ */
+typedef struct
+{
+  spi_host_device_t host;
+  gpio_num_t cs;
+  int config_clock_hz;
+  int read_clock_hz;
+} mpu9250_spi_config_t;
+
+#define MPU9250_SPI_MAX_TRANSFER (MPU9250_FIFO_SIZE + 1) // A full FIFO, plus the register byte
+
+#define MPU9250_SPI_DEFAULT_CONFIG(spi_host, cs_gpio) \
+  {                                                   \
+    .host = (spi_host),                               \
+    .cs = (cs_gpio),                                  \
+    .config_clock_hz = 1000000,                       \
+    .read_clock_hz = 20000000,                        \
+  }
+
+esp_err_t mpu9250_transport_i2c(i2c_port_t port, uint8_t address, mpu9250_transport_t *t);
+esp_err_t mpu9250_transport_spi(const mpu9250_spi_config_t *config, mpu9250_transport_t *t);
+
+/**
+ * Use `t` for all MPU9250 register access.  Must be called before i2c_mpu9250_init().  `t` is
+ * copied, the context it points to must stay valid until the transport is replaced.
+ */
+esp_err_t mpu9250_set_transport(const mpu9250_transport_t *t);
+const mpu9250_transport_t *mpu9250_get_transport(void);
+
+/**
+ * Free a transport.  It must not be the one in use by the driver.
+ */
+void mpu9250_transport_delete(mpu9250_transport_t *t);
+
+#endif
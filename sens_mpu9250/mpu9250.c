@@ -16,12 +16,16 @@
  *                                                                           *
  *****************************************************************************/
 
+#include <math.h>
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "i2c-easy.h"
 #include "mpu9250.h"
 #include "ak8963.h"
+#include "transport.h"
 
 #define I2C_MASTER_SCL_IO 22     /*!< gpio number for I2C master clock */
 #define I2C_MASTER_SDA_IO 21     /*!< gpio number for I2C master data  */
@@ -31,10 +35,42 @@ static const char *TAG = "mpu9250";
 
 static bool initialised = false;
 static calibration_t *cal;
+static mpu9250_transport_t transport; // See mpu9250_set_transport()
 
 static float gyro_inv_scale = 1.0;
 static float accel_inv_scale = 1.0;
 
+// Precomputed accel conversion, used when the calibration has an accel_matrix
+static bool accel_affine = false;
+static conversion_t accel_conv; // Calibration and mounting, when accel_affine
+static conversion_t accel_mount_conv; // Mounting only, after the per axis accel_scale_lo / accel_scale_hi
+static conversion_t gyro_conv;
+static float gyro_counts_per_dps = 1.0;
+
+// Current full scale ranges, and auto ranging
+static uint8_t gyro_range = MPU9250_GYRO_FS_250;
+static uint8_t accel_range = MPU9250_ACCEL_FS_4;
+
+typedef struct
+{
+  uint32_t count;
+  uint16_t peak;
+  uint8_t settle;
+  uint32_t flags; // Of the last sample
+} range_state_t;
+
+static bool autorange_enabled = false;
+static mpu9250_autorange_config_t autorange;
+static range_state_t gyro_state;
+static range_state_t accel_state;
+
+// Accel / gyro mounting rotation, body = mounting * sensor
+static float mounting[3][3] = {{1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, 1.0}};
+static float mounting_inv[3][3] = {{1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, 1.0}};
+
+// Last temperature read, used by the gyro bias temperature model
+static float temperature = MPU9250_TEMP_OFFSET;
+
 typedef struct
 {
   uint8_t x;
@@ -43,6 +79,7 @@ typedef struct
 } power_settings_e;
 
 static esp_err_t enable_magnetometer(void);
+static esp_err_t check_transport(void);
 
 esp_err_t i2c_mpu9250_init(calibration_t *c,bool use_mag)
 {
@@ -61,9 +98,16 @@ esp_err_t i2c_mpu9250_init(calibration_t *c,bool use_mag)
 
   ESP_LOGD(TAG, "i2c_mpu9250_init");
 
-  ESP_ERROR_CHECK(i2c_write_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_DEVICE_RESET_BIT, 1));
+  ESP_ERROR_CHECK(check_transport());
+  ESP_ERROR_CHECK(mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_DEVICE_RESET_BIT, 1, 1));
   vTaskDelay(10 / portTICK_PERIOD_MS);
 
+  // Over SPI, turn the I2C slave interface off so bus noise can't switch it back (the reset turns it on).
+  if (transport.bus == MPU9250_BUS_SPI)
+  {
+    ESP_ERROR_CHECK(mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_I2C_IF_DIS_BIT, 1, 1));
+  }
+
   // define clock source
   ESP_ERROR_CHECK(set_clock_source(MPU9250_CLOCK_PLL_XGYRO));
   vTaskDelay(10 / portTICK_PERIOD_MS);
@@ -72,7 +116,7 @@ esp_err_t i2c_mpu9250_init(calibration_t *c,bool use_mag)
   ESP_ERROR_CHECK(set_full_scale_gyro_range(MPU9250_GYRO_FS_250));
   vTaskDelay(10 / portTICK_PERIOD_MS);
 
-  // define accel range
+  // define accel range, this also builds the accel conversion
   ESP_ERROR_CHECK(set_full_scale_accel_range(MPU9250_ACCEL_FS_4));
   vTaskDelay(10 / portTICK_PERIOD_MS);
 
@@ -91,15 +135,121 @@ esp_err_t i2c_mpu9250_init(calibration_t *c,bool use_mag)
   return ESP_OK;
 }
 
+esp_err_t mpu9250_set_transport(const mpu9250_transport_t *t)
+{
+  if (initialised)
+  {
+    ESP_LOGE(TAG, "mpu9250_set_transport must be called before i2c_mpu9250_init");
+    return ESP_ERR_INVALID_STATE;
+  }
+  transport = *t;
+  return ESP_OK;
+}
+
+const mpu9250_transport_t *mpu9250_get_transport(void)
+{
+  return &transport;
+}
+
+// Fall back to the original I2C wiring when no transport was set.
+static esp_err_t check_transport(void)
+{
+  if (transport.read != NULL)
+  {
+    return ESP_OK;
+  }
+  return mpu9250_transport_i2c(I2C_MASTER_NUM, MPU9250_I2C_ADDR, &transport);
+}
+
+esp_err_t mpu9250_read_bytes(uint8_t reg, uint8_t *data, size_t len)
+{
+  esp_err_t ret = check_transport();
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  return transport.read(transport.ctx, reg, data, len);
+}
+
+esp_err_t mpu9250_read_byte(uint8_t reg, uint8_t *data)
+{
+  return mpu9250_read_bytes(reg, data, 1);
+}
+
+esp_err_t mpu9250_write_byte(uint8_t reg, uint8_t data)
+{
+  return mpu9250_write_bytes(reg, &data, 1);
+}
+
+esp_err_t mpu9250_write_bytes(uint8_t reg, const uint8_t *data, size_t len)
+{
+  esp_err_t ret = check_transport();
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  return transport.write(transport.ctx, reg, data, len);
+}
+
+esp_err_t mpu9250_write_bits(uint8_t reg, uint8_t bit, uint8_t length, uint8_t value)
+{
+  uint8_t byte;
+  esp_err_t ret = mpu9250_read_byte(reg, &byte);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  uint8_t mask = get_bit_mask(bit, length);
+  byte = byte ^ ((byte ^ (value << bit)) & mask);
+  return mpu9250_write_byte(reg, byte);
+}
+
+static esp_err_t read_bit(uint8_t reg, uint8_t bit, uint8_t *result)
+{
+  uint8_t byte;
+  esp_err_t ret = mpu9250_read_byte(reg, &byte);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  *result = (byte >> bit) & 1;
+  return ESP_OK;
+}
+
+esp_err_t mpu9250_fifo_reset(void)
+{
+  return mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_FIFO_RESET_BIT, 1, 1);
+}
+
+esp_err_t mpu9250_fifo_count(uint16_t *count)
+{
+  uint8_t bytes[2];
+  esp_err_t ret = mpu9250_read_bytes(MPU9250_RA_FIFO_COUNTH, bytes, 2);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  // FIFO_COUNT is 13 bits
+  *count = ((bytes[0] & 0x1F) << 8) | bytes[1];
+  return ESP_OK;
+}
+
+esp_err_t mpu9250_fifo_read(uint8_t *data, size_t len)
+{
+  return mpu9250_read_bytes(MPU9250_RA_FIFO_R_W, data, len);
+}
+
 esp_err_t set_clock_source(uint8_t adrs)
 {
-  return i2c_write_bits(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_CLKSEL_BIT, MPU9250_PWR1_CLKSEL_LENGTH, adrs);
+  return mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_CLKSEL_BIT, MPU9250_PWR1_CLKSEL_LENGTH, adrs);
 }
 
 esp_err_t get_clock_source(uint8_t *clock_source)
 {
   uint8_t byte;
-  esp_err_t ret = i2c_read_byte(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_1, &byte);
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_PWR_MGMT_1, &byte);
   if (ret != ESP_OK)
   {
     return ret;
@@ -129,8 +279,17 @@ float get_gyro_inv_scale(uint8_t scale_factor)
 
 esp_err_t set_full_scale_gyro_range(uint8_t adrs)
 {
+  // Only switch the conversion once the device has switched, so the two can't disagree.
+  esp_err_t ret = mpu9250_write_bits(MPU9250_RA_GYRO_CONFIG, MPU9250_GCONFIG_FS_SEL_BIT, MPU9250_GCONFIG_FS_SEL_LENGTH, adrs);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  gyro_range = adrs;
   gyro_inv_scale = get_gyro_inv_scale(adrs);
-  return i2c_write_bits(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_GYRO_CONFIG, MPU9250_GCONFIG_FS_SEL_BIT, MPU9250_GCONFIG_FS_SEL_LENGTH, adrs);
+  mpu9250_update_calibration();
+  return ESP_OK;
 }
 
 float get_accel_inv_scale(uint8_t scale_factor)
@@ -151,21 +310,145 @@ float get_accel_inv_scale(uint8_t scale_factor)
   }
 }
 
+void conversion_init(conversion_t *c, const float rotation[3][3], const float matrix[3][3], const vector_t *in_scale, const vector_t *offset)
+{
+  float scale[3] = {1.0f, 1.0f, 1.0f};
+  if (in_scale != NULL)
+  {
+    scale[0] = in_scale->x;
+    scale[1] = in_scale->y;
+    scale[2] = in_scale->z;
+  }
+
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      float sum = 0.0f;
+      for (int k = 0; k < 3; k++)
+      {
+        float r = rotation != NULL ? rotation[i][k] : (i == k);
+        float m = matrix != NULL ? matrix[k][j] : (k == j);
+        sum += r * m;
+      }
+      c->m[i][j] = sum * scale[j];
+    }
+  }
+
+  c->offset.x = offset != NULL ? offset->x / scale[0] : 0.0f;
+  c->offset.y = offset != NULL ? offset->y / scale[1] : 0.0f;
+  c->offset.z = offset != NULL ? offset->z / scale[2] : 0.0f;
+}
+
+void conversion_apply(const conversion_t *c, float x, float y, float z, vector_t *v)
+{
+  x -= c->offset.x;
+  y -= c->offset.y;
+  z -= c->offset.z;
+
+  v->x = c->m[0][0] * x + c->m[0][1] * y + c->m[0][2] * z;
+  v->y = c->m[1][0] * x + c->m[1][1] * y + c->m[1][2] * z;
+  v->z = c->m[2][0] * x + c->m[2][1] * y + c->m[2][2] * z;
+}
+
+void mpu9250_mounting_from_axes(int8_t body_x, int8_t body_y, int8_t body_z, float r[3][3])
+{
+  int8_t axes[3] = {body_x, body_y, body_z};
+
+  memset(r, 0, sizeof(float) * 9);
+  for (int i = 0; i < 3; i++)
+  {
+    int a = axes[i] < 0 ? -axes[i] : axes[i];
+    if (a >= MPU9250_AXIS_X && a <= MPU9250_AXIS_Z)
+    {
+      // An invalid code leaves a zero row, which mpu9250_set_mounting() rejects.
+      r[i][a - 1] = axes[i] < 0 ? -1.0f : 1.0f;
+    }
+  }
+}
+
+esp_err_t mpu9250_set_mounting(const float r[3][3])
+{
+  float det = r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1]) -
+              r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0]) +
+              r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+  if (fabsf(det) < 1e-6f)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  mounting_inv[0][0] = (r[1][1] * r[2][2] - r[1][2] * r[2][1]) / det;
+  mounting_inv[0][1] = (r[0][2] * r[2][1] - r[0][1] * r[2][2]) / det;
+  mounting_inv[0][2] = (r[0][1] * r[1][2] - r[0][2] * r[1][1]) / det;
+  mounting_inv[1][0] = (r[1][2] * r[2][0] - r[1][0] * r[2][2]) / det;
+  mounting_inv[1][1] = (r[0][0] * r[2][2] - r[0][2] * r[2][0]) / det;
+  mounting_inv[1][2] = (r[0][2] * r[1][0] - r[0][0] * r[1][2]) / det;
+  mounting_inv[2][0] = (r[1][0] * r[2][1] - r[1][1] * r[2][0]) / det;
+  mounting_inv[2][1] = (r[0][1] * r[2][0] - r[0][0] * r[2][1]) / det;
+  mounting_inv[2][2] = (r[0][0] * r[1][1] - r[0][1] * r[1][0]) / det;
+  memcpy(mounting, r, sizeof(mounting));
+
+  mpu9250_update_calibration();
+  return ESP_OK;
+}
+
+void mpu9250_body_to_sensor(vector_t *v)
+{
+  vector_t b = *v;
+  v->x = mounting_inv[0][0] * b.x + mounting_inv[0][1] * b.y + mounting_inv[0][2] * b.z;
+  v->y = mounting_inv[1][0] * b.x + mounting_inv[1][1] * b.y + mounting_inv[1][2] * b.z;
+  v->z = mounting_inv[2][0] * b.x + mounting_inv[2][1] * b.y + mounting_inv[2][2] * b.z;
+}
+
+void mpu9250_update_calibration(void)
+{
+  // Gyro: body = mounting * scale * (raw + bias / scale), the bias is added per sample.
+  vector_t gyro_scale = {.x = gyro_inv_scale, .y = gyro_inv_scale, .z = gyro_inv_scale};
+  conversion_init(&gyro_conv, mounting, NULL, &gyro_scale, NULL);
+  gyro_counts_per_dps = 1.0f / gyro_inv_scale;
+
+  conversion_init(&accel_mount_conv, mounting, NULL, NULL, NULL);
+
+  if (cal == NULL)
+  {
+    return;
+  }
+
+  accel_affine = cal->accel_matrix[0][0] != 0.0f || cal->accel_matrix[1][1] != 0.0f || cal->accel_matrix[2][2] != 0.0f;
+  if (accel_affine)
+  {
+    // Fold the mounting and range scale into the matrix, and the bias into counts.
+    vector_t accel_scale = {.x = accel_inv_scale, .y = accel_inv_scale, .z = accel_inv_scale};
+    conversion_init(&accel_conv, mounting, cal->accel_matrix, &accel_scale, &cal->accel_bias);
+  }
+
+  ak8963_update_calibration();
+}
+
 esp_err_t set_full_scale_accel_range(uint8_t adrs)
 {
+  // Only switch the conversion once the device has switched, so the two can't disagree.
+  esp_err_t ret = mpu9250_write_bits(MPU9250_RA_ACCEL_CONFIG_1, MPU9250_ACONFIG_FS_SEL_BIT, MPU9250_ACONFIG_FS_SEL_LENGTH, adrs);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  accel_range = adrs;
   accel_inv_scale = get_accel_inv_scale(adrs);
-  return i2c_write_bits(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_ACCEL_CONFIG_1, MPU9250_ACONFIG_FS_SEL_BIT, MPU9250_ACONFIG_FS_SEL_LENGTH, adrs);
+  mpu9250_update_calibration();
+  return ESP_OK;
 }
 
 esp_err_t set_sleep_enabled(bool state)
 {
-  return i2c_write_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_SLEEP_BIT, state ? 0x01 : 0x00);
+  return mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_SLEEP_BIT, 1, state ? 0x01 : 0x00);
 }
 
 esp_err_t get_sleep_enabled(bool *state)
 {
   uint8_t bit;
-  esp_err_t ret = i2c_read_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_SLEEP_BIT, &bit);
+  esp_err_t ret = read_bit(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_SLEEP_BIT, &bit);
   if (ret != ESP_OK)
   {
     return ret;
@@ -187,15 +470,124 @@ float scale_accel(float value, float offset, float scale_lo, float scale_hi)
   }
 }
 
+esp_err_t mpu9250_set_autorange(const mpu9250_autorange_config_t *config)
+{
+  if (config == NULL)
+  {
+    autorange_enabled = false;
+    return ESP_OK;
+  }
+  if (config->gyro_min > config->gyro_max || config->gyro_max > MPU9250_GYRO_FS_2000 ||
+      config->accel_min > config->accel_max || config->accel_max > MPU9250_ACCEL_FS_16 ||
+      config->down_threshold >= config->up_threshold / 2)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  autorange = *config;
+  memset(&gyro_state, 0, sizeof(range_state_t));
+  memset(&accel_state, 0, sizeof(range_state_t));
+
+  esp_err_t ret = ESP_OK;
+  if (gyro_range < autorange.gyro_min || gyro_range > autorange.gyro_max)
+  {
+    ret = set_full_scale_gyro_range(gyro_range < autorange.gyro_min ? autorange.gyro_min : autorange.gyro_max);
+  }
+  if (ret == ESP_OK && (accel_range < autorange.accel_min || accel_range > autorange.accel_max))
+  {
+    ret = set_full_scale_accel_range(accel_range < autorange.accel_min ? autorange.accel_min : autorange.accel_max);
+  }
+
+  autorange_enabled = ret == ESP_OK;
+  return ret;
+}
+
+uint32_t mpu9250_get_sample_flags(void)
+{
+  return accel_state.flags | gyro_state.flags;
+}
+
+/**
+ * Flag a sample, which has already been converted at the current range, and pick the range for the
+ * next one.  The new range is written and the conversion rebuilt before the next sample is read, so
+ * the scale always follows the sample stream.
+ */
+static void autorange_step(range_state_t *st, int16_t x, int16_t y, int16_t z,
+                           uint8_t range, uint8_t min, uint8_t max, esp_err_t (*set_range)(uint8_t),
+                           uint32_t clipped, uint32_t switching)
+{
+  uint16_t ax = x < 0 ? -(int32_t)x : x;
+  uint16_t ay = y < 0 ? -(int32_t)y : y;
+  uint16_t az = z < 0 ? -(int32_t)z : z;
+  uint16_t peak = ax > ay ? (ax > az ? ax : az) : (ay > az ? ay : az);
+
+  st->flags = 0;
+  if (peak >= (autorange_enabled ? autorange.up_threshold : INT16_MAX))
+  {
+    st->flags |= clipped;
+  }
+  if (!autorange_enabled)
+  {
+    return;
+  }
+  if (st->settle > 0)
+  {
+    // Don't judge the range from samples that may be at either scale.
+    st->settle -= 1;
+    st->flags |= switching;
+    return;
+  }
+
+  uint8_t next = range;
+  if (peak >= autorange.up_threshold)
+  {
+    if (range < max)
+      next = range + 1;
+  }
+  else
+  {
+    if (peak > st->peak)
+      st->peak = peak;
+    if (++st->count >= autorange.hold_samples)
+    {
+      if (range > min && st->peak < autorange.down_threshold)
+        next = range - 1;
+      st->count = 0;
+      st->peak = 0;
+    }
+  }
+
+  if (next != range && set_range(next) == ESP_OK)
+  {
+    ESP_LOGD(TAG, "Range %d -> %d", range, next);
+    st->settle = autorange.settle_samples;
+    st->count = 0;
+    st->peak = 0;
+  }
+}
+
 void align_accel(uint8_t bytes[6], vector_t *v)
 {
   int16_t xi = BYTE_2_INT_BE(bytes, 0);
   int16_t yi = BYTE_2_INT_BE(bytes, 2);
   int16_t zi = BYTE_2_INT_BE(bytes, 4);
 
-  v->x = scale_accel((float)xi, cal->accel_offset.x, cal->accel_scale_lo.x, cal->accel_scale_hi.x);
-  v->y = scale_accel((float)yi, cal->accel_offset.y, cal->accel_scale_lo.y, cal->accel_scale_hi.y);
-  v->z = scale_accel((float)zi, cal->accel_offset.z, cal->accel_scale_lo.z, cal->accel_scale_hi.z);
+  if (accel_affine)
+  {
+    conversion_apply(&accel_conv, xi, yi, zi, v);
+  }
+  else
+  {
+    // The lo / hi scaling is piecewise, so it can't be folded into a matrix; mount after it.
+    conversion_apply(&accel_mount_conv,
+                     scale_accel((float)xi, cal->accel_offset.x, cal->accel_scale_lo.x, cal->accel_scale_hi.x),
+                     scale_accel((float)yi, cal->accel_offset.y, cal->accel_scale_lo.y, cal->accel_scale_hi.y),
+                     scale_accel((float)zi, cal->accel_offset.z, cal->accel_scale_lo.z, cal->accel_scale_hi.z),
+                     v);
+  }
+
+  autorange_step(&accel_state, xi, yi, zi, accel_range, autorange.accel_min, autorange.accel_max,
+                 set_full_scale_accel_range, MPU9250_SAMPLE_ACCEL_CLIPPED, MPU9250_SAMPLE_ACCEL_SWITCHING);
 }
 
 esp_err_t get_accel(vector_t *v)
@@ -204,7 +596,7 @@ esp_err_t get_accel(vector_t *v)
   esp_err_t ret;
   uint8_t bytes[6];
 
-  ret = i2c_read_bytes(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_ACCEL_XOUT_H, bytes, 6);
+  ret = mpu9250_read_bytes(MPU9250_ACCEL_XOUT_H, bytes, 6);
   if (ret != ESP_OK)
   {
     return ret;
@@ -215,22 +607,77 @@ esp_err_t get_accel(vector_t *v)
   return ESP_OK;
 }
 
+/**
+ * The gyro bias at the last known temperature.
+ */
+static void gyro_bias(vector_t *b)
+{
+  float dt = temperature - cal->gyro_temp_ref;
+
+  // Horner's method, highest order first
+  b->x = 0.0f;
+  b->y = 0.0f;
+  b->z = 0.0f;
+  for (int k = GYRO_TEMP_POLY_ORDER - 1; k >= 0; k--)
+  {
+    b->x = (b->x + cal->gyro_temp_coeff[k].x) * dt;
+    b->y = (b->y + cal->gyro_temp_coeff[k].y) * dt;
+    b->z = (b->z + cal->gyro_temp_coeff[k].z) * dt;
+  }
+
+  b->x += cal->gyro_bias_offset.x;
+  b->y += cal->gyro_bias_offset.y;
+  b->z += cal->gyro_bias_offset.z;
+}
+
+esp_err_t get_accel_raw(vector_t *v)
+{
+  esp_err_t ret;
+  uint8_t bytes[6];
+
+  ret = mpu9250_read_bytes(MPU9250_ACCEL_XOUT_H, bytes, 6);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  v->x = BYTE_2_INT_BE(bytes, 0) * accel_inv_scale;
+  v->y = BYTE_2_INT_BE(bytes, 2) * accel_inv_scale;
+  v->z = BYTE_2_INT_BE(bytes, 4) * accel_inv_scale;
+
+  return ESP_OK;
+}
+
 void align_gryo(uint8_t bytes[6], vector_t *v)
 {
   int16_t xi = BYTE_2_INT_BE(bytes, 0);
   int16_t yi = BYTE_2_INT_BE(bytes, 2);
   int16_t zi = BYTE_2_INT_BE(bytes, 4);
 
-  v->x = (float)xi * gyro_inv_scale + cal->gyro_bias_offset.x;
-  v->y = (float)yi * gyro_inv_scale + cal->gyro_bias_offset.y;
-  v->z = (float)zi * gyro_inv_scale + cal->gyro_bias_offset.z;
+  vector_t b;
+  gyro_bias(&b);
+
+  // The bias changes (temperature, bias tracker), so it goes in as counts rather than being folded in.
+  conversion_apply(&gyro_conv,
+                   xi + b.x * gyro_counts_per_dps,
+                   yi + b.y * gyro_counts_per_dps,
+                   zi + b.z * gyro_counts_per_dps,
+                   v);
+
+  autorange_step(&gyro_state, xi, yi, zi, gyro_range, autorange.gyro_min, autorange.gyro_max,
+                 set_full_scale_gyro_range, MPU9250_SAMPLE_GYRO_CLIPPED, MPU9250_SAMPLE_GYRO_SWITCHING);
+}
+
+static float align_temp(uint8_t bytes[2])
+{
+  return (float)BYTE_2_INT_BE(bytes, 0) / MPU9250_TEMP_SENSITIVITY + MPU9250_TEMP_OFFSET;
 }
 
 esp_err_t get_gyro(vector_t *v)
 {
   esp_err_t ret;
   uint8_t bytes[6];
-  ret = i2c_read_bytes(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_GYRO_XOUT_H, bytes, 6);
+  ret = mpu9250_read_bytes(MPU9250_GYRO_XOUT_H, bytes, 6);
   if (ret != ESP_OK)
   {
     return ret;
@@ -242,10 +689,16 @@ esp_err_t get_gyro(vector_t *v)
 }
 
 esp_err_t get_accel_gyro(vector_t *va, vector_t *vg)
+{
+  float temp;
+  return get_accel_gyro_temp(va, vg, &temp);
+}
+
+esp_err_t get_accel_gyro_temp(vector_t *va, vector_t *vg, float *temp)
 {
   esp_err_t ret;
   uint8_t bytes[14];
-  ret = i2c_read_bytes(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_ACCEL_XOUT_H, bytes, 14);
+  ret = mpu9250_read_bytes(MPU9250_ACCEL_XOUT_H, bytes, 14);
   if (ret != ESP_OK)
   {
     return ret;
@@ -254,9 +707,11 @@ esp_err_t get_accel_gyro(vector_t *va, vector_t *vg)
   // Accelerometer - bytes 0:5
   align_accel(bytes, va);
 
-  // Skip Temperature - bytes 6:7
+  // Temperature - bytes 6:7, needed before the gyro for the bias model
+  temperature = align_temp(&bytes[6]);
+  *temp = temperature;
 
-  // Gyroscope - bytes 9:13
+  // Gyroscope - bytes 8:13
   align_gryo(&bytes[8], vg);
 
   return ESP_OK;
@@ -286,13 +741,13 @@ esp_err_t get_mag_raw(uint8_t bytes[6])
 
 esp_err_t get_device_id(uint8_t *val)
 {
-  return i2c_read_byte(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_WHO_AM_I, val);
+  return mpu9250_read_byte(MPU9250_WHO_AM_I, val);
 }
 
 esp_err_t get_temperature_raw(uint16_t *val)
 {
   uint8_t bytes[2];
-  esp_err_t ret = i2c_read_bytes(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_TEMP_OUT_H, bytes, 2);
+  esp_err_t ret = mpu9250_read_bytes(MPU9250_TEMP_OUT_H, bytes, 2);
   if (ret != ESP_OK)
   {
     return ret;
@@ -303,13 +758,14 @@ esp_err_t get_temperature_raw(uint16_t *val)
 
 esp_err_t get_temperature_celsius(float *val)
 {
-  uint16_t raw_temp;
-  esp_err_t ret = get_temperature_raw(&raw_temp);
+  uint8_t bytes[2];
+  esp_err_t ret = mpu9250_read_bytes(MPU9250_TEMP_OUT_H, bytes, 2);
   if (ret != ESP_OK)
   {
     return ret;
   }
-  *val = ((float)raw_temp) / 333.87 + 21.0;
+  temperature = align_temp(bytes);
+  *val = temperature;
 
   return ESP_OK;
 }
@@ -318,6 +774,22 @@ static esp_err_t enable_magnetometer(void)
 {
   ESP_LOGI(TAG, "Enabling magnetometer");
 
+  if (transport.bus == MPU9250_BUS_SPI)
+  {
+    // The AK8963 is only on the auxiliary bus, reach it with the internal I2C master.
+    ESP_ERROR_CHECK(set_bypass_enabled(false));
+    ESP_ERROR_CHECK(mpu9250_write_byte(MPU9250_RA_I2C_MST_CTRL, MPU9250_I2C_MST_CTRL_400KHZ));
+    ESP_ERROR_CHECK(set_i2c_master_mode(true));
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+
+    esp_err_t ret = ak8963_init_slave(cal);
+    if (ret == ESP_OK)
+    {
+      ESP_LOGI(TAG, "Magnetometer enabled, through the I2C master");
+    }
+    return ret;
+  }
+
   ESP_ERROR_CHECK(set_i2c_master_mode(false));
   vTaskDelay(100 / portTICK_PERIOD_MS);
 
@@ -342,7 +814,7 @@ static esp_err_t enable_magnetometer(void)
 esp_err_t get_bypass_enabled(bool *state)
 {
   uint8_t bit;
-  esp_err_t ret = i2c_read_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_INT_PIN_CFG, MPU9250_INTCFG_BYPASS_EN_BIT, &bit);
+  esp_err_t ret = read_bit(MPU9250_RA_INT_PIN_CFG, MPU9250_INTCFG_BYPASS_EN_BIT, &bit);
   if (ret != ESP_OK)
   {
     return ret;
@@ -354,13 +826,13 @@ esp_err_t get_bypass_enabled(bool *state)
 
 esp_err_t set_bypass_enabled(bool state)
 {
-  return i2c_write_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_INT_PIN_CFG, MPU9250_INTCFG_BYPASS_EN_BIT, state ? 1 : 0);
+  return mpu9250_write_bits(MPU9250_RA_INT_PIN_CFG, MPU9250_INTCFG_BYPASS_EN_BIT, 1, state ? 1 : 0);
 }
 
 esp_err_t get_i2c_master_mode(bool *state)
 {
   uint8_t bit;
-  esp_err_t ret = i2c_read_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_I2C_MST_EN_BIT, &bit);
+  esp_err_t ret = read_bit(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_I2C_MST_EN_BIT, &bit);
   if (ret != ESP_OK)
   {
     return ret;
@@ -372,7 +844,7 @@ esp_err_t get_i2c_master_mode(bool *state)
 
 esp_err_t set_i2c_master_mode(bool state)
 {
-  return i2c_write_bit(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_I2C_MST_EN_BIT, state ? 1 : 0);
+  return mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_I2C_MST_EN_BIT, 1, state ? 1 : 0);
 }
 
 /**
@@ -381,7 +853,7 @@ esp_err_t set_i2c_master_mode(bool state)
 esp_err_t get_gyro_power_settings(power_settings_e *ps)
 {
   uint8_t byte;
-  esp_err_t ret = i2c_read_byte(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_2, &byte);
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_PWR_MGMT_2, &byte);
   if (ret != ESP_OK)
   {
     return ret;
@@ -402,7 +874,7 @@ esp_err_t get_gyro_power_settings(power_settings_e *ps)
 esp_err_t get_accel_power_settings(power_settings_e *ps)
 {
   uint8_t byte;
-  esp_err_t ret = i2c_read_byte(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_PWR_MGMT_2, &byte);
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_PWR_MGMT_2, &byte);
   if (ret != ESP_OK)
   {
     return ret;
@@ -423,7 +895,7 @@ esp_err_t get_accel_power_settings(power_settings_e *ps)
 esp_err_t get_full_scale_accel_range(uint8_t *full_scale_accel_range)
 {
   uint8_t byte;
-  esp_err_t ret = i2c_read_byte(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_ACCEL_CONFIG_1, &byte);
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_ACCEL_CONFIG_1, &byte);
   if (ret != ESP_OK)
   {
     return ret;
@@ -443,7 +915,7 @@ esp_err_t get_full_scale_accel_range(uint8_t *full_scale_accel_range)
 esp_err_t get_full_scale_gyro_range(uint8_t *full_scale_gyro_range)
 {
   uint8_t byte;
-  esp_err_t ret = i2c_read_byte(I2C_MASTER_NUM, MPU9250_I2C_ADDR, MPU9250_RA_GYRO_CONFIG, &byte);
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_GYRO_CONFIG, &byte);
   if (ret != ESP_OK)
   {
     return ret;
@@ -469,34 +941,90 @@ const char *CLK_RNG[] = {
     "6 (Internal 20MHz oscillator)",
     "7 (Stops the clock and keeps timing generator in reset)"};
 
-void mpu9250_print_settings(void)
+typedef struct
 {
+  uint8_t reg;
+  uint8_t len;
+} burst_t;
+
+// The mpu9250_config_t bursts, in struct order
+static const burst_t config_bursts[] = {
+    {MPU9250_RA_SMPLRT_DIV, MPU9250_RA_I2C_SLV4_DI - MPU9250_RA_SMPLRT_DIV + 1},
+    {MPU9250_RA_INT_PIN_CFG, MPU9250_RA_INT_ENABLE - MPU9250_RA_INT_PIN_CFG + 1},
+    {MPU9250_RA_I2C_MST_DELAY_CTRL, MPU9250_RA_PWR_MGMT_2 - MPU9250_RA_I2C_MST_DELAY_CTRL + 1},
+    {MPU9250_WHO_AM_I, 1},
+};
 
-  uint8_t device_id;
-  ESP_ERROR_CHECK(get_device_id(&device_id));
+_Static_assert(sizeof(mpu9250_config_t) == 29 + 2 + 6 + 1, "mpu9250_config_t must match config_bursts");
 
-  bool bypass_enabled;
-  ESP_ERROR_CHECK(get_bypass_enabled(&bypass_enabled));
+esp_err_t mpu9250_get_config(mpu9250_config_t *config)
+{
+  uint8_t *p = (uint8_t *)config;
+  for (int i = 0; i < sizeof(config_bursts) / sizeof(config_bursts[0]); i++)
+  {
+    esp_err_t ret = mpu9250_read_bytes(config_bursts[i].reg, p, config_bursts[i].len);
+    if (ret != ESP_OK)
+    {
+      return ret;
+    }
+    p += config_bursts[i].len;
+  }
 
-  bool sleep_enabled;
-  ESP_ERROR_CHECK(get_sleep_enabled(&sleep_enabled));
+  return ESP_OK;
+}
 
-  bool i2c_master_mode;
-  ESP_ERROR_CHECK(get_i2c_master_mode(&i2c_master_mode));
+static bool is_volatile_register(uint8_t reg)
+{
+  return (reg >= MPU9250_RA_WOM_THR + 1 && reg < MPU9250_RA_FIFO_EN) ||
+         reg == MPU9250_RA_I2C_SLV4_DI ||
+         reg == MPU9250_RA_SIGNAL_PATH_RESET;
+}
 
-  uint8_t clock_source;
-  ESP_ERROR_CHECK(get_clock_source(&clock_source));
+int mpu9250_config_diff(const mpu9250_config_t *expected, const mpu9250_config_t *actual, uint8_t *reg)
+{
+  const uint8_t *e = (const uint8_t *)expected;
+  const uint8_t *a = (const uint8_t *)actual;
+  int count = 0;
 
-  power_settings_e accel_ps;
-  ESP_ERROR_CHECK(get_accel_power_settings(&accel_ps));
+  for (int i = 0; i < sizeof(config_bursts) / sizeof(config_bursts[0]); i++)
+  {
+    for (int j = 0; j < config_bursts[i].len; j++, e++, a++)
+    {
+      uint8_t r = config_bursts[i].reg + j;
+      if (*e == *a || is_volatile_register(r))
+      {
+        continue;
+      }
+      if (count == 0 && reg != NULL)
+      {
+        *reg = r;
+      }
+      count++;
+    }
+  }
+
+  return count;
+}
 
-  power_settings_e gyro_ps;
-  ESP_ERROR_CHECK(get_gyro_power_settings(&gyro_ps));
+static void print_mpu9250_settings(const mpu9250_config_t *config)
+{
+  bool bypass_enabled = (config->int_pin_cfg >> MPU9250_INTCFG_BYPASS_EN_BIT) & 1;
+  bool sleep_enabled = (config->pwr_mgmt_1 >> MPU9250_PWR1_SLEEP_BIT) & 1;
+  bool i2c_master_mode = (config->user_ctrl >> MPU9250_USERCTRL_I2C_MST_EN_BIT) & 1;
+  uint8_t clock_source = config->pwr_mgmt_1 & 0x07;
+  uint8_t pwr_mgmt_2 = config->pwr_mgmt_2;
 
   ESP_LOGI(TAG, "MPU9250:");
-  ESP_LOGI(TAG, "--> i2c bus: 0x%02x", I2C_MASTER_NUM);
-  ESP_LOGI(TAG, "--> Device address: 0x%02x", MPU9250_I2C_ADDR);
-  ESP_LOGI(TAG, "--> Device ID: 0x%02x", device_id);
+  if (transport.bus == MPU9250_BUS_SPI)
+  {
+    ESP_LOGI(TAG, "--> Bus: SPI");
+  }
+  else
+  {
+    ESP_LOGI(TAG, "--> i2c bus: 0x%02x", I2C_MASTER_NUM);
+    ESP_LOGI(TAG, "--> Device address: 0x%02x", MPU9250_I2C_ADDR);
+  }
+  ESP_LOGI(TAG, "--> Device ID: 0x%02x", config->who_am_i);
   ESP_LOGI(TAG, "--> initialised: %s", initialised ? "Yes" : "No");
   ESP_LOGI(TAG, "--> BYPASS enabled: %s", bypass_enabled ? "Yes" : "No");
   ESP_LOGI(TAG, "--> SleepEnabled Mode: %s", sleep_enabled ? "On" : "Off");
@@ -504,21 +1032,27 @@ void mpu9250_print_settings(void)
   ESP_LOGI(TAG, "--> Power Management (0x6B, 0x6C):");
   ESP_LOGI(TAG, "  --> Clock Source: %d %s", clock_source, CLK_RNG[clock_source]);
   ESP_LOGI(TAG, "  --> Accel enabled (x, y, z): (%s, %s, %s)",
-           YN(accel_ps.x),
-           YN(accel_ps.y),
-           YN(accel_ps.z));
+           YN((pwr_mgmt_2 >> 5) & 1),
+           YN((pwr_mgmt_2 >> 4) & 1),
+           YN((pwr_mgmt_2 >> 3) & 1));
   ESP_LOGI(TAG, "  --> Gyro enabled (x, y, z): (%s, %s, %s)",
-           YN(gyro_ps.x),
-           YN(gyro_ps.y),
-           YN(gyro_ps.z));
+           YN((pwr_mgmt_2 >> 2) & 1),
+           YN((pwr_mgmt_2 >> 1) & 1),
+           YN((pwr_mgmt_2 >> 0) & 1));
+}
+
+void mpu9250_print_settings(void)
+{
+  mpu9250_config_t config;
+  ESP_ERROR_CHECK(mpu9250_get_config(&config));
+  print_mpu9250_settings(&config);
 }
 
 const char *FS_RANGE[] = {"±2g (0)", "±4g (1)", "±8g (2)", "±16g (3)"};
 
-void print_accel_settings(void)
+static void print_accel_settings(const mpu9250_config_t *config)
 {
-  uint8_t full_scale_accel_range;
-  ESP_ERROR_CHECK(get_full_scale_accel_range(&full_scale_accel_range));
+  uint8_t full_scale_accel_range = (config->accel_config_1 >> MPU9250_ACONFIG_FS_SEL_BIT) & 0x03;
 
   ESP_LOGI(TAG, "Accelerometer:");
   ESP_LOGI(TAG, "--> Full Scale Range (0x1C): %s", FS_RANGE[full_scale_accel_range]);
@@ -532,9 +1066,15 @@ void print_accel_settings(void)
   ESP_LOGI(TAG, "    --> x: (%f, %f)", cal->accel_scale_lo.x, cal->accel_scale_hi.x);
   ESP_LOGI(TAG, "    --> y: (%f, %f)", cal->accel_scale_lo.y, cal->accel_scale_hi.y);
   ESP_LOGI(TAG, "    --> z: (%f, %f)", cal->accel_scale_lo.z, cal->accel_scale_hi.z);
+  ESP_LOGI(TAG, "  --> Six position fit: %s", accel_affine ? "Yes" : "No");
+  ESP_LOGI(TAG, "    --> Bias: (%f, %f, %f)", cal->accel_bias.x, cal->accel_bias.y, cal->accel_bias.z);
+  for (int i = 0; i < 3; i++)
+  {
+    ESP_LOGI(TAG, "    --> %f %f %f", cal->accel_matrix[i][0], cal->accel_matrix[i][1], cal->accel_matrix[i][2]);
+  }
 };
 
-void print_gyro_settings(void)
+static void print_gyro_settings(const mpu9250_config_t *config)
 {
   const char *FS_RANGE[] = {
       "+250 dps (0)",
@@ -542,8 +1082,7 @@ void print_gyro_settings(void)
       "+1000 dps (2)",
       "+2000 dps (3)"};
 
-  uint8_t full_scale_gyro_range;
-  ESP_ERROR_CHECK(get_full_scale_gyro_range(&full_scale_gyro_range));
+  uint8_t full_scale_gyro_range = (config->gyro_config >> MPU9250_GCONFIG_FS_SEL_BIT) & 0x03;
 
   ESP_LOGI(TAG, "Gyroscope:");
   ESP_LOGI(TAG, "--> Full Scale Range (0x1B): %s", FS_RANGE[full_scale_gyro_range]);
@@ -552,13 +1091,22 @@ void print_gyro_settings(void)
   ESP_LOGI(TAG, "  --> x: %f", cal->gyro_bias_offset.x);
   ESP_LOGI(TAG, "  --> y: %f", cal->gyro_bias_offset.y);
   ESP_LOGI(TAG, "  --> z: %f", cal->gyro_bias_offset.z);
+  ESP_LOGI(TAG, "--> Bias Temperature Model (reference %f C):", cal->gyro_temp_ref);
+  for (int k = 0; k < GYRO_TEMP_POLY_ORDER; k++)
+  {
+    ESP_LOGI(TAG, "  --> dT^%d: (%g, %g, %g)", k + 1, cal->gyro_temp_coeff[k].x, cal->gyro_temp_coeff[k].y, cal->gyro_temp_coeff[k].z);
+  }
 };
 
 void print_settings(bool use_mag)
 {
-  mpu9250_print_settings();
-  print_accel_settings();
-  print_gyro_settings();
+  // One snapshot for all three, rather than a read per setting
+  mpu9250_config_t config;
+  ESP_ERROR_CHECK(mpu9250_get_config(&config));
+
+  print_mpu9250_settings(&config);
+  print_accel_settings(&config);
+  print_gyro_settings(&config);
   if(use_mag){
     ak8963_print_settings();
   }
@@ -0,0 +1,348 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+#include "mpu9250.h"
+#include "ak8963.h"
+#include "power_mode.h"
+
+#define GYRO_START_UP_MS (35)
+#define POLL_INTERVAL_MS (10)
+
+static const char *TAG = "power_mode";
+
+static bool initialised = false;
+static power_mode_config_t config;
+static power_mode_t mode = POWER_MODE_FULL_RATE;
+static uint32_t still_count = 0;
+
+static SemaphoreHandle_t motion_sem = NULL;
+
+// Saved full rate settings
+static uint8_t accel_config_2;
+static uint8_t int_enable;
+static uint8_t ak8963_mode;
+
+static void IRAM_ATTR motion_isr(void *arg)
+{
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(motion_sem, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * Undo install_motion_interrupt(), as far as it got.
+ */
+static void remove_motion_interrupt(gpio_num_t gpio, bool handler_added)
+{
+  if (handler_added)
+    gpio_isr_handler_remove(gpio);
+  vSemaphoreDelete(motion_sem);
+  motion_sem = NULL;
+}
+
+/**
+ * Create the semaphore and attach motion_isr() to the INT pin.  On failure nothing is left behind.
+ */
+static esp_err_t install_motion_interrupt(gpio_num_t gpio)
+{
+  motion_sem = xSemaphoreCreateBinary();
+  if (motion_sem == NULL)
+    return ESP_ERR_NO_MEM;
+
+  gpio_config_t io = {
+      .pin_bit_mask = 1ULL << gpio,
+      .mode = GPIO_MODE_INPUT,
+      .pull_up_en = GPIO_PULLUP_DISABLE,
+      .pull_down_en = GPIO_PULLDOWN_DISABLE,
+      .intr_type = GPIO_INTR_POSEDGE};
+  esp_err_t ret = gpio_config(&io);
+
+  // Somebody else may have already installed the ISR service.
+  if (ret == ESP_OK)
+  {
+    ret = gpio_install_isr_service(0);
+    if (ret == ESP_ERR_INVALID_STATE)
+      ret = ESP_OK;
+  }
+
+  if (ret == ESP_OK)
+    ret = gpio_isr_handler_add(gpio, motion_isr, NULL);
+
+  if (ret != ESP_OK)
+    remove_motion_interrupt(gpio, false);
+  return ret;
+}
+
+esp_err_t power_mode_init(const power_mode_config_t *c)
+{
+  if (initialised)
+  {
+    ESP_LOGE(TAG, "power_mode_init has already been called");
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (c->lp_accel_odr > MPU9250_LP_ACCEL_ODR_500HZ || c->wom_threshold_mg > 255 * MPU9250_WOM_THR_MG_PER_LSB)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  esp_err_t ret;
+  if (c->int_gpio != GPIO_NUM_NC)
+  {
+    ret = install_motion_interrupt(c->int_gpio);
+    if (ret != ESP_OK)
+      return ret;
+  }
+
+  // Latch the interrupt until INT_STATUS is read, so a short bump is not missed.
+  ret = mpu9250_write_bits(MPU9250_RA_INT_PIN_CFG, MPU9250_INTCFG_LATCH_INT_EN_BIT, 1, 1);
+  if (ret != ESP_OK)
+  {
+    if (c->int_gpio != GPIO_NUM_NC)
+      remove_motion_interrupt(c->int_gpio, true);
+    return ret;
+  }
+
+  // Only kept once everything succeeded, so a failed init can simply be retried
+  config = *c;
+  initialised = true;
+  mode = POWER_MODE_FULL_RATE;
+  still_count = 0;
+
+  return ESP_OK;
+}
+
+/**
+ * Put back the full rate settings saved by power_mode_enter_low_power().  Every register is written
+ * even if an earlier one fails, so as much as possible is restored; the first error is returned.
+ */
+static esp_err_t restore_full_rate(void)
+{
+  esp_err_t ret = ESP_OK;
+  esp_err_t err;
+
+  err = mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_CYCLE_BIT, 1, 0);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_PWR_MGMT_2, 0x00);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_MOT_DETECT_CTRL, 0x00);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_INT_ENABLE, int_enable);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_2, accel_config_2);
+  ret = ret != ESP_OK ? ret : err;
+
+  if (config.use_mag)
+  {
+    err = ak8963_set_cntl(ak8963_mode);
+    ret = ret != ESP_OK ? ret : err;
+  }
+
+  return ret;
+}
+
+/**
+ * The register writes for wake on motion, the sequence from the MPU-9250 register map,
+ * "Wake-on-Motion Interrupt".  Stops at the first error.
+ */
+static esp_err_t configure_wake_on_motion(void)
+{
+  esp_err_t ret;
+
+  if (config.use_mag)
+  {
+    ret = ak8963_set_cntl(AK8963_CNTL_MODE_OFF);
+    if (ret != ESP_OK)
+      return ret;
+  }
+
+  ret = mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_CYCLE_BIT, 1, 0);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_SLEEP_BIT, 1, 0);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_GYRO_STANDBY_BIT, 1, 0);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_PWR_MGMT_2, MPU9250_PWR2_DISABLE_GYRO);
+  if (ret != ESP_OK)
+    return ret;
+
+  // accel_fchoice_b = 1, A_DLPFCFG = 1
+  ret = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_2, 0x09);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_INT_ENABLE, 1 << MPU9250_INT_WOM_BIT);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_MOT_DETECT_CTRL, (1 << MPU9250_MOTCTRL_ACCEL_INTEL_EN_BIT) | (1 << MPU9250_MOTCTRL_ACCEL_INTEL_MODE_BIT));
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_WOM_THR, config.wom_threshold_mg / MPU9250_WOM_THR_MG_PER_LSB);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_write_byte(MPU9250_RA_LP_ACCEL_ODR, config.lp_accel_odr);
+  if (ret != ESP_OK)
+    return ret;
+
+  // Clear anything already pending, then start cycling.
+  uint8_t status;
+  ret = mpu9250_read_byte(MPU9250_RA_INT_STATUS, &status);
+  if (ret != ESP_OK)
+    return ret;
+  if (motion_sem != NULL)
+  {
+    xSemaphoreTake(motion_sem, 0);
+  }
+  return mpu9250_write_bits(MPU9250_RA_PWR_MGMT_1, MPU9250_PWR1_CYCLE_BIT, 1, 1);
+}
+
+esp_err_t power_mode_enter_low_power(void)
+{
+  if (!initialised)
+    return ESP_ERR_INVALID_STATE;
+  if (mode == POWER_MODE_LOW_POWER)
+    return ESP_OK;
+
+  ESP_LOGI(TAG, "Entering low power mode");
+
+  // Save what we are about to change, nothing has been touched yet if this fails.
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_ACCEL_CONFIG_2, &accel_config_2);
+  if (ret != ESP_OK)
+    return ret;
+  ret = mpu9250_read_byte(MPU9250_RA_INT_ENABLE, &int_enable);
+  if (ret != ESP_OK)
+    return ret;
+  if (config.use_mag)
+  {
+    ret = ak8963_get_cntl(&ak8963_mode);
+    if (ret != ESP_OK)
+      return ret;
+  }
+
+  ret = configure_wake_on_motion();
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Failed to enter low power mode (%s), restoring full rate", esp_err_to_name(ret));
+    restore_full_rate();
+    return ret;
+  }
+
+  mode = POWER_MODE_LOW_POWER;
+  return ESP_OK;
+}
+
+esp_err_t power_mode_enter_full_rate(void)
+{
+  if (!initialised)
+    return ESP_ERR_INVALID_STATE;
+  if (mode == POWER_MODE_FULL_RATE)
+    return ESP_OK;
+
+  // Stay in low power mode on failure, so the caller can try again.
+  esp_err_t ret = restore_full_rate();
+  if (ret != ESP_OK)
+    return ret;
+
+  // Gyro start up time, the first samples are not valid before this.
+  vTaskDelay(pdMS_TO_TICKS(GYRO_START_UP_MS) + 1);
+
+  ESP_LOGI(TAG, "Back to full rate");
+
+  mode = POWER_MODE_FULL_RATE;
+  still_count = 0;
+  return ESP_OK;
+}
+
+power_mode_t power_mode_get(void)
+{
+  return mode;
+}
+
+power_mode_t power_mode_update(const vector_t *va, const vector_t *vg)
+{
+  if (!initialised || mode == POWER_MODE_LOW_POWER)
+    return mode;
+
+  float a = sqrtf(va->x * va->x + va->y * va->y + va->z * va->z);
+  bool still = fabsf(vg->x) < config.still_gyro_dps &&
+               fabsf(vg->y) < config.still_gyro_dps &&
+               fabsf(vg->z) < config.still_gyro_dps &&
+               fabsf(a - 1.0f) < config.still_accel_g;
+
+  still_count = still ? still_count + 1 : 0;
+  if (still_count >= config.idle_samples)
+  {
+    esp_err_t ret = power_mode_enter_low_power();
+    if (ret != ESP_OK)
+    {
+      // Still at full rate, try again after another idle_samples.
+      ESP_LOGW(TAG, "Staying at full rate: %s", esp_err_to_name(ret));
+      still_count = 0;
+    }
+  }
+
+  return mode;
+}
+
+esp_err_t power_mode_wait_for_motion(TickType_t timeout)
+{
+  if (!initialised)
+    return ESP_ERR_INVALID_STATE;
+  if (mode == POWER_MODE_FULL_RATE)
+    return ESP_OK;
+
+  if (motion_sem != NULL)
+  {
+    if (xSemaphoreTake(motion_sem, timeout) != pdTRUE)
+      return ESP_ERR_TIMEOUT;
+  }
+  else
+  {
+    // No interrupt line, poll INT_STATUS.
+    TickType_t start = xTaskGetTickCount();
+    uint8_t status = 0;
+    while (true)
+    {
+      esp_err_t ret = mpu9250_read_byte(MPU9250_RA_INT_STATUS, &status);
+      if (ret != ESP_OK)
+        return ret;
+      if (status & (1 << MPU9250_INT_WOM_BIT))
+        break;
+      if (xTaskGetTickCount() - start >= timeout)
+        return ESP_ERR_TIMEOUT;
+      vTaskDelay(pdMS_TO_TICKS(POLL_INTERVAL_MS) + 1);
+    }
+  }
+
+  // Reading INT_STATUS releases the latched interrupt.
+  uint8_t status;
+  esp_err_t ret = mpu9250_read_byte(MPU9250_RA_INT_STATUS, &status);
+  if (ret != ESP_OK)
+    return ret;
+
+  return power_mode_enter_full_rate();
+}
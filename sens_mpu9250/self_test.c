@@ -0,0 +1,303 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "mpu9250.h"
+#include "ak8963.h"
+#include "self_test.h"
+
+static const char *TAG = "self_test";
+
+#define SELF_TEST_SAMPLES (200)
+#define SELF_TEST_SETTLE_MS (20)
+#define SELF_TEST_POLL_MS (10)
+#define SELF_TEST_BYTES_PER_SAMPLE (12) // Accel then gyro, in register order
+
+// AN-MPU-9250A-03 pass criteria, at +/-2 g and +/-250 dps
+#define ACCEL_RATIO_MIN (0.5f)
+#define ACCEL_RATIO_MAX (1.5f)
+#define ACCEL_UNTRIMMED_MIN (0.225f * MPU9250_ACCEL_SCALE_FACTOR_0) // 225 mg
+#define ACCEL_UNTRIMMED_MAX (0.675f * MPU9250_ACCEL_SCALE_FACTOR_0) // 675 mg
+#define GYRO_RATIO_MIN (0.5f)
+#define GYRO_UNTRIMMED_MIN (60.0f * MPU9250_GYRO_SCALE_FACTOR_0) // 60 dps
+#define GYRO_OFFSET_MAX (20.0f * MPU9250_GYRO_SCALE_FACTOR_0)    // 20 dps
+
+typedef struct
+{
+  uint8_t smplrt_div;
+  uint8_t config;
+  uint8_t gyro_config;
+  uint8_t accel_config_1;
+  uint8_t accel_config_2;
+  uint8_t fifo_en;
+  uint8_t user_ctrl;
+} saved_settings_t;
+
+static esp_err_t save_settings(saved_settings_t *s)
+{
+  esp_err_t ret;
+  if ((ret = mpu9250_read_byte(MPU9250_RA_SMPLRT_DIV, &s->smplrt_div)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_read_byte(MPU9250_RA_CONFIG, &s->config)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_read_byte(MPU9250_RA_GYRO_CONFIG, &s->gyro_config)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_read_byte(MPU9250_RA_ACCEL_CONFIG_1, &s->accel_config_1)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_read_byte(MPU9250_RA_ACCEL_CONFIG_2, &s->accel_config_2)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_read_byte(MPU9250_RA_FIFO_EN, &s->fifo_en)) != ESP_OK)
+    return ret;
+  return mpu9250_read_byte(MPU9250_RA_USER_CTRL, &s->user_ctrl);
+}
+
+/**
+ * Put back the settings saved by save_settings().  Every register is written even if an earlier one
+ * fails, so as much as possible is restored; the first error is returned.
+ */
+static esp_err_t restore_settings(const saved_settings_t *s)
+{
+  esp_err_t ret = ESP_OK;
+  esp_err_t err;
+
+  err = mpu9250_write_byte(MPU9250_RA_FIFO_EN, s->fifo_en);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_USER_CTRL, s->user_ctrl);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_fifo_reset();
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_SMPLRT_DIV, s->smplrt_div);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_CONFIG, s->config);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_GYRO_CONFIG, s->gyro_config);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_1, s->accel_config_1);
+  ret = ret != ESP_OK ? ret : err;
+  err = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_2, s->accel_config_2);
+  ret = ret != ESP_OK ? ret : err;
+
+  return ret;
+}
+
+/**
+ * Average SELF_TEST_SAMPLES accel and gyro samples from the FIFO, in LSB.
+ */
+static esp_err_t fifo_average(float accel[3], float gyro[3])
+{
+  uint8_t buf[SELF_TEST_BYTES_PER_SAMPLE * 8];
+  int32_t sum[6] = {0, 0, 0, 0, 0, 0};
+  uint32_t n = 0;
+
+  // Twice the nominal time before giving up.
+  TickType_t start = xTaskGetTickCount();
+  TickType_t timeout = pdMS_TO_TICKS(2 * SELF_TEST_SAMPLES) + 2;
+
+  esp_err_t ret = mpu9250_fifo_reset();
+  if (ret != ESP_OK)
+    return ret;
+
+  while (n < SELF_TEST_SAMPLES)
+  {
+    if (xTaskGetTickCount() - start > timeout)
+      return ESP_ERR_TIMEOUT;
+
+    vTaskDelay(pdMS_TO_TICKS(SELF_TEST_POLL_MS) + 1);
+
+    uint16_t count;
+    if ((ret = mpu9250_fifo_count(&count)) != ESP_OK)
+      return ret;
+    if (count > MPU9250_FIFO_SIZE - SELF_TEST_BYTES_PER_SAMPLE)
+    {
+      // Overflowed, the samples may be misaligned.
+      if ((ret = mpu9250_fifo_reset()) != ESP_OK)
+        return ret;
+      continue;
+    }
+
+    uint32_t available = count / SELF_TEST_BYTES_PER_SAMPLE;
+    while (available > 0 && n < SELF_TEST_SAMPLES)
+    {
+      uint32_t chunk = available < sizeof(buf) / SELF_TEST_BYTES_PER_SAMPLE ? available : sizeof(buf) / SELF_TEST_BYTES_PER_SAMPLE;
+      if ((ret = mpu9250_fifo_read(buf, chunk * SELF_TEST_BYTES_PER_SAMPLE)) != ESP_OK)
+        return ret;
+      available -= chunk;
+
+      for (uint32_t i = 0; i < chunk && n < SELF_TEST_SAMPLES; i++, n++)
+      {
+        for (int k = 0; k < 6; k++)
+        {
+          sum[k] += BYTE_2_INT_BE(buf, i * SELF_TEST_BYTES_PER_SAMPLE + 2 * k);
+        }
+      }
+    }
+  }
+
+  for (int k = 0; k < 3; k++)
+  {
+    accel[k] = (float)sum[k] / n;
+    gyro[k] = (float)sum[k + 3] / n;
+  }
+  return ESP_OK;
+}
+
+/**
+ * Factory self-test response from a SELF_TEST_* code, at the lowest full scale range.
+ */
+static float factory_response(uint8_t code)
+{
+  if (code == 0)
+    return 0.0f;
+  return 2620.0f * powf(1.01f, code - 1);
+}
+
+static esp_err_t run(self_test_result_t *result)
+{
+  esp_err_t ret;
+  float accel_os[3], gyro_os[3], accel_st[3], gyro_st[3];
+
+  // 1 kHz, gyro 92 Hz and accel 99 Hz bandwidth, +/-250 dps, +/-2 g, accel and gyro into the FIFO.
+  if ((ret = mpu9250_write_byte(MPU9250_RA_SMPLRT_DIV, 0)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_CONFIG, 0x02)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_2, 0x02)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_GYRO_CONFIG, MPU9250_GYRO_FS_250 << MPU9250_GCONFIG_FS_SEL_BIT)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_1, MPU9250_ACCEL_FS_2 << MPU9250_ACONFIG_FS_SEL_BIT)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_byte(MPU9250_RA_FIFO_EN, (1 << MPU9250_FIFO_ACCEL_BIT) | (1 << MPU9250_FIFO_GYRO_XOUT_BIT) | (1 << MPU9250_FIFO_GYRO_YOUT_BIT) | (1 << MPU9250_FIFO_GYRO_ZOUT_BIT))) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_write_bits(MPU9250_RA_USER_CTRL, MPU9250_USERCTRL_FIFO_EN_BIT, 1, 1)) != ESP_OK)
+    return ret;
+  vTaskDelay(pdMS_TO_TICKS(SELF_TEST_SETTLE_MS) + 1);
+
+  if ((ret = fifo_average(accel_os, gyro_os)) != ESP_OK)
+    return ret;
+
+  // Self-test on, let it settle
+  uint8_t st = (1 << MPU9250_GCONFIG_XG_ST_BIT) | (1 << MPU9250_GCONFIG_YG_ST_BIT) | (1 << MPU9250_GCONFIG_ZG_ST_BIT);
+  if ((ret = mpu9250_write_byte(MPU9250_RA_GYRO_CONFIG, st | (MPU9250_GYRO_FS_250 << MPU9250_GCONFIG_FS_SEL_BIT))) != ESP_OK)
+    return ret;
+  st = (1 << MPU9250_ACONFIG_XA_ST_BIT) | (1 << MPU9250_ACONFIG_YA_ST_BIT) | (1 << MPU9250_ACONFIG_ZA_ST_BIT);
+  if ((ret = mpu9250_write_byte(MPU9250_RA_ACCEL_CONFIG_1, st | (MPU9250_ACCEL_FS_2 << MPU9250_ACONFIG_FS_SEL_BIT))) != ESP_OK)
+    return ret;
+  vTaskDelay(pdMS_TO_TICKS(SELF_TEST_SETTLE_MS) + 1);
+
+  if ((ret = fifo_average(accel_st, gyro_st)) != ESP_OK)
+    return ret;
+
+  // Factory trim
+  uint8_t gyro_code[3], accel_code[3];
+  if ((ret = mpu9250_read_bytes(MPU9250_RA_SELF_TEST_X_GYRO, gyro_code, 3)) != ESP_OK)
+    return ret;
+  if ((ret = mpu9250_read_bytes(MPU9250_RA_SELF_TEST_X_ACCEL, accel_code, 3)) != ESP_OK)
+    return ret;
+
+  float gyro_offset[3];
+  for (int i = 0; i < 3; i++)
+  {
+    self_test_axes_t *a = &result->accel;
+    a->factory[i] = factory_response(accel_code[i]);
+    a->response[i] = accel_st[i] - accel_os[i];
+    if (a->factory[i] != 0.0f)
+    {
+      a->ratio[i] = a->response[i] / a->factory[i];
+      a->pass[i] = a->ratio[i] > ACCEL_RATIO_MIN && a->ratio[i] < ACCEL_RATIO_MAX;
+    }
+    else
+    {
+      a->pass[i] = fabsf(a->response[i]) >= ACCEL_UNTRIMMED_MIN && fabsf(a->response[i]) <= ACCEL_UNTRIMMED_MAX;
+    }
+
+    self_test_axes_t *g = &result->gyro;
+    g->factory[i] = factory_response(gyro_code[i]);
+    g->response[i] = gyro_st[i] - gyro_os[i];
+    if (g->factory[i] != 0.0f)
+    {
+      g->ratio[i] = g->response[i] / g->factory[i];
+      g->pass[i] = g->ratio[i] > GYRO_RATIO_MIN;
+    }
+    else
+    {
+      g->pass[i] = fabsf(g->response[i]) >= GYRO_UNTRIMMED_MIN;
+    }
+    g->pass[i] = g->pass[i] && fabsf(gyro_os[i]) <= GYRO_OFFSET_MAX;
+    gyro_offset[i] = gyro_os[i] / MPU9250_GYRO_SCALE_FACTOR_0;
+  }
+  result->gyro_offset_dps.x = gyro_offset[0];
+  result->gyro_offset_dps.y = gyro_offset[1];
+  result->gyro_offset_dps.z = gyro_offset[2];
+
+  return ESP_OK;
+}
+
+esp_err_t mpu9250_self_test(bool test_mag, self_test_result_t *result)
+{
+  memset(result, 0, sizeof(self_test_result_t));
+  TickType_t start = xTaskGetTickCount();
+
+  saved_settings_t saved;
+  esp_err_t ret = save_settings(&saved);
+  if (ret != ESP_OK)
+    return ret;
+
+  ret = run(result);
+
+  // Put everything back whatever happened, the first error wins.
+  esp_err_t ret2 = restore_settings(&saved);
+  if (ret == ESP_OK)
+    ret = ret2;
+
+  if (ret == ESP_OK && test_mag)
+  {
+    result->mag_tested = true;
+    ret = ak8963_self_test(&result->mag_field, result->mag_pass);
+  }
+
+  // Let the filters settle on the restored settings.
+  vTaskDelay(pdMS_TO_TICKS(SELF_TEST_SETTLE_MS) + 1);
+  result->elapsed_ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  result->pass = true;
+  for (int i = 0; i < 3; i++)
+  {
+    result->pass = result->pass && result->accel.pass[i] && result->gyro.pass[i];
+    if (result->mag_tested)
+      result->pass = result->pass && result->mag_pass[i];
+  }
+
+  ESP_LOGI(TAG, "%s in %u ms", result->pass ? "Passed" : "FAILED", (unsigned)result->elapsed_ms);
+  ESP_LOGD(TAG, "accel ratio (%f, %f, %f), gyro ratio (%f, %f, %f)",
+           result->accel.ratio[0], result->accel.ratio[1], result->accel.ratio[2],
+           result->gyro.ratio[0], result->gyro.ratio[1], result->gyro.ratio[2]);
+
+  return ESP_OK;
+}
@@ -0,0 +1,231 @@
+/*****************************************************************************
+ *                                                                           *
+ *  Copyright 2018 Simon M. Werner                                           *
+ *                                                                           *
+ *  Licensed under the Apache License, Version 2.0 (the "License");          *
+ *  you may not use this file except in compliance with the License.         *
+ *  You may obtain a copy of the License at                                  *
+ *                                                                           *
+ *      http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                           *
+ *  Unless required by applicable law or agreed to in writing, software      *
+ *  distributed under the License is distributed on an "AS IS" BASIS,        *
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ *  See the License for the specific language governing permissions and      *
+ *  limitations under the License.                                           *
+ *                                                                           *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "i2c-easy.h"
+#include "mpu9250.h"
+#include "transport.h"
+
+#define SPI_READ_FLAG (0x80)
+
+static const char *TAG = "mpu9250_transport";
+
+typedef struct
+{
+  i2c_port_t port;
+  uint8_t address;
+} i2c_ctx_t;
+
+typedef struct
+{
+  spi_device_handle_t config_dev; // Slow clock, everything but sensor data
+  spi_device_handle_t read_dev;   // Fast clock, sensor, interrupt and FIFO reads
+  gpio_num_t cs;
+  uint8_t *tx; // DMA capable, MPU9250_SPI_MAX_TRANSFER bytes
+  uint8_t *rx;
+} spi_ctx_t;
+
+static esp_err_t i2c_read(void *ctx, uint8_t reg, uint8_t *data, size_t len)
+{
+  i2c_ctx_t *c = ctx;
+  return i2c_read_bytes(c->port, c->address, reg, data, len);
+}
+
+static esp_err_t i2c_write(void *ctx, uint8_t reg, const uint8_t *data, size_t len)
+{
+  i2c_ctx_t *c = ctx;
+  return i2c_write_bytes(c->port, c->address, reg, (uint8_t *)data, len);
+}
+
+esp_err_t mpu9250_transport_i2c(i2c_port_t port, uint8_t address, mpu9250_transport_t *t)
+{
+  i2c_ctx_t *c = malloc(sizeof(i2c_ctx_t));
+  if (c == NULL)
+  {
+    return ESP_ERR_NO_MEM;
+  }
+  c->port = port;
+  c->address = address;
+
+  t->bus = MPU9250_BUS_I2C;
+  t->read = i2c_read;
+  t->write = i2c_write;
+  t->ctx = c;
+  return ESP_OK;
+}
+
+// Registers the datasheet allows to be read at 20 MHz
+static bool is_fast_register(uint8_t reg)
+{
+  return (reg >= MPU9250_RA_INT_STATUS && reg <= MPU9250_RA_EXT_SENS_DATA_23) ||
+         (reg >= MPU9250_RA_FIFO_COUNTH && reg <= MPU9250_RA_FIFO_R_W);
+}
+
+// One CS framed transfer of `len` bytes from s->tx into s->rx.  The bus must be acquired.
+static esp_err_t spi_transfer(spi_ctx_t *s, spi_device_handle_t dev, size_t len)
+{
+  spi_transaction_t trans = {
+      .length = len * 8,
+      .tx_buffer = s->tx,
+      .rx_buffer = s->rx,
+  };
+
+  gpio_set_level(s->cs, 0);
+  esp_err_t ret = spi_device_polling_transmit(dev, &trans);
+  gpio_set_level(s->cs, 1);
+  return ret;
+}
+
+static esp_err_t spi_read(void *ctx, uint8_t reg, uint8_t *data, size_t len)
+{
+  spi_ctx_t *s = ctx;
+  if (len + 1 > MPU9250_SPI_MAX_TRANSFER)
+  {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  spi_device_handle_t dev = is_fast_register(reg) ? s->read_dev : s->config_dev;
+  esp_err_t ret = spi_device_acquire_bus(dev, portMAX_DELAY);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  s->tx[0] = reg | SPI_READ_FLAG;
+  memset(s->tx + 1, 0, len);
+  ret = spi_transfer(s, dev, len + 1);
+  if (ret == ESP_OK)
+  {
+    memcpy(data, s->rx + 1, len);
+  }
+
+  spi_device_release_bus(dev);
+  return ret;
+}
+
+static esp_err_t spi_write(void *ctx, uint8_t reg, const uint8_t *data, size_t len)
+{
+  spi_ctx_t *s = ctx;
+  if (len + 1 > MPU9250_SPI_MAX_TRANSFER)
+  {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  esp_err_t ret = spi_device_acquire_bus(s->config_dev, portMAX_DELAY);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  s->tx[0] = reg & ~SPI_READ_FLAG;
+  memcpy(s->tx + 1, data, len);
+  ret = spi_transfer(s, s->config_dev, len + 1);
+
+  spi_device_release_bus(s->config_dev);
+  return ret;
+}
+
+static void spi_ctx_free(spi_ctx_t *s)
+{
+  if (s->config_dev != NULL)
+    spi_bus_remove_device(s->config_dev);
+  if (s->read_dev != NULL)
+    spi_bus_remove_device(s->read_dev);
+  heap_caps_free(s->tx);
+  heap_caps_free(s->rx);
+  free(s);
+}
+
+esp_err_t mpu9250_transport_spi(const mpu9250_spi_config_t *config, mpu9250_transport_t *t)
+{
+  spi_ctx_t *s = calloc(1, sizeof(spi_ctx_t));
+  if (s == NULL)
+  {
+    return ESP_ERR_NO_MEM;
+  }
+  s->cs = config->cs;
+  s->tx = heap_caps_malloc(MPU9250_SPI_MAX_TRANSFER, MALLOC_CAP_DMA);
+  s->rx = heap_caps_malloc(MPU9250_SPI_MAX_TRANSFER, MALLOC_CAP_DMA);
+  if (s->tx == NULL || s->rx == NULL)
+  {
+    spi_ctx_free(s);
+    return ESP_ERR_NO_MEM;
+  }
+
+  gpio_config_t io_conf = {
+      .pin_bit_mask = 1ULL << config->cs,
+      .mode = GPIO_MODE_OUTPUT,
+  };
+  esp_err_t ret = gpio_config(&io_conf);
+  if (ret != ESP_OK)
+  {
+    spi_ctx_free(s);
+    return ret;
+  }
+  gpio_set_level(config->cs, 1);
+
+  // Mode 3, CS is driven by hand so both devices can share it.
+  spi_device_interface_config_t dev_conf = {
+      .mode = 3,
+      .clock_speed_hz = config->config_clock_hz,
+      .spics_io_num = -1,
+      .queue_size = 1,
+  };
+  ret = spi_bus_add_device(config->host, &dev_conf, &s->config_dev);
+  if (ret == ESP_OK)
+  {
+    dev_conf.clock_speed_hz = config->read_clock_hz;
+    ret = spi_bus_add_device(config->host, &dev_conf, &s->read_dev);
+  }
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(TAG, "Can't add the MPU9250 to SPI host %d: %s", config->host, esp_err_to_name(ret));
+    spi_ctx_free(s);
+    return ret;
+  }
+
+  t->bus = MPU9250_BUS_SPI;
+  t->read = spi_read;
+  t->write = spi_write;
+  t->ctx = s;
+  return ESP_OK;
+}
+
+void mpu9250_transport_delete(mpu9250_transport_t *t)
+{
+  if (t->ctx == NULL)
+  {
+    return;
+  }
+
+  if (t->bus == MPU9250_BUS_SPI)
+  {
+    spi_ctx_free(t->ctx);
+  }
+  else
+  {
+    free(t->ctx);
+  }
+  t->ctx = NULL;
+}
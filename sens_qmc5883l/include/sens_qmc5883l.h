@@ -33,8 +33,20 @@ typedef struct {
     float z;
 } qmc_vector_t;
 
+/**
+ * @brief Read the field in Gauss, with the calibration applied if one is set.
+ */
 esp_err_t qmc5883l_read_mag_float(qmc_vector_t *vec);
 
+/**
+ * @brief Set the hard and soft iron calibration, e.g. from an ellipsoid fit (util_magcal) of
+ * uncalibrated qmc5883l_read_mag_float() readings.
+ * Applied as: out = soft_iron * (in - offset).  Pass NULL to clear it.
+ * @param offset Hard iron offset in Gauss
+ * @param soft_iron 3x3 soft iron matrix
+ */
+void qmc5883l_set_calibration(const float offset[3], const float soft_iron[3][3]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
@@ -19,6 +20,11 @@ static const char *TAG = "QMC5883L";
 // Store the I2C port internally
 static i2c_port_t g_i2c_port = I2C_NUM_0;
 
+// Hard / soft iron calibration
+static bool g_calibrated = false;
+static float g_offset[3];
+static float g_soft_iron[3][3];
+
 // Internal helper: Write byte
 static esp_err_t qmc5883l_write_reg(uint8_t reg_addr, uint8_t data) {
     i2c_cmd_handle_t cmd = i2c_cmd_link_create();
@@ -100,6 +106,25 @@ esp_err_t qmc5883l_read_mag_float(qmc_vector_t *vec) {
         vec->x = raw_x / 3000.0f;
         vec->y = raw_y / 3000.0f;
         vec->z = raw_z / 3000.0f;
+
+        if (g_calibrated) {
+            float dx = vec->x - g_offset[0];
+            float dy = vec->y - g_offset[1];
+            float dz = vec->z - g_offset[2];
+            vec->x = g_soft_iron[0][0] * dx + g_soft_iron[0][1] * dy + g_soft_iron[0][2] * dz;
+            vec->y = g_soft_iron[1][0] * dx + g_soft_iron[1][1] * dy + g_soft_iron[1][2] * dz;
+            vec->z = g_soft_iron[2][0] * dx + g_soft_iron[2][1] * dy + g_soft_iron[2][2] * dz;
+        }
     }
     return ret;
+}
+
+void qmc5883l_set_calibration(const float offset[3], const float soft_iron[3][3]) {
+    if (offset == NULL || soft_iron == NULL) {
+        g_calibrated = false;
+        return;
+    }
+    memcpy(g_offset, offset, sizeof(g_offset));
+    memcpy(g_soft_iron, soft_iron, sizeof(g_soft_iron));
+    g_calibrated = true;
 }
\ No newline at end of file
@@ -44,6 +44,10 @@ float vl53l0x_getSignalRateLimit (vl53l0x_t *);
 const char *vl53l0x_setMeasurementTimingBudget (vl53l0x_t *, uint32_t budget_us);
 uint32_t vl53l0x_getMeasurementTimingBudget (vl53l0x_t *);
 
+// Part to part range offset, in micrometres (-512000 to 511750, 250 um steps)
+const char *vl53l0x_setOffsetMicrometers (vl53l0x_t *, int32_t offset_um);
+int32_t vl53l0x_getOffsetMicrometers (vl53l0x_t *);
+
 const char *vl53l0x_setVcselPulsePeriod (vl53l0x_t *, vl53l0x_vcselPeriodType type, uint8_t period_pclks);
 uint8_t vl53l0x_getVcselPulsePeriod (vl53l0x_t *, vl53l0x_vcselPeriodType type);
 
@@ -957,6 +957,31 @@ vl53l0x_getSignalRateLimit (vl53l0x_t * v)
    return (float) vl53l0x_readReg16Bit (v, FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT) / (1 << 7);
 }
 
+// Set the part to part range offset, which is added to every range.  The
+// register holds a 12 bit two's complement value in 1/4 mm, so -512 mm to
+// +511.75 mm.  Not kept over a reset, store it (e.g. util_calstore) and set it
+// again after vl53l0x_init().
+// based on VL53L0X_set_offset_calibration_data_micro_meter()
+const char *
+vl53l0x_setOffsetMicrometers (vl53l0x_t * v, int32_t offset_um)
+{
+   if (offset_um < -512000 || offset_um > 511750)
+      return "Bad offset";
+   int16_t encoded = offset_um / 250;
+   vl53l0x_writeReg16Bit (v, ALGO_PART_TO_PART_RANGE_OFFSET_MM, (uint16_t) encoded & 0x0FFF);
+   return NULL;
+}
+
+// based on VL53L0X_get_offset_calibration_data_micro_meter()
+int32_t
+vl53l0x_getOffsetMicrometers (vl53l0x_t * v)
+{
+   int32_t encoded = vl53l0x_readReg16Bit (v, ALGO_PART_TO_PART_RANGE_OFFSET_MM) & 0x0FFF;
+   if (encoded >= 0x0800)
+      encoded -= 0x1000;
+   return encoded * 250;
+}
+
 // Set the VCSEL (vertical cavity surface emitting laser) pulse period for the
 // given period type (pre-range or final range) to the given value in PCLKs.
 // Longer periods seem to increase the potential range of the sensor.
@@ -1,288 +1,1061 @@
-//=====================================================================================================
-// ahrs.c
-//=====================================================================================================
-//
-// Implementation of Madgwick's IMU and AHRS algorithms.
-// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
-//
-// Date			Author          Notes
-// 29/09/2011	SOH Madgwick    Initial release
-// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
-// 19/02/2012	SOH Madgwick	Magnetometer measurement is normalised
-//
-//=====================================================================================================
-
-//---------------------------------------------------------------------------------------------------
-// Header files
-
-#include "ahrs.h"
-#include <math.h>
-
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
-
-//---------------------------------------------------------------------------------------------------
-// Variable definitions
-
-volatile float sampleFreq = 50;                            // 2 * proportional gain (Kp)
-volatile float beta = 0.8;                                 // 2 * proportional gain (Kp)
-volatile float q0 = 1.0f, q1 = 0.0f, q2 = 0.0f, q3 = 0.0f; // quaternion of sensor frame relative to auxiliary frame
-
-//====================================================================================================
-// Functions
-
-void ahrs_init(float sampleFreqDef, float betaDef)
-{
-  sampleFreq = sampleFreqDef;
-  beta = betaDef;
-}
-
-//---------------------------------------------------------------------------------------------------
-// AHRS algorithm update
-
-void ahrs_update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
-{
-  float recipNorm;
-  float s0, s1, s2, s3;
-  float qDot1, qDot2, qDot3, qDot4;
-  float hx, hy;
-  float _2q0mx, _2q0my, _2q0mz, _2q1mx, _2bx, _2bz, _4bx, _4bz, _2q0, _2q1, _2q2, _2q3, _2q0q2, _2q2q3, q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
-
-  // Use IMU algorithm if magnetometer measurement invalid (avoids NaN in magnetometer normalisation)
-  if ((mx == 0.0f) && (my == 0.0f) && (mz == 0.0f))
-  {
-    ahrs_update_imu(gx, gy, gz, ax, ay, az);
-    return;
-  }
-
-  // Rate of change of quaternion from gyroscope
-  qDot1 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
-  qDot2 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
-  qDot3 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
-  qDot4 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
-
-  // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
-  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
-  {
-
-    // Normalise accelerometer measurement
-    recipNorm = 1.0 / sqrt(ax * ax + ay * ay + az * az);
-    ax *= recipNorm;
-    ay *= recipNorm;
-    az *= recipNorm;
-
-    // Normalise magnetometer measurement
-    recipNorm = 1.0 / sqrt(mx * mx + my * my + mz * mz);
-    mx *= recipNorm;
-    my *= recipNorm;
-    mz *= recipNorm;
-
-    // Auxiliary variables to avoid repeated arithmetic
-    _2q0mx = 2.0f * q0 * mx;
-    _2q0my = 2.0f * q0 * my;
-    _2q0mz = 2.0f * q0 * mz;
-    _2q1mx = 2.0f * q1 * mx;
-    _2q0 = 2.0f * q0;
-    _2q1 = 2.0f * q1;
-    _2q2 = 2.0f * q2;
-    _2q3 = 2.0f * q3;
-    _2q0q2 = 2.0f * q0 * q2;
-    _2q2q3 = 2.0f * q2 * q3;
-    q0q0 = q0 * q0;
-    q0q1 = q0 * q1;
-    q0q2 = q0 * q2;
-    q0q3 = q0 * q3;
-    q1q1 = q1 * q1;
-    q1q2 = q1 * q2;
-    q1q3 = q1 * q3;
-    q2q2 = q2 * q2;
-    q2q3 = q2 * q3;
-    q3q3 = q3 * q3;
-
-    // Reference direction of Earth's magnetic field
-    hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
-    hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
-    _2bx = sqrt(hx * hx + hy * hy);
-    _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
-    _4bx = 2.0f * _2bx;
-    _4bz = 2.0f * _2bz;
-
-    // Gradient decent algorithm corrective step
-    s0 = -_2q2 * (2.0f * q1q3 - _2q0q2 - ax) + _2q1 * (2.0f * q0q1 + _2q2q3 - ay) - _2bz * q2 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (-_2bx * q3 + _2bz * q1) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + _2bx * q2 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
-    s1 = _2q3 * (2.0f * q1q3 - _2q0q2 - ax) + _2q0 * (2.0f * q0q1 + _2q2q3 - ay) - 4.0f * q1 * (1 - 2.0f * q1q1 - 2.0f * q2q2 - az) + _2bz * q3 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (_2bx * q2 + _2bz * q0) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + (_2bx * q3 - _4bz * q1) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
-    s2 = -_2q0 * (2.0f * q1q3 - _2q0q2 - ax) + _2q3 * (2.0f * q0q1 + _2q2q3 - ay) - 4.0f * q2 * (1 - 2.0f * q1q1 - 2.0f * q2q2 - az) + (-_4bx * q2 - _2bz * q0) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (_2bx * q1 + _2bz * q3) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + (_2bx * q0 - _4bz * q2) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
-    s3 = _2q1 * (2.0f * q1q3 - _2q0q2 - ax) + _2q2 * (2.0f * q0q1 + _2q2q3 - ay) + (-_4bx * q3 + _2bz * q1) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (-_2bx * q0 + _2bz * q2) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + _2bx * q1 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
-    recipNorm = 1.0 / sqrt(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3); // normalise step magnitude
-    s0 *= recipNorm;
-    s1 *= recipNorm;
-    s2 *= recipNorm;
-    s3 *= recipNorm;
-
-    // Apply feedback step
-    qDot1 -= beta * s0;
-    qDot2 -= beta * s1;
-    qDot3 -= beta * s2;
-    qDot4 -= beta * s3;
-  }
-
-  // Integrate rate of change of quaternion to yield quaternion
-  q0 += qDot1 * (1.0f / sampleFreq);
-  q1 += qDot2 * (1.0f / sampleFreq);
-  q2 += qDot3 * (1.0f / sampleFreq);
-  q3 += qDot4 * (1.0f / sampleFreq);
-
-  // Normalise quaternion
-  recipNorm = 1.0 / sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
-  q0 *= recipNorm;
-  q1 *= recipNorm;
-  q2 *= recipNorm;
-  q3 *= recipNorm;
-}
-
-//---------------------------------------------------------------------------------------------------
-// IMU algorithm update
-
-void ahrs_update_imu(float gx, float gy, float gz, float ax, float ay, float az)
-{
-  float recipNorm;
-  float s0, s1, s2, s3;
-  float qDot1, qDot2, qDot3, qDot4;
-  float _2q0, _2q1, _2q2, _2q3, _4q0, _4q1, _4q2, _8q1, _8q2, q0q0, q1q1, q2q2, q3q3;
-
-  // Rate of change of quaternion from gyroscope
-  qDot1 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
-  qDot2 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
-  qDot3 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
-  qDot4 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
-
-  // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
-  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
-  {
-
-    // Normalise accelerometer measurement
-    recipNorm = 1.0 / sqrt(ax * ax + ay * ay + az * az);
-    ax *= recipNorm;
-    ay *= recipNorm;
-    az *= recipNorm;
-
-    // Auxiliary variables to avoid repeated arithmetic
-    _2q0 = 2.0f * q0;
-    _2q1 = 2.0f * q1;
-    _2q2 = 2.0f * q2;
-    _2q3 = 2.0f * q3;
-    _4q0 = 4.0f * q0;
-    _4q1 = 4.0f * q1;
-    _4q2 = 4.0f * q2;
-    _8q1 = 8.0f * q1;
-    _8q2 = 8.0f * q2;
-    q0q0 = q0 * q0;
-    q1q1 = q1 * q1;
-    q2q2 = q2 * q2;
-    q3q3 = q3 * q3;
-
-    // Gradient decent algorithm corrective step
-    s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
-    s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
-    s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
-    s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
-    recipNorm = 1.0 / sqrt(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3); // normalise step magnitude
-    s0 *= recipNorm;
-    s1 *= recipNorm;
-    s2 *= recipNorm;
-    s3 *= recipNorm;
-
-    // Apply feedback step
-    qDot1 -= beta * s0;
-    qDot2 -= beta * s1;
-    qDot3 -= beta * s2;
-    qDot4 -= beta * s3;
-  }
-
-  // Integrate rate of change of quaternion to yield quaternion
-  q0 += qDot1 * (1.0f / sampleFreq);
-  q1 += qDot2 * (1.0f / sampleFreq);
-  q2 += qDot3 * (1.0f / sampleFreq);
-  q3 += qDot4 * (1.0f / sampleFreq);
-
-  // Normalise quaternion
-  recipNorm = 1.0 / sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
-  q0 *= recipNorm;
-  q1 *= recipNorm;
-  q2 *= recipNorm;
-  q3 *= recipNorm;
-}
-
-/**
- * Convert the quaternion to a vector with angle.  Reverse of the code
- * in the following link: http://www.euclideanspace.com/maths/geometry/rotations/conversions/angleToQuaternion/index.htm
- * @return {object} Normalised vector - {x, y, z, angle}
- */
-void MadgwickGetVector(float *angle, float *x, float *y, float *z)
-{
-  float ang = 2.0 * acos(q0);
-  float sin_angle = sin(ang / 2.0);
-  *angle = ang;
-  *x = q1 / sin_angle;
-  *y = q2 / sin_angle;
-  *z = q3 / sin_angle;
-};
-
-float norm_angle_0_2pi(float a)
-{
-  a = fmod(a, M_PI * 2.0);
-  if (a < 0)
-  {
-    a += M_PI * 2.0;
-  }
-  return a;
-}
-
-/**
- * Return an object with the Euler angles {heading; pitch, roll}, in radians.
- *
- * Where:
- *   - heading is from magnetic north, going west (about z-axis).
- *   - pitch is from vertical, going forward (about y-axis).
- *   - roll is from vertical, going right (about x-axis).
- *
- * Thanks to:
- *   https://github.com/PenguPilot/PenguPilot/blob/master/autopilot/service/util/math/quat.c#L103
- * @return {object} {heading, pitch, roll} in radians
- */
-void MadgwickGetEulerAngles(float *heading, float *pitch, float *roll)
-{
-  float ww = q0 * q0;
-  float xx = q1 * q1;
-  float yy = q2 * q2;
-  float zz = q3 * q3;
-  *heading = norm_angle_0_2pi(atan2f(2.0 * (q1 * q2 + q3 * q0), xx - yy - zz + ww));
-  *pitch = asinf(-2.0 * (q1 * q3 - q2 * q0));
-  *roll = atan2(2.0 * (q2 * q3 + q1 * q0), -xx - yy + zz + ww);
-}
-
-/**
- * Return an object with the Euler angles {heading, pitch, roll}, in radians.
- *
- * Where:
- *   - heading is from magnetic north, going west (about z-axis).
- *   - pitch is from vertical, going forward (about y-axis).
- *   - roll is from vertical, going right (about x-axis).
- *
- * Thanks to:
- *   https://github.com/PenguPilot/PenguPilot/blob/master/autopilot/service/util/quat.c#L103
- * @return {object} {heading, pitch, roll} in radians
- */
-#define RAD_2_DEG (180.0f / M_PI)
-void ahrs_get_euler_in_degrees(float *heading, float *pitch, float *roll)
-{
-  MadgwickGetEulerAngles(heading, pitch, roll);
-
-  *heading *= RAD_2_DEG;
-  *pitch *= RAD_2_DEG;
-  *roll *= RAD_2_DEG;
-}
-
-//====================================================================================================
-// END OF CODE
-//====================================================================================================
+//=====================================================================================================
+// ahrs.c
+//=====================================================================================================
+//
+// Implementation of Madgwick's and Mahony's IMU and AHRS algorithms.
+// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
+//
+// Date			Author          Notes
+// 29/09/2011	SOH Madgwick    Initial release
+// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
+// 19/02/2012	SOH Madgwick	Magnetometer measurement is normalised
+//
+//=====================================================================================================
+
+//---------------------------------------------------------------------------------------------------
+// Header files
+
+#include "ahrs.h"
+#include <math.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Single precision only, the FPU has no double support and a double constant drags the whole
+// expression through the soft-float routines.
+#define PI_F ((float)M_PI)
+
+// For the block update, so each engine is inlined into its own loop with the state in registers
+#define AHRS_ALWAYS_INLINE inline __attribute__((always_inline))
+
+//---------------------------------------------------------------------------------------------------
+// Variable definitions
+
+// Published from the default instance, so ahrs_get_euler_in_degrees() can be called from any task
+static ahrs_publication_t default_publication = {
+    .words = {0x3f800000}, // q0 = 1.0f
+};
+
+// The instance behind the original ahrs_* functions
+static ahrs_t default_ahrs = {
+    .engine = AHRS_ENGINE_MADGWICK,
+    .q0 = 1.0f,
+    .q1 = 0.0f,
+    .q2 = 0.0f,
+    .q3 = 0.0f,
+    .beta = 0.8f,
+    .sample_freq = 50.0f,
+    .sample_period = 1.0f / 50.0f,
+    .dt_min = 0.25f / 50.0f,
+    .dt_max = 4.0f / 50.0f,
+    .kp_scale = 1.0f,
+    .ki_scale = 1.0f,
+    .publication = &default_publication,
+};
+
+//====================================================================================================
+// Functions
+
+static inline float inv_sqrt(float x)
+{
+#ifdef CONFIG_AHRS_FAST_INV_SQRT
+  // Bit level first guess, then two Newton-Raphson steps, about 5e-6 relative error.
+  union
+  {
+    float f;
+    uint32_t i;
+  } conv = {.f = x};
+  conv.i = 0x5f3759df - (conv.i >> 1);
+  float y = conv.f;
+  y = y * (1.5f - 0.5f * x * y * y);
+  y = y * (1.5f - 0.5f * x * y * y);
+  return y;
+#else
+  return 1.0f / sqrtf(x);
+#endif
+}
+
+static AHRS_ALWAYS_INLINE void madgwick_update(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+static AHRS_ALWAYS_INLINE void madgwick_update_imu(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az);
+static AHRS_ALWAYS_INLINE void mahony_update(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+static AHRS_ALWAYS_INLINE void mahony_update_imu(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az);
+
+static void set_sample_freq(ahrs_t *ahrs, float sampleFreqDef)
+{
+  ahrs->sample_freq = sampleFreqDef;
+  ahrs->sample_period = 1.0f / sampleFreqDef;
+  ahrs->dt_min = 0.25f * ahrs->sample_period;
+  ahrs->dt_max = 4.0f * ahrs->sample_period;
+}
+
+void ahrs_filter_init(ahrs_t *ahrs, float sampleFreqDef, float betaDef)
+{
+  *ahrs = (ahrs_t){
+      .engine = AHRS_ENGINE_MADGWICK,
+      .q0 = 1.0f,
+      .beta = betaDef,
+      .kp_scale = 1.0f,
+      .ki_scale = 1.0f,
+  };
+  set_sample_freq(ahrs, sampleFreqDef);
+}
+
+void ahrs_filter_init_mahony(ahrs_t *ahrs, float sampleFreqDef, float kp, float ki)
+{
+  *ahrs = (ahrs_t){
+      .engine = AHRS_ENGINE_MAHONY,
+      .q0 = 1.0f,
+      .two_kp = 2.0f * kp,
+      .two_ki = 2.0f * ki,
+      .kp_scale = 1.0f,
+      .ki_scale = 1.0f,
+  };
+  set_sample_freq(ahrs, sampleFreqDef);
+}
+
+void ahrs_filter_set_gain_schedule(ahrs_t *ahrs, const ahrs_gain_schedule_t *schedule)
+{
+  if (schedule == NULL)
+  {
+    ahrs->scheduled = false;
+    ahrs->kp_scale = 1.0f;
+    ahrs->ki_scale = 1.0f;
+    return;
+  }
+
+  ahrs->scheduled = true;
+  ahrs->schedule = *schedule;
+  ahrs->gain_ramp = (schedule->initial_gain - 1.0f) / schedule->convergence_time;
+  ahrs->gain = schedule->initial_gain;
+  ahrs->error_time = 0.0f;
+
+  // Worked on |a|^2, |a|^2 / gravity^2 - 1 is about 2 (|a| / gravity - 1)
+  ahrs->recip_gravity2 = 1.0f / (schedule->gravity * schedule->gravity);
+  ahrs->cos2_error_threshold = cosf(schedule->error_threshold) * cosf(schedule->error_threshold);
+}
+
+/**
+ * Work out kp_scale and ki_scale for this update.  While converging (gain over 1) the gain is held at
+ * initial_gain as long as the accel or mag error is over the threshold, then ramps down to 1 over
+ * convergence_time.  Once converged it is only raised again when the error has lasted
+ * restart_time with the device not turning.  It is cut while the accel magnitude says there is
+ * linear acceleration.  mx, my, mz are zero without a mag.
+ */
+static AHRS_ALWAYS_INLINE void schedule_gain(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  const ahrs_gain_schedule_t *schedule = &ahrs->schedule;
+  float a2 = ax * ax + ay * ay + az * az;
+
+  // Accel gating, full gain inside the tolerance, none past the rejection, linear in between
+  float deviation = fabsf(a2 * ahrs->recip_gravity2 - 1.0f);
+  float tolerance = 2.0f * schedule->accel_tolerance;
+  float rejection = 2.0f * schedule->accel_rejection;
+  float accel_scale = 1.0f;
+  if (deviation >= rejection)
+    accel_scale = 0.0f;
+  else if (deviation > tolerance)
+    accel_scale = (rejection - deviation) / (rejection - tolerance);
+
+  // Only against a trusted accel, a bad one would both trigger the restart and then be pulled
+  // towards at the high gain.
+  bool checked = accel_scale == 1.0f && schedule->error_threshold > 0.0f;
+  bool error = false;
+  if (checked)
+  {
+    float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+    float q0q0 = q0 * q0, q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+    float q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+    float q2q2 = q2 * q2, q2q3 = q2 * q3, q3q3 = q3 * q3;
+
+    // Tilt, the angle between the accel and the estimated direction of gravity v is over the
+    // threshold when a . v < 0 or (a . v)^2 < cos^2 |a|^2.
+    float av = 2.0f * (ax * (q1q3 - q0q2) + ay * (q0q1 + q2q3)) + az * (q0q0 - q1q1 - q2q2 + q3q3);
+    error = av < 0.0f || av * av < ahrs->cos2_error_threshold * a2;
+
+    // Heading, the mag in the earth frame should point along x, see the reference direction in the
+    // updates.  Over the threshold when hx < 0 or hx^2 < cos^2 (hx^2 + hy^2).
+    if (!error && !((mx == 0.0f) && (my == 0.0f) && (mz == 0.0f)))
+    {
+      float hx = mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2);
+      float hy = mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1);
+      error = hx < 0.0f || hx * hx < ahrs->cos2_error_threshold * (hx * hx + hy * hy);
+    }
+  }
+
+  // A sideways acceleration hardly changes |a|, so a trusted accel can still be off.  Restarting
+  // from the steady gain on it would follow the false gravity at the high gain, so the error has to
+  // last, and only counts while the gyro says the device isn't turning (centripetal acceleration).
+  // A sample that wasn't checked says nothing either way and leaves the count.
+  float g2 = gx * gx + gy * gy + gz * gz;
+  if (g2 > schedule->rotation_threshold * schedule->rotation_threshold)
+    ahrs->error_time = 0.0f;
+  else if (checked)
+    ahrs->error_time = error ? ahrs->error_time + dt : 0.0f;
+  if ((error && ahrs->gain > 1.0f) || ahrs->error_time >= schedule->restart_time)
+    ahrs->gain = schedule->initial_gain;
+
+  ahrs->gain -= ahrs->gain_ramp * dt;
+  if (ahrs->gain < 1.0f)
+    ahrs->gain = 1.0f;
+
+  // The integral would wind up on the large errors of convergence, it only runs at the steady gain
+  ahrs->kp_scale = ahrs->gain * accel_scale;
+  ahrs->ki_scale = ahrs->gain == 1.0f ? accel_scale : 0.0f;
+}
+
+void ahrs_filter_set_mag_rejection(ahrs_t *ahrs, const ahrs_mag_rejection_t *rejection)
+{
+  ahrs->mag_rejection = rejection != NULL;
+  ahrs->mag_disturbed = false;
+  if (rejection == NULL)
+    return;
+
+  ahrs->mag_config = *rejection;
+  ahrs->mag_dot_tolerance = sinf(rejection->inclination_tolerance);
+  ahrs->mag_reference_valid = false;
+  ahrs->mag_candidate_time = 0.0f;
+}
+
+bool ahrs_filter_get_mag_disturbed(const ahrs_t *ahrs)
+{
+  return ahrs->mag_disturbed;
+}
+
+static inline bool mag_within(const ahrs_t *ahrs, float norm, float dot, float reference_norm, float reference_dot)
+{
+  return fabsf(norm - reference_norm) <= ahrs->mag_config.magnitude_tolerance * reference_norm &&
+         fabsf(dot - reference_dot) <= ahrs->mag_dot_tolerance;
+}
+
+/**
+ * Check the field against the expected magnitude and inclination, and zero the mag if it is
+ * disturbed so the update takes the IMU path.  The inclination is the cosine of the angle between
+ * the field and the accel, which needs no attitude.  While undisturbed the reference follows the
+ * field with the learn_time time constant.
+ *
+ * Alongside, a candidate is the mean of the field since it last moved outside the tolerances of
+ * that mean.  The reference is first taken from a candidate that has lasted recovery_time, and is
+ * replaced by one that has lasted reseed_time while the field is off the reference.
+ */
+static AHRS_ALWAYS_INLINE void reject_mag(ahrs_t *ahrs, float dt, float ax, float ay, float az, float *mx, float *my, float *mz)
+{
+  const ahrs_mag_rejection_t *config = &ahrs->mag_config;
+  float m2 = *mx * *mx + *my * *my + *mz * *mz;
+  float a2 = ax * ax + ay * ay + az * az;
+  if (m2 == 0.0f || a2 == 0.0f)
+    return;
+
+  float norm = sqrtf(m2);
+  float dot = (ax * *mx + ay * *my + az * *mz) * inv_sqrt(a2) / norm;
+
+  // Time weighted mean, restarted from this sample when the field jumps
+  if (ahrs->mag_candidate_time > 0.0f &&
+      mag_within(ahrs, norm, dot, ahrs->mag_candidate_norm, ahrs->mag_candidate_dot))
+  {
+    ahrs->mag_candidate_time += dt;
+    float k = dt / ahrs->mag_candidate_time;
+    ahrs->mag_candidate_norm += (norm - ahrs->mag_candidate_norm) * k;
+    ahrs->mag_candidate_dot += (dot - ahrs->mag_candidate_dot) * k;
+  }
+  else
+  {
+    ahrs->mag_candidate_norm = norm;
+    ahrs->mag_candidate_dot = dot;
+    ahrs->mag_candidate_time = dt;
+  }
+
+  float reference_norm = config->field > 0.0f ? config->field : ahrs->mag_reference_norm;
+  bool within = ahrs->mag_reference_valid && mag_within(ahrs, norm, dot, reference_norm, ahrs->mag_reference_dot);
+  float seed_time = ahrs->mag_reference_valid ? config->reseed_time : config->recovery_time;
+  if (!within && ahrs->mag_candidate_time >= seed_time)
+  {
+    ahrs->mag_reference_norm = ahrs->mag_candidate_norm;
+    ahrs->mag_reference_dot = ahrs->mag_candidate_dot;
+    ahrs->mag_reference_valid = true;
+    ahrs->mag_clean_time = config->recovery_time;
+    reference_norm = config->field > 0.0f ? config->field : ahrs->mag_reference_norm;
+    within = mag_within(ahrs, norm, dot, reference_norm, ahrs->mag_reference_dot);
+  }
+
+  if (!within)
+  {
+    ahrs->mag_clean_time = 0.0f;
+  }
+  else
+  {
+    ahrs->mag_clean_time += dt;
+    float k = dt / config->learn_time;
+    ahrs->mag_reference_norm += (norm - ahrs->mag_reference_norm) * k;
+    ahrs->mag_reference_dot += (dot - ahrs->mag_reference_dot) * k;
+  }
+
+  ahrs->mag_disturbed = ahrs->mag_clean_time < config->recovery_time;
+  if (ahrs->mag_disturbed)
+  {
+    *mx = 0.0f;
+    *my = 0.0f;
+    *mz = 0.0f;
+  }
+}
+
+//---------------------------------------------------------------------------------------------------
+// Publication, a seqlock with a single writer.  The sequence is odd while the words are written, a
+// reader retries if it saw an odd sequence or the sequence changed while it read the words.
+
+typedef union
+{
+  float f;
+  uint32_t i;
+} float_bits_t;
+
+void ahrs_publication_init(ahrs_publication_t *publication)
+{
+  *publication = (ahrs_publication_t){
+      .words = {((float_bits_t){.f = 1.0f}).i},
+  };
+}
+
+void ahrs_filter_set_publication(ahrs_t *ahrs, ahrs_publication_t *publication)
+{
+  ahrs->publication = publication;
+  ahrs->time_us = 0;
+}
+
+static void publish(ahrs_t *ahrs, float dt)
+{
+  ahrs_publication_t *p = ahrs->publication;
+
+  // The sample time, the timestamp if there is one, otherwise summed from dt
+  if (ahrs->has_timestamp)
+    ahrs->time_us = ahrs->last_timestamp_us;
+  else
+    ahrs->time_us += (int64_t)(dt * 1e6f);
+
+  const uint32_t words[AHRS_PUBLICATION_WORDS] = {
+      ((float_bits_t){.f = ahrs->q0}).i,
+      ((float_bits_t){.f = ahrs->q1}).i,
+      ((float_bits_t){.f = ahrs->q2}).i,
+      ((float_bits_t){.f = ahrs->q3}).i,
+      (uint32_t)ahrs->time_us,
+      (uint32_t)((uint64_t)ahrs->time_us >> 32),
+  };
+
+  // Only this task writes the sequence, so it can be read relaxed
+  uint32_t sequence = __atomic_load_n(&p->sequence, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (int i = 0; i < AHRS_PUBLICATION_WORDS; i++)
+  {
+    __atomic_store_n(&p->words[i], words[i], __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&p->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void ahrs_publication_read(const ahrs_publication_t *publication, ahrs_quaternion_t *q, int64_t *timestamp_us)
+{
+  uint32_t words[AHRS_PUBLICATION_WORDS];
+  uint32_t before, after;
+  do
+  {
+    before = __atomic_load_n(&publication->sequence, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < AHRS_PUBLICATION_WORDS; i++)
+    {
+      words[i] = __atomic_load_n(&publication->words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&publication->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+
+  q->q0 = ((float_bits_t){.i = words[0]}).f;
+  q->q1 = ((float_bits_t){.i = words[1]}).f;
+  q->q2 = ((float_bits_t){.i = words[2]}).f;
+  q->q3 = ((float_bits_t){.i = words[3]}).f;
+  if (timestamp_us)
+    *timestamp_us = (int64_t)(((uint64_t)words[5] << 32) | words[4]);
+}
+
+void ahrs_publication_get_euler_in_degrees(const ahrs_publication_t *publication, float *heading, float *pitch, float *roll)
+{
+  ahrs_quaternion_t q;
+  ahrs_publication_read(publication, &q, NULL);
+  const ahrs_t ahrs = {.q0 = q.q0, .q1 = q.q1, .q2 = q.q2, .q3 = q.q3};
+  ahrs_filter_get_euler_in_degrees(&ahrs, heading, pitch, roll);
+}
+
+static void filter_update(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  if (ahrs->mag_rejection)
+    reject_mag(ahrs, dt, ax, ay, az, &mx, &my, &mz);
+  if (ahrs->scheduled)
+    schedule_gain(ahrs, dt, gx, gy, gz, ax, ay, az, mx, my, mz);
+  if (ahrs->engine == AHRS_ENGINE_MAHONY)
+    mahony_update(ahrs, dt, gx, gy, gz, ax, ay, az, mx, my, mz);
+  else
+    madgwick_update(ahrs, dt, gx, gy, gz, ax, ay, az, mx, my, mz);
+  if (ahrs->publication)
+    publish(ahrs, dt);
+}
+
+static void filter_update_imu(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  if (ahrs->scheduled)
+    schedule_gain(ahrs, dt, gx, gy, gz, ax, ay, az, 0.0f, 0.0f, 0.0f);
+  if (ahrs->engine == AHRS_ENGINE_MAHONY)
+    mahony_update_imu(ahrs, dt, gx, gy, gz, ax, ay, az);
+  else
+    madgwick_update_imu(ahrs, dt, gx, gy, gz, ax, ay, az);
+  if (ahrs->publication)
+    publish(ahrs, dt);
+}
+
+// An update without a timestamp ends the run of timestamps, so it publishes the time summed from dt
+// and the next timestamp update starts again from the sample period.
+void ahrs_filter_update_dt(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  ahrs->has_timestamp = false;
+  filter_update(ahrs, dt, gx, gy, gz, ax, ay, az, mx, my, mz);
+}
+
+void ahrs_filter_update_imu_dt(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  ahrs->has_timestamp = false;
+  filter_update_imu(ahrs, dt, gx, gy, gz, ax, ay, az);
+}
+
+void ahrs_filter_update(ahrs_t *ahrs, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  ahrs_filter_update_dt(ahrs, ahrs->sample_period, gx, gy, gz, ax, ay, az, mx, my, mz);
+}
+
+void ahrs_filter_update_imu(ahrs_t *ahrs, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  ahrs_filter_update_imu_dt(ahrs, ahrs->sample_period, gx, gy, gz, ax, ay, az);
+}
+
+static float timestamp_dt(ahrs_t *ahrs, int64_t timestamp_us)
+{
+  float dt = ahrs->sample_period;
+  if (ahrs->has_timestamp)
+  {
+    dt = (float)(timestamp_us - ahrs->last_timestamp_us) * 1e-6f;
+    if (dt < ahrs->dt_min)
+      dt = ahrs->dt_min;
+    else if (dt > ahrs->dt_max)
+      dt = ahrs->dt_max;
+  }
+  ahrs->last_timestamp_us = timestamp_us;
+  ahrs->has_timestamp = true;
+  return dt;
+}
+
+void ahrs_filter_update_timestamp(ahrs_t *ahrs, int64_t timestamp_us, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  filter_update(ahrs, timestamp_dt(ahrs, timestamp_us), gx, gy, gz, ax, ay, az, mx, my, mz);
+}
+
+void ahrs_filter_update_imu_timestamp(ahrs_t *ahrs, int64_t timestamp_us, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  filter_update_imu(ahrs, timestamp_dt(ahrs, timestamp_us), gx, gy, gz, ax, ay, az);
+}
+
+void ahrs_filter_get_gyro_bias(const ahrs_t *ahrs, float *bx, float *by, float *bz)
+{
+  // The integral feedback is added to the gyro, so it is minus the bias.
+  *bx = -ahrs->integral_x;
+  *by = -ahrs->integral_y;
+  *bz = -ahrs->integral_z;
+}
+
+static AHRS_ALWAYS_INLINE size_t update_block(ahrs_t *ahrs, const ahrs_block_t *block, size_t n, ahrs_quaternion_t *out, size_t decimation,
+                                              ahrs_engine_t engine, bool mag)
+{
+  // A local copy can't alias `block` or `out`, so the state stays in registers between samples
+  ahrs_t s = *ahrs;
+  size_t written = 0;
+  size_t next = decimation;
+  float elapsed = 0.0f;
+  if (!block->timestamp_us && n > 0)
+    s.has_timestamp = false;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    float dt = block->timestamp_us ? timestamp_dt(&s, block->timestamp_us[i]) : s.sample_period;
+    elapsed += dt;
+    float mx = 0.0f, my = 0.0f, mz = 0.0f;
+    if (mag)
+    {
+      mx = block->mx[i];
+      my = block->my[i];
+      mz = block->mz[i];
+      if (s.mag_rejection)
+        reject_mag(&s, dt, block->ax[i], block->ay[i], block->az[i], &mx, &my, &mz);
+    }
+    if (s.scheduled)
+      schedule_gain(&s, dt, block->gx[i], block->gy[i], block->gz[i], block->ax[i], block->ay[i], block->az[i], mx, my, mz);
+
+    if (engine == AHRS_ENGINE_MAHONY)
+    {
+      if (mag)
+        mahony_update(&s, dt, block->gx[i], block->gy[i], block->gz[i], block->ax[i], block->ay[i], block->az[i], mx, my, mz);
+      else
+        mahony_update_imu(&s, dt, block->gx[i], block->gy[i], block->gz[i], block->ax[i], block->ay[i], block->az[i]);
+    }
+    else
+    {
+      if (mag)
+        madgwick_update(&s, dt, block->gx[i], block->gy[i], block->gz[i], block->ax[i], block->ay[i], block->az[i], mx, my, mz);
+      else
+        madgwick_update_imu(&s, dt, block->gx[i], block->gy[i], block->gz[i], block->ax[i], block->ay[i], block->az[i]);
+    }
+
+    if (out && --next == 0)
+    {
+      out[written++] = (ahrs_quaternion_t){s.q0, s.q1, s.q2, s.q3};
+      next = decimation;
+    }
+  }
+
+  *ahrs = s;
+  if (n > 0 && ahrs->publication)
+    publish(ahrs, elapsed);
+  return written;
+}
+
+size_t ahrs_filter_update_block(ahrs_t *ahrs, const ahrs_block_t *block, size_t n, ahrs_quaternion_t *out, size_t decimation)
+{
+  if (decimation == 0)
+  {
+    out = NULL;
+  }
+
+  // One loop per engine, with and without mag, so nothing is decided per sample
+  bool mag = block->mx && block->my && block->mz;
+  if (ahrs->engine == AHRS_ENGINE_MAHONY)
+  {
+    if (mag)
+      return update_block(ahrs, block, n, out, decimation, AHRS_ENGINE_MAHONY, true);
+    return update_block(ahrs, block, n, out, decimation, AHRS_ENGINE_MAHONY, false);
+  }
+  if (mag)
+    return update_block(ahrs, block, n, out, decimation, AHRS_ENGINE_MADGWICK, true);
+  return update_block(ahrs, block, n, out, decimation, AHRS_ENGINE_MADGWICK, false);
+}
+
+ahrs_t *ahrs_default(void)
+{
+  return &default_ahrs;
+}
+
+void ahrs_init(float sampleFreqDef, float betaDef)
+{
+  // Leaves the quaternion alone, as it always has
+  set_sample_freq(&default_ahrs, sampleFreqDef);
+  default_ahrs.beta = betaDef;
+}
+
+void ahrs_update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  ahrs_filter_update(&default_ahrs, gx, gy, gz, ax, ay, az, mx, my, mz);
+}
+
+void ahrs_update_imu(float gx, float gy, float gz, float ax, float ay, float az)
+{
+  ahrs_filter_update_imu(&default_ahrs, gx, gy, gz, ax, ay, az);
+}
+
+//---------------------------------------------------------------------------------------------------
+// Madgwick AHRS algorithm update
+
+static AHRS_ALWAYS_INLINE void madgwick_update(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  float recipNorm;
+  float s0, s1, s2, s3;
+  float qDot1, qDot2, qDot3, qDot4;
+  float hx, hy;
+  float _2q0mx, _2q0my, _2q0mz, _2q1mx, _2bx, _2bz, _4bx, _4bz, _2q0, _2q1, _2q2, _2q3, _2q0q2, _2q2q3, q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+
+  // Use IMU algorithm if magnetometer measurement invalid (avoids NaN in magnetometer normalisation)
+  if ((mx == 0.0f) && (my == 0.0f) && (mz == 0.0f))
+  {
+    madgwick_update_imu(ahrs, dt, gx, gy, gz, ax, ay, az);
+    return;
+  }
+
+  // Work on locals, written back once at the end
+  float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+  float beta = ahrs->beta * ahrs->kp_scale;
+
+  // Rate of change of quaternion from gyroscope
+  qDot1 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+  qDot2 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+  qDot3 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+  qDot4 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+  // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+  {
+
+    // Normalise accelerometer measurement
+    recipNorm = inv_sqrt(ax * ax + ay * ay + az * az);
+    ax *= recipNorm;
+    ay *= recipNorm;
+    az *= recipNorm;
+
+    // Normalise magnetometer measurement
+    recipNorm = inv_sqrt(mx * mx + my * my + mz * mz);
+    mx *= recipNorm;
+    my *= recipNorm;
+    mz *= recipNorm;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    _2q0mx = 2.0f * q0 * mx;
+    _2q0my = 2.0f * q0 * my;
+    _2q0mz = 2.0f * q0 * mz;
+    _2q1mx = 2.0f * q1 * mx;
+    _2q0 = 2.0f * q0;
+    _2q1 = 2.0f * q1;
+    _2q2 = 2.0f * q2;
+    _2q3 = 2.0f * q3;
+    _2q0q2 = 2.0f * q0 * q2;
+    _2q2q3 = 2.0f * q2 * q3;
+    q0q0 = q0 * q0;
+    q0q1 = q0 * q1;
+    q0q2 = q0 * q2;
+    q0q3 = q0 * q3;
+    q1q1 = q1 * q1;
+    q1q2 = q1 * q2;
+    q1q3 = q1 * q3;
+    q2q2 = q2 * q2;
+    q2q3 = q2 * q3;
+    q3q3 = q3 * q3;
+
+    // Reference direction of Earth's magnetic field
+    hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+    hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
+    _2bx = sqrtf(hx * hx + hy * hy);
+    _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+    _4bx = 2.0f * _2bx;
+    _4bz = 2.0f * _2bz;
+
+    // Gradient decent algorithm corrective step
+    s0 = -_2q2 * (2.0f * q1q3 - _2q0q2 - ax) + _2q1 * (2.0f * q0q1 + _2q2q3 - ay) - _2bz * q2 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (-_2bx * q3 + _2bz * q1) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + _2bx * q2 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+    s1 = _2q3 * (2.0f * q1q3 - _2q0q2 - ax) + _2q0 * (2.0f * q0q1 + _2q2q3 - ay) - 4.0f * q1 * (1 - 2.0f * q1q1 - 2.0f * q2q2 - az) + _2bz * q3 * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (_2bx * q2 + _2bz * q0) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + (_2bx * q3 - _4bz * q1) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+    s2 = -_2q0 * (2.0f * q1q3 - _2q0q2 - ax) + _2q3 * (2.0f * q0q1 + _2q2q3 - ay) - 4.0f * q2 * (1 - 2.0f * q1q1 - 2.0f * q2q2 - az) + (-_4bx * q2 - _2bz * q0) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (_2bx * q1 + _2bz * q3) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + (_2bx * q0 - _4bz * q2) * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+    s3 = _2q1 * (2.0f * q1q3 - _2q0q2 - ax) + _2q2 * (2.0f * q0q1 + _2q2q3 - ay) + (-_4bx * q3 + _2bz * q1) * (_2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx) + (-_2bx * q0 + _2bz * q2) * (_2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my) + _2bx * q1 * (_2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz);
+    recipNorm = inv_sqrt(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3); // normalise step magnitude
+    s0 *= recipNorm;
+    s1 *= recipNorm;
+    s2 *= recipNorm;
+    s3 *= recipNorm;
+
+    // Apply feedback step
+    qDot1 -= beta * s0;
+    qDot2 -= beta * s1;
+    qDot3 -= beta * s2;
+    qDot4 -= beta * s3;
+  }
+
+  // Integrate rate of change of quaternion to yield quaternion
+  q0 += qDot1 * dt;
+  q1 += qDot2 * dt;
+  q2 += qDot3 * dt;
+  q3 += qDot4 * dt;
+
+  // Normalise quaternion
+  recipNorm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+  q0 *= recipNorm;
+  q1 *= recipNorm;
+  q2 *= recipNorm;
+  q3 *= recipNorm;
+
+  ahrs->q0 = q0;
+  ahrs->q1 = q1;
+  ahrs->q2 = q2;
+  ahrs->q3 = q3;
+}
+
+//---------------------------------------------------------------------------------------------------
+// Madgwick IMU algorithm update
+
+static AHRS_ALWAYS_INLINE void madgwick_update_imu(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  float recipNorm;
+  float s0, s1, s2, s3;
+  float qDot1, qDot2, qDot3, qDot4;
+  float _2q0, _2q1, _2q2, _2q3, _4q0, _4q1, _4q2, _8q1, _8q2, q0q0, q1q1, q2q2, q3q3;
+
+  // Work on locals, written back once at the end
+  float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+  float beta = ahrs->beta * ahrs->kp_scale;
+
+  // Rate of change of quaternion from gyroscope
+  qDot1 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+  qDot2 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+  qDot3 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+  qDot4 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+  // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+  {
+
+    // Normalise accelerometer measurement
+    recipNorm = inv_sqrt(ax * ax + ay * ay + az * az);
+    ax *= recipNorm;
+    ay *= recipNorm;
+    az *= recipNorm;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    _2q0 = 2.0f * q0;
+    _2q1 = 2.0f * q1;
+    _2q2 = 2.0f * q2;
+    _2q3 = 2.0f * q3;
+    _4q0 = 4.0f * q0;
+    _4q1 = 4.0f * q1;
+    _4q2 = 4.0f * q2;
+    _8q1 = 8.0f * q1;
+    _8q2 = 8.0f * q2;
+    q0q0 = q0 * q0;
+    q1q1 = q1 * q1;
+    q2q2 = q2 * q2;
+    q3q3 = q3 * q3;
+
+    // Gradient decent algorithm corrective step
+    s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+    s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+    s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+    s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+    recipNorm = inv_sqrt(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3); // normalise step magnitude
+    s0 *= recipNorm;
+    s1 *= recipNorm;
+    s2 *= recipNorm;
+    s3 *= recipNorm;
+
+    // Apply feedback step
+    qDot1 -= beta * s0;
+    qDot2 -= beta * s1;
+    qDot3 -= beta * s2;
+    qDot4 -= beta * s3;
+  }
+
+  // Integrate rate of change of quaternion to yield quaternion
+  q0 += qDot1 * dt;
+  q1 += qDot2 * dt;
+  q2 += qDot3 * dt;
+  q3 += qDot4 * dt;
+
+  // Normalise quaternion
+  recipNorm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+  q0 *= recipNorm;
+  q1 *= recipNorm;
+  q2 *= recipNorm;
+  q3 *= recipNorm;
+
+  ahrs->q0 = q0;
+  ahrs->q1 = q1;
+  ahrs->q2 = q2;
+  ahrs->q3 = q3;
+}
+
+//---------------------------------------------------------------------------------------------------
+// Mahony AHRS algorithm update
+
+static AHRS_ALWAYS_INLINE void mahony_update(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  float recipNorm;
+  float q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+  float hx, hy, bx, bz;
+  float halfvx, halfvy, halfvz, halfwx, halfwy, halfwz;
+  float halfex, halfey, halfez;
+  float qa, qb, qc;
+
+  // Use IMU algorithm if magnetometer measurement invalid (avoids NaN in magnetometer normalisation)
+  if ((mx == 0.0f) && (my == 0.0f) && (mz == 0.0f))
+  {
+    mahony_update_imu(ahrs, dt, gx, gy, gz, ax, ay, az);
+    return;
+  }
+
+  // Work on locals, written back once at the end
+  float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+
+  // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+  {
+
+    // Normalise accelerometer measurement
+    recipNorm = inv_sqrt(ax * ax + ay * ay + az * az);
+    ax *= recipNorm;
+    ay *= recipNorm;
+    az *= recipNorm;
+
+    // Normalise magnetometer measurement
+    recipNorm = inv_sqrt(mx * mx + my * my + mz * mz);
+    mx *= recipNorm;
+    my *= recipNorm;
+    mz *= recipNorm;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    q0q0 = q0 * q0;
+    q0q1 = q0 * q1;
+    q0q2 = q0 * q2;
+    q0q3 = q0 * q3;
+    q1q1 = q1 * q1;
+    q1q2 = q1 * q2;
+    q1q3 = q1 * q3;
+    q2q2 = q2 * q2;
+    q2q3 = q2 * q3;
+    q3q3 = q3 * q3;
+
+    // Reference direction of Earth's magnetic field
+    hx = 2.0f * (mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+    hy = 2.0f * (mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+    bx = sqrtf(hx * hx + hy * hy);
+    bz = 2.0f * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5f - q1q1 - q2q2));
+
+    // Estimated direction of gravity and magnetic field
+    halfvx = q1q3 - q0q2;
+    halfvy = q0q1 + q2q3;
+    halfvz = q0q0 - 0.5f + q3q3;
+    halfwx = bx * (0.5f - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+    halfwy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+    halfwz = bx * (q0q2 + q1q3) + bz * (0.5f - q1q1 - q2q2);
+
+    // Error is sum of cross product between estimated direction and measured direction of field vectors
+    halfex = (ay * halfvz - az * halfvy) + (my * halfwz - mz * halfwy);
+    halfey = (az * halfvx - ax * halfvz) + (mz * halfwx - mx * halfwz);
+    halfez = (ax * halfvy - ay * halfvx) + (mx * halfwy - my * halfwx);
+
+    // Compute and apply integral feedback if enabled
+    if (ahrs->two_ki > 0.0f)
+    {
+      float two_ki = ahrs->two_ki * ahrs->ki_scale;
+      ahrs->integral_x += two_ki * halfex * dt; // integral error scaled by Ki
+      ahrs->integral_y += two_ki * halfey * dt;
+      ahrs->integral_z += two_ki * halfez * dt;
+      gx += ahrs->integral_x; // apply integral feedback
+      gy += ahrs->integral_y;
+      gz += ahrs->integral_z;
+    }
+    else
+    {
+      ahrs->integral_x = 0.0f; // prevent integral windup
+      ahrs->integral_y = 0.0f;
+      ahrs->integral_z = 0.0f;
+    }
+
+    // Apply proportional feedback
+    float two_kp = ahrs->two_kp * ahrs->kp_scale;
+    gx += two_kp * halfex;
+    gy += two_kp * halfey;
+    gz += two_kp * halfez;
+  }
+
+  // Integrate rate of change of quaternion
+  gx *= 0.5f * dt; // pre-multiply common factors
+  gy *= 0.5f * dt;
+  gz *= 0.5f * dt;
+  qa = q0;
+  qb = q1;
+  qc = q2;
+  q0 += (-qb * gx - qc * gy - q3 * gz);
+  q1 += (qa * gx + qc * gz - q3 * gy);
+  q2 += (qa * gy - qb * gz + q3 * gx);
+  q3 += (qa * gz + qb * gy - qc * gx);
+
+  // Normalise quaternion
+  recipNorm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+  q0 *= recipNorm;
+  q1 *= recipNorm;
+  q2 *= recipNorm;
+  q3 *= recipNorm;
+
+  ahrs->q0 = q0;
+  ahrs->q1 = q1;
+  ahrs->q2 = q2;
+  ahrs->q3 = q3;
+}
+
+//---------------------------------------------------------------------------------------------------
+// Mahony IMU algorithm update
+
+static AHRS_ALWAYS_INLINE void mahony_update_imu(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  float recipNorm;
+  float halfvx, halfvy, halfvz;
+  float halfex, halfey, halfez;
+  float qa, qb, qc;
+
+  // Work on locals, written back once at the end
+  float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+
+  // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+  {
+
+    // Normalise accelerometer measurement
+    recipNorm = inv_sqrt(ax * ax + ay * ay + az * az);
+    ax *= recipNorm;
+    ay *= recipNorm;
+    az *= recipNorm;
+
+    // Estimated direction of gravity
+    halfvx = q1 * q3 - q0 * q2;
+    halfvy = q0 * q1 + q2 * q3;
+    halfvz = q0 * q0 - 0.5f + q3 * q3;
+
+    // Error is sum of cross product between estimated and measured direction of gravity
+    halfex = (ay * halfvz - az * halfvy);
+    halfey = (az * halfvx - ax * halfvz);
+    halfez = (ax * halfvy - ay * halfvx);
+
+    // Compute and apply integral feedback if enabled
+    if (ahrs->two_ki > 0.0f)
+    {
+      float two_ki = ahrs->two_ki * ahrs->ki_scale;
+      ahrs->integral_x += two_ki * halfex * dt; // integral error scaled by Ki
+      ahrs->integral_y += two_ki * halfey * dt;
+      ahrs->integral_z += two_ki * halfez * dt;
+      gx += ahrs->integral_x; // apply integral feedback
+      gy += ahrs->integral_y;
+      gz += ahrs->integral_z;
+    }
+    else
+    {
+      ahrs->integral_x = 0.0f; // prevent integral windup
+      ahrs->integral_y = 0.0f;
+      ahrs->integral_z = 0.0f;
+    }
+
+    // Apply proportional feedback
+    float two_kp = ahrs->two_kp * ahrs->kp_scale;
+    gx += two_kp * halfex;
+    gy += two_kp * halfey;
+    gz += two_kp * halfez;
+  }
+
+  // Integrate rate of change of quaternion
+  gx *= 0.5f * dt; // pre-multiply common factors
+  gy *= 0.5f * dt;
+  gz *= 0.5f * dt;
+  qa = q0;
+  qb = q1;
+  qc = q2;
+  q0 += (-qb * gx - qc * gy - q3 * gz);
+  q1 += (qa * gx + qc * gz - q3 * gy);
+  q2 += (qa * gy - qb * gz + q3 * gx);
+  q3 += (qa * gz + qb * gy - qc * gx);
+
+  // Normalise quaternion
+  recipNorm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+  q0 *= recipNorm;
+  q1 *= recipNorm;
+  q2 *= recipNorm;
+  q3 *= recipNorm;
+
+  ahrs->q0 = q0;
+  ahrs->q1 = q1;
+  ahrs->q2 = q2;
+  ahrs->q3 = q3;
+}
+
+/**
+ * Convert the quaternion to a vector with angle.  Reverse of the code
+ * in the following link: http://www.euclideanspace.com/maths/geometry/rotations/conversions/angleToQuaternion/index.htm
+ * @return {object} Normalised vector - {x, y, z, angle}
+ */
+static void get_vector(const ahrs_t *ahrs, float *angle, float *x, float *y, float *z)
+{
+  float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+  float ang = 2.0f * acosf(q0);
+  float sin_angle = sinf(ang / 2.0f);
+  *angle = ang;
+  *x = q1 / sin_angle;
+  *y = q2 / sin_angle;
+  *z = q3 / sin_angle;
+};
+
+void MadgwickGetVector(float *angle, float *x, float *y, float *z)
+{
+  get_vector(&default_ahrs, angle, x, y, z);
+}
+
+float norm_angle_0_2pi(float a)
+{
+  a = fmodf(a, PI_F * 2.0f);
+  if (a < 0)
+  {
+    a += PI_F * 2.0f;
+  }
+  return a;
+}
+
+/**
+ * Return an object with the Euler angles {heading; pitch, roll}, in radians.
+ *
+ * Where:
+ *   - heading is from magnetic north, going west (about z-axis).
+ *   - pitch is from vertical, going forward (about y-axis).
+ *   - roll is from vertical, going right (about x-axis).
+ *
+ * Thanks to:
+ *   https://github.com/PenguPilot/PenguPilot/blob/master/autopilot/service/util/math/quat.c#L103
+ * @return {object} {heading, pitch, roll} in radians
+ */
+static void get_euler_angles(const ahrs_t *ahrs, float *heading, float *pitch, float *roll)
+{
+  float q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+  float ww = q0 * q0;
+  float xx = q1 * q1;
+  float yy = q2 * q2;
+  float zz = q3 * q3;
+  *heading = norm_angle_0_2pi(atan2f(2.0f * (q1 * q2 + q3 * q0), xx - yy - zz + ww));
+  *pitch = asinf(-2.0f * (q1 * q3 - q2 * q0));
+  *roll = atan2f(2.0f * (q2 * q3 + q1 * q0), -xx - yy + zz + ww);
+}
+
+void MadgwickGetEulerAngles(float *heading, float *pitch, float *roll)
+{
+  get_euler_angles(&default_ahrs, heading, pitch, roll);
+}
+
+/**
+ * Return an object with the Euler angles {heading, pitch, roll}, in radians.
+ *
+ * Where:
+ *   - heading is from magnetic north, going west (about z-axis).
+ *   - pitch is from vertical, going forward (about y-axis).
+ *   - roll is from vertical, going right (about x-axis).
+ *
+ * Thanks to:
+ *   https://github.com/PenguPilot/PenguPilot/blob/master/autopilot/service/util/quat.c#L103
+ * @return {object} {heading, pitch, roll} in radians
+ */
+#define RAD_2_DEG (180.0f / PI_F)
+void ahrs_filter_get_euler_in_degrees(const ahrs_t *ahrs, float *heading, float *pitch, float *roll)
+{
+  get_euler_angles(ahrs, heading, pitch, roll);
+
+  *heading *= RAD_2_DEG;
+  *pitch *= RAD_2_DEG;
+  *roll *= RAD_2_DEG;
+}
+
+void ahrs_get_euler_in_degrees(float *heading, float *pitch, float *roll)
+{
+  // Through the publication if it is still attached (ahrs_filter_init() on the default instance
+  // detaches it), so a task other than the one doing the updates never sees a torn quaternion.
+  if (default_ahrs.publication)
+    ahrs_publication_get_euler_in_degrees(default_ahrs.publication, heading, pitch, roll);
+  else
+    ahrs_filter_get_euler_in_degrees(&default_ahrs, heading, pitch, roll);
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
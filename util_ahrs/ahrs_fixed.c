@@ -0,0 +1,319 @@
+//=====================================================================================================
+// ahrs_fixed.c
+//=====================================================================================================
+//
+// Fixed point version of the Mahony engine in ahrs.c, see ahrs_fixed.h.  Line for line the same
+// algorithm, with the float operations replaced:
+//
+//   - Q2.30 products are 32 x 32 -> 64 bit multiplies, shifted back down.
+//   - Normalisation uses a Newton-Raphson 1 / sqrt after scaling the input to [0.25, 1).
+//   - Anything that could leave the Q2.30 range (gyro feedback, the integral, the quaternion) is
+//     saturated, and the rotation per update is limited so the quaternion can be renormalised.
+//
+//=====================================================================================================
+
+//---------------------------------------------------------------------------------------------------
+// Header files
+
+#include "ahrs_fixed.h"
+#include "ahrs.h"
+#include <stdbool.h>
+
+#define Q30_ONE (1 << 30)
+#define Q30_HALF (1 << 29)
+#define Q30_TO_FLOAT (1.0f / 1073741824.0f)
+
+// Largest half angle per axis in one update, 1 rad per axis per step is beyond any real gyro and
+// sample rate (2000 dps at 50 Hz is 0.7).  With a unit quaternion this keeps every component of the
+// integrated quaternion below 1 + sqrt(3) / 2, inside Q2.30.
+#define MAX_HALF_ANGLE Q30_HALF
+
+// Outside 1 +/- this the single Newton-Raphson step isn't accurate enough, normalise in full
+#define NORM_FAST_TOLERANCE (Q30_ONE >> 6)
+
+//====================================================================================================
+// Functions
+
+static inline int32_t sat32(int64_t x)
+{
+  if (x > INT32_MAX)
+    return INT32_MAX;
+  if (x < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)x;
+}
+
+// a * b for Q2.30 b, the result has the format of a
+static inline int32_t mul30(int32_t a, int32_t b)
+{
+  return (int32_t)(((int64_t)a * b) >> 30);
+}
+
+static inline uint32_t abs32(int32_t x)
+{
+  return x < 0 ? -(uint32_t)x : (uint32_t)x;
+}
+
+/**
+ * 1 / sqrt(x), both Q2.30, for x in [0.25, 1].  A linear first guess through (0.25, 2) and (1, 1),
+ * then four Newton-Raphson steps, y = y (3 - x y^2) / 2, for the full 30 bits.
+ */
+static uint32_t rsqrt_q30(uint32_t x)
+{
+  uint64_t y = (uint64_t)((7 * (int64_t)Q30_ONE - 4 * (int64_t)x) / 3);
+  for (int i = 0; i < 4; i++)
+  {
+    uint64_t yy = (y * y) >> 30;
+    uint64_t xyy = (x * yy) >> 30;
+    y = (y * ((3ULL << 30) - xyy)) >> 31;
+  }
+  return (uint32_t)y;
+}
+
+/**
+ * sqrt(x), both Q2.30, x in [0, 1].  x is scaled by an even power of 2 into range for rsqrt_q30(),
+ * sqrt(x) = x / sqrt(x).
+ */
+static int32_t sqrt_q30(uint32_t x)
+{
+  if (x == 0)
+    return 0;
+  int k = 0;
+  int lz = __builtin_clz(x);
+  if (lz > 3)
+    k = (lz - 2) / 2;
+  uint32_t r = rsqrt_q30(x << (2 * k));
+  return (int32_t)(((uint64_t)x * r) >> (30 - k));
+}
+
+/**
+ * Normalise a vector of `n` (up to 4) components in any units to Q2.30.  It is first shifted so the
+ * largest component is in [0.25, 0.5), then the squared length is in [0.0625, 1) and is moved into
+ * [0.25, 1) by a factor of 4.
+ * @return false for a zero vector.
+ */
+static bool normalise_n(int32_t *const v[], int n)
+{
+  uint32_t m = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (abs32(*v[i]) > m)
+      m = abs32(*v[i]);
+  }
+  if (m == 0)
+    return false;
+
+  int shift = 28 - (31 - __builtin_clz(m));
+  int64_t n2 = 0;
+  for (int i = 0; i < n; i++)
+  {
+    if (shift >= 0)
+      *v[i] *= (int32_t)1 << shift;
+    else
+      *v[i] >>= -shift;
+    n2 += (int64_t)*v[i] * *v[i];
+  }
+  n2 >>= 30;
+
+  int k = 0;
+  if (n2 < (1 << 28))
+  {
+    n2 <<= 2;
+    k = 1;
+  }
+  uint32_t r = rsqrt_q30((uint32_t)n2);
+  for (int i = 0; i < n; i++)
+  {
+    *v[i] = (int32_t)(((int64_t)*v[i] * r) >> (30 - k));
+  }
+  return true;
+}
+
+static bool normalise(int32_t *x, int32_t *y, int32_t *z)
+{
+  int32_t *const v[] = {x, y, z};
+  return normalise_n(v, 3);
+}
+
+// Integral and proportional feedback of the error, the gyro is Q16.16 and the error Q2.30
+static void feedback(ahrs_fixed_t *ahrs, int32_t *gx, int32_t *gy, int32_t *gz, int32_t halfex, int32_t halfey, int32_t halfez)
+{
+  // Compute and apply integral feedback if enabled
+  if (ahrs->two_ki > 0)
+  {
+    // Q16.16 * Q2.30 >> 16 is Q2.30, times dt
+    ahrs->integral_x = sat32(ahrs->integral_x + ((((int64_t)ahrs->two_ki * halfex) >> 16) * ahrs->sample_period >> 30));
+    ahrs->integral_y = sat32(ahrs->integral_y + ((((int64_t)ahrs->two_ki * halfey) >> 16) * ahrs->sample_period >> 30));
+    ahrs->integral_z = sat32(ahrs->integral_z + ((((int64_t)ahrs->two_ki * halfez) >> 16) * ahrs->sample_period >> 30));
+  }
+  else
+  {
+    ahrs->integral_x = 0; // prevent integral windup
+    ahrs->integral_y = 0;
+    ahrs->integral_z = 0;
+  }
+
+  // Apply integral (Q2.30 to Q16.16) and proportional feedback
+  *gx = sat32((int64_t)*gx + (ahrs->integral_x >> 14) + (((int64_t)ahrs->two_kp * halfex) >> 30));
+  *gy = sat32((int64_t)*gy + (ahrs->integral_y >> 14) + (((int64_t)ahrs->two_kp * halfey) >> 30));
+  *gz = sat32((int64_t)*gz + (ahrs->integral_z >> 14) + (((int64_t)ahrs->two_kp * halfez) >> 30));
+}
+
+static inline int32_t clamp_half_angle(int64_t x)
+{
+  if (x > MAX_HALF_ANGLE)
+    return MAX_HALF_ANGLE;
+  if (x < -MAX_HALF_ANGLE)
+    return -MAX_HALF_ANGLE;
+  return (int32_t)x;
+}
+
+// Integrate rate of change of quaternion and normalise, written back to ahrs
+static void integrate(ahrs_fixed_t *ahrs, int32_t q0, int32_t q1, int32_t q2, int32_t q3, int32_t gx, int32_t gy, int32_t gz)
+{
+  // Q16.16 rad/s * Q2.30 s >> 17 is half the angle in Q2.30
+  gx = clamp_half_angle(((int64_t)gx * ahrs->sample_period) >> 17);
+  gy = clamp_half_angle(((int64_t)gy * ahrs->sample_period) >> 17);
+  gz = clamp_half_angle(((int64_t)gz * ahrs->sample_period) >> 17);
+
+  int32_t qa = q0, qb = q1, qc = q2;
+  q0 = sat32((int64_t)q0 - mul30(qb, gx) - mul30(qc, gy) - mul30(q3, gz));
+  q1 = sat32((int64_t)q1 + mul30(qa, gx) + mul30(qc, gz) - mul30(q3, gy));
+  q2 = sat32((int64_t)q2 + mul30(qa, gy) - mul30(qb, gz) + mul30(q3, gx));
+  q3 = sat32((int64_t)q3 + mul30(qa, gz) + mul30(qb, gy) - mul30(qc, gx));
+
+  // Normalise quaternion.  The norm is normally close to 1, so one Newton-Raphson step from 1 is
+  // enough, 1 / sqrt(n) = (3 - n) / 2, and any error left is corrected on the next update.  A large
+  // rotation in one step moves it further than that step can correct.
+  int64_t n2 = ((int64_t)q0 * q0 + (int64_t)q1 * q1 + (int64_t)q2 * q2 + (int64_t)q3 * q3) >> 30;
+  if (n2 > Q30_ONE + NORM_FAST_TOLERANCE || n2 < Q30_ONE - NORM_FAST_TOLERANCE)
+  {
+    int32_t *const q[] = {&q0, &q1, &q2, &q3};
+    normalise_n(q, 4);
+    ahrs->q0 = q0;
+    ahrs->q1 = q1;
+    ahrs->q2 = q2;
+    ahrs->q3 = q3;
+    return;
+  }
+  int32_t recipNorm = (int32_t)((3 * (int64_t)Q30_ONE - n2) >> 1);
+  ahrs->q0 = mul30(q0, recipNorm);
+  ahrs->q1 = mul30(q1, recipNorm);
+  ahrs->q2 = mul30(q2, recipNorm);
+  ahrs->q3 = mul30(q3, recipNorm);
+}
+
+void ahrs_fixed_init(ahrs_fixed_t *ahrs, float sampleFreqDef, float kp, float ki)
+{
+  *ahrs = (ahrs_fixed_t){
+      .q0 = Q30_ONE,
+      .two_kp = AHRS_FIXED_Q16(2.0f * kp),
+      .two_ki = AHRS_FIXED_Q16(2.0f * ki),
+      .sample_period = AHRS_FIXED_Q30(1.0f / sampleFreqDef),
+  };
+}
+
+//---------------------------------------------------------------------------------------------------
+// AHRS algorithm update
+
+void ahrs_fixed_update(ahrs_fixed_t *ahrs, int32_t gx, int32_t gy, int32_t gz, int32_t ax, int32_t ay, int32_t az, int32_t mx, int32_t my, int32_t mz)
+{
+  int32_t q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+  int32_t hx, hy, bx, bz;
+  int32_t halfvx, halfvy, halfvz, halfwx, halfwy, halfwz;
+  int32_t halfex, halfey, halfez;
+
+  // Use IMU algorithm if magnetometer measurement invalid
+  if ((mx == 0) && (my == 0) && (mz == 0))
+  {
+    ahrs_fixed_update_imu(ahrs, gx, gy, gz, ax, ay, az);
+    return;
+  }
+
+  int32_t q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+
+  // Compute feedback only if accelerometer measurement valid
+  if (normalise(&ax, &ay, &az))
+  {
+    normalise(&mx, &my, &mz);
+
+    // Auxiliary variables to avoid repeated arithmetic
+    q0q0 = mul30(q0, q0);
+    q0q1 = mul30(q0, q1);
+    q0q2 = mul30(q0, q2);
+    q0q3 = mul30(q0, q3);
+    q1q1 = mul30(q1, q1);
+    q1q2 = mul30(q1, q2);
+    q1q3 = mul30(q1, q3);
+    q2q2 = mul30(q2, q2);
+    q2q3 = mul30(q2, q3);
+    q3q3 = mul30(q3, q3);
+
+    // Reference direction of Earth's magnetic field
+    hx = sat32(2 * ((int64_t)mul30(mx, Q30_HALF - q2q2 - q3q3) + mul30(my, q1q2 - q0q3) + mul30(mz, q1q3 + q0q2)));
+    hy = sat32(2 * ((int64_t)mul30(mx, q1q2 + q0q3) + mul30(my, Q30_HALF - q1q1 - q3q3) + mul30(mz, q2q3 - q0q1)));
+    bx = sqrt_q30((uint32_t)(mul30(hx, hx) + mul30(hy, hy)));
+    bz = sat32(2 * ((int64_t)mul30(mx, q1q3 - q0q2) + mul30(my, q2q3 + q0q1) + mul30(mz, Q30_HALF - q1q1 - q2q2)));
+
+    // Estimated direction of gravity and magnetic field
+    halfvx = q1q3 - q0q2;
+    halfvy = q0q1 + q2q3;
+    halfvz = q0q0 - Q30_HALF + q3q3;
+    halfwx = mul30(bx, Q30_HALF - q2q2 - q3q3) + mul30(bz, q1q3 - q0q2);
+    halfwy = mul30(bx, q1q2 - q0q3) + mul30(bz, q0q1 + q2q3);
+    halfwz = mul30(bx, q0q2 + q1q3) + mul30(bz, Q30_HALF - q1q1 - q2q2);
+
+    // Error is sum of cross product between estimated direction and measured direction of field vectors
+    halfex = sat32((int64_t)mul30(ay, halfvz) - mul30(az, halfvy) + mul30(my, halfwz) - mul30(mz, halfwy));
+    halfey = sat32((int64_t)mul30(az, halfvx) - mul30(ax, halfvz) + mul30(mz, halfwx) - mul30(mx, halfwz));
+    halfez = sat32((int64_t)mul30(ax, halfvy) - mul30(ay, halfvx) + mul30(mx, halfwy) - mul30(my, halfwx));
+
+    feedback(ahrs, &gx, &gy, &gz, halfex, halfey, halfez);
+  }
+
+  integrate(ahrs, q0, q1, q2, q3, gx, gy, gz);
+}
+
+//---------------------------------------------------------------------------------------------------
+// IMU algorithm update
+
+void ahrs_fixed_update_imu(ahrs_fixed_t *ahrs, int32_t gx, int32_t gy, int32_t gz, int32_t ax, int32_t ay, int32_t az)
+{
+  int32_t halfvx, halfvy, halfvz;
+  int32_t halfex, halfey, halfez;
+
+  int32_t q0 = ahrs->q0, q1 = ahrs->q1, q2 = ahrs->q2, q3 = ahrs->q3;
+
+  // Compute feedback only if accelerometer measurement valid
+  if (normalise(&ax, &ay, &az))
+  {
+    // Estimated direction of gravity
+    halfvx = mul30(q1, q3) - mul30(q0, q2);
+    halfvy = mul30(q0, q1) + mul30(q2, q3);
+    halfvz = mul30(q0, q0) - Q30_HALF + mul30(q3, q3);
+
+    // Error is sum of cross product between estimated and measured direction of gravity
+    halfex = mul30(ay, halfvz) - mul30(az, halfvy);
+    halfey = mul30(az, halfvx) - mul30(ax, halfvz);
+    halfez = mul30(ax, halfvy) - mul30(ay, halfvx);
+
+    feedback(ahrs, &gx, &gy, &gz, halfex, halfey, halfez);
+  }
+
+  integrate(ahrs, q0, q1, q2, q3, gx, gy, gz);
+}
+
+void ahrs_fixed_get_euler_in_degrees(const ahrs_fixed_t *ahrs, float *heading, float *pitch, float *roll)
+{
+  const ahrs_t q = {
+      .q0 = ahrs->q0 * Q30_TO_FLOAT,
+      .q1 = ahrs->q1 * Q30_TO_FLOAT,
+      .q2 = ahrs->q2 * Q30_TO_FLOAT,
+      .q3 = ahrs->q3 * Q30_TO_FLOAT,
+  };
+  ahrs_filter_get_euler_in_degrees(&q, heading, pitch, roll);
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
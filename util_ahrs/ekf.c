@@ -0,0 +1,366 @@
+//=====================================================================================================
+// ekf.c
+//=====================================================================================================
+//
+// Multiplicative error-state extended Kalman filter for attitude and gyro bias, see ekf.h.
+//
+// Error state dx = [dtheta, db], q_true = q * (1, dtheta / 2), b_true = b + db.
+//
+//   predict:  w = gyro - b, q = q * exp(w dt)
+//             Phi = [I - [w x] dt, -I dt; 0, I], P = Phi P Phi' + Q
+//   update:   h = R(q)' r, the earth frame reference r seen in the sensor frame
+//             H = [[h x], 0], S = H P H' + R, K = P H' S^-1
+//             dx = K (z - h), P = P - K H P, inject dx into q and b
+//   heading:  the mag is only used for the rotation about the vertical.  The innovation is the
+//             angle of the horizontal field from north, H = [v', 0] with v the vertical in the
+//             sensor frame, so the mag can't see a tilt error.
+//
+//=====================================================================================================
+
+//---------------------------------------------------------------------------------------------------
+// Header files
+
+#include "ekf.h"
+#include "ahrs.h"
+#include <math.h>
+#include <string.h>
+
+#define N AHRS_EKF_STATES
+
+//====================================================================================================
+// Functions
+
+void ahrs_ekf_init(ahrs_ekf_t *ekf, float sampleFreqDef, const ahrs_ekf_config_t *config)
+{
+  memset(ekf, 0, sizeof(ahrs_ekf_t));
+  ekf->config = *config;
+  ekf->sample_freq = sampleFreqDef;
+  ekf->q0 = 1.0f;
+
+  float a = config->init_attitude_std * config->init_attitude_std;
+  float b = config->init_bias_std * config->init_bias_std;
+  for (int i = 0; i < 3; i++)
+  {
+    ekf->P[i][i] = a;
+    ekf->P[i + 3][i + 3] = b;
+  }
+}
+
+static void normalise_quaternion(ahrs_ekf_t *ekf)
+{
+  float recipNorm = 1.0f / sqrtf(ekf->q0 * ekf->q0 + ekf->q1 * ekf->q1 + ekf->q2 * ekf->q2 + ekf->q3 * ekf->q3);
+  ekf->q0 *= recipNorm;
+  ekf->q1 *= recipNorm;
+  ekf->q2 *= recipNorm;
+  ekf->q3 *= recipNorm;
+}
+
+// q = q * (1, v), v is half the rotation vector
+static void rotate_quaternion(ahrs_ekf_t *ekf, float vx, float vy, float vz)
+{
+  float q0 = ekf->q0, q1 = ekf->q1, q2 = ekf->q2, q3 = ekf->q3;
+  ekf->q0 = q0 - q1 * vx - q2 * vy - q3 * vz;
+  ekf->q1 = q1 + q0 * vx + q2 * vz - q3 * vy;
+  ekf->q2 = q2 + q0 * vy - q1 * vz + q3 * vx;
+  ekf->q3 = q3 + q0 * vz + q1 * vy - q2 * vx;
+  normalise_quaternion(ekf);
+}
+
+static void predict(ahrs_ekf_t *ekf, float gx, float gy, float gz)
+{
+  float dt = 1.0f / ekf->sample_freq;
+  float wx = gx - ekf->bias[0];
+  float wy = gy - ekf->bias[1];
+  float wz = gz - ekf->bias[2];
+
+  rotate_quaternion(ekf, 0.5f * wx * dt, 0.5f * wy * dt, 0.5f * wz * dt);
+
+  // Phi = [A, -I dt; 0, I] with A = I - [w x] dt.  Done in blocks, P = [Paa, Pab; Pba, Pbb].
+  const float A[3][3] = {
+      {1.0f, wz * dt, -wy * dt},
+      {-wz * dt, 1.0f, wx * dt},
+      {wy * dt, -wx * dt, 1.0f}};
+
+  // T = Phi * P, rows 0-2 only, rows 3-5 are unchanged
+  float T[3][N];
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < N; j++)
+    {
+      T[i][j] = A[i][0] * ekf->P[0][j] + A[i][1] * ekf->P[1][j] + A[i][2] * ekf->P[2][j] - dt * ekf->P[i + 3][j];
+    }
+  }
+
+  // P = T * Phi'
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      ekf->P[i][j] = T[i][0] * A[j][0] + T[i][1] * A[j][1] + T[i][2] * A[j][2] - dt * T[i][j + 3];
+    }
+    for (int j = 3; j < N; j++)
+    {
+      ekf->P[i][j] = T[i][j];
+    }
+  }
+  for (int i = 3; i < N; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      ekf->P[i][j] = ekf->P[j][i];
+    }
+  }
+
+  float qa = ekf->config.gyro_noise * ekf->config.gyro_noise * dt;
+  float qb = ekf->config.gyro_bias_walk * ekf->config.gyro_bias_walk * dt;
+  for (int i = 0; i < 3; i++)
+  {
+    ekf->P[i][i] += qa;
+    ekf->P[i + 3][i + 3] += qb;
+  }
+}
+
+// Update with the unit vector z, predicted h.  Returns false if it was gated out.
+static bool update(ahrs_ekf_t *ekf, const float z[3], const float h[3], float noise, float innovation[3], float *nis)
+{
+  // [h x]
+  const float hx[3][3] = {
+      {0.0f, -h[2], h[1]},
+      {h[2], 0.0f, -h[0]},
+      {-h[1], h[0], 0.0f}};
+
+  // PHt = P H' = P[:, 0:3] [h x]'
+  float PHt[N][3];
+  for (int i = 0; i < N; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      PHt[i][j] = ekf->P[i][0] * hx[j][0] + ekf->P[i][1] * hx[j][1] + ekf->P[i][2] * hx[j][2];
+    }
+  }
+
+  // S = H P H' + R
+  float S[3][3];
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      S[i][j] = hx[i][0] * PHt[0][j] + hx[i][1] * PHt[1][j] + hx[i][2] * PHt[2][j];
+    }
+    S[i][i] += noise * noise;
+  }
+
+  // S^-1, S is symmetric positive definite
+  float c00 = S[1][1] * S[2][2] - S[1][2] * S[2][1];
+  float c01 = S[0][2] * S[2][1] - S[0][1] * S[2][2];
+  float c02 = S[0][1] * S[1][2] - S[0][2] * S[1][1];
+  float det = S[0][0] * c00 + S[1][0] * c01 + S[2][0] * c02;
+  if (det <= 0.0f)
+  {
+    return false;
+  }
+  float recipDet = 1.0f / det;
+  const float Si[3][3] = {
+      {c00 * recipDet, c01 * recipDet, c02 * recipDet},
+      {c01 * recipDet, (S[0][0] * S[2][2] - S[0][2] * S[2][0]) * recipDet, (S[0][2] * S[1][0] - S[0][0] * S[1][2]) * recipDet},
+      {c02 * recipDet, (S[0][2] * S[1][0] - S[0][0] * S[1][2]) * recipDet, (S[0][0] * S[1][1] - S[0][1] * S[1][0]) * recipDet}};
+
+  float y[3] = {z[0] - h[0], z[1] - h[1], z[2] - h[2]};
+  float Siy[3];
+  for (int i = 0; i < 3; i++)
+  {
+    Siy[i] = Si[i][0] * y[0] + Si[i][1] * y[1] + Si[i][2] * y[2];
+  }
+
+  memcpy(innovation, y, sizeof(y));
+  *nis = y[0] * Siy[0] + y[1] * Siy[1] + y[2] * Siy[2];
+  if (ekf->config.gate > 0.0f && *nis > ekf->config.gate)
+  {
+    return false;
+  }
+
+  // K = PHt S^-1, dx = K y = PHt S^-1 y
+  float K[N][3];
+  float dx[N];
+  for (int i = 0; i < N; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      K[i][j] = PHt[i][0] * Si[0][j] + PHt[i][1] * Si[1][j] + PHt[i][2] * Si[2][j];
+    }
+    dx[i] = PHt[i][0] * Siy[0] + PHt[i][1] * Siy[1] + PHt[i][2] * Siy[2];
+  }
+
+  // P = P - K H P = P - K PHt', kept symmetric
+  for (int i = 0; i < N; i++)
+  {
+    for (int j = i; j < N; j++)
+    {
+      float p = ekf->P[i][j] - (K[i][0] * PHt[j][0] + K[i][1] * PHt[j][1] + K[i][2] * PHt[j][2]);
+      ekf->P[i][j] = p;
+      ekf->P[j][i] = p;
+    }
+  }
+
+  // Inject the error state, the reset Jacobian is taken as identity.
+  rotate_quaternion(ekf, 0.5f * dx[0], 0.5f * dx[1], 0.5f * dx[2]);
+  ekf->bias[0] += dx[3];
+  ekf->bias[1] += dx[4];
+  ekf->bias[2] += dx[5];
+
+  return true;
+}
+
+static void update_accel(ahrs_ekf_t *ekf, float ax, float ay, float az)
+{
+  float recipNorm = 1.0f / sqrtf(ax * ax + ay * ay + az * az);
+  const float z[3] = {ax * recipNorm, ay * recipNorm, az * recipNorm};
+
+  // Gravity, earth (0, 0, 1), in the sensor frame
+  float q0 = ekf->q0, q1 = ekf->q1, q2 = ekf->q2, q3 = ekf->q3;
+  const float h[3] = {
+      2.0f * (q1 * q3 - q0 * q2),
+      2.0f * (q0 * q1 + q2 * q3),
+      q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3};
+
+  if (!update(ekf, z, h, ekf->config.accel_noise, ekf->accel_innovation, &ekf->accel_nis))
+  {
+    ekf->accel_rejected++;
+  }
+}
+
+// Scalar update of the rotation about the sensor frame vector v, with innovation y.  Returns false if
+// it was gated out.
+static bool update_rotation(ahrs_ekf_t *ekf, float y, const float v[3], float noise2, float gate, float *nis)
+{
+  // PHt = P H' = P[:, 0:3] v
+  float PHt[N];
+  for (int i = 0; i < N; i++)
+  {
+    PHt[i] = ekf->P[i][0] * v[0] + ekf->P[i][1] * v[1] + ekf->P[i][2] * v[2];
+  }
+
+  float S = v[0] * PHt[0] + v[1] * PHt[1] + v[2] * PHt[2] + noise2;
+  if (S <= 0.0f)
+  {
+    return false;
+  }
+  float recipS = 1.0f / S;
+
+  *nis = y * y * recipS;
+  if (gate > 0.0f && *nis > gate)
+  {
+    return false;
+  }
+
+  // K = PHt / S, P = P - K PHt', kept symmetric
+  float K[N];
+  for (int i = 0; i < N; i++)
+  {
+    K[i] = PHt[i] * recipS;
+  }
+  for (int i = 0; i < N; i++)
+  {
+    for (int j = i; j < N; j++)
+    {
+      float p = ekf->P[i][j] - K[i] * PHt[j];
+      ekf->P[i][j] = p;
+      ekf->P[j][i] = p;
+    }
+  }
+
+  rotate_quaternion(ekf, 0.5f * K[0] * y, 0.5f * K[1] * y, 0.5f * K[2] * y);
+  ekf->bias[0] += K[3] * y;
+  ekf->bias[1] += K[4] * y;
+  ekf->bias[2] += K[5] * y;
+
+  return true;
+}
+
+static void update_mag(ahrs_ekf_t *ekf, float mx, float my, float mz)
+{
+  float recipNorm = 1.0f / sqrtf(mx * mx + my * my + mz * mz);
+  const float z[3] = {mx * recipNorm, my * recipNorm, mz * recipNorm};
+
+  float q0 = ekf->q0, q1 = ekf->q1, q2 = ekf->q2, q3 = ekf->q3;
+  float q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+  float q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+  float q2q2 = q2 * q2, q2q3 = q2 * q3, q3q3 = q3 * q3;
+
+  // Horizontal part of the measurement in the earth frame, north is x.
+  float hx = 2.0f * (z[0] * (0.5f - q2q2 - q3q3) + z[1] * (q1q2 - q0q3) + z[2] * (q1q3 + q0q2));
+  float hy = 2.0f * (z[0] * (q1q2 + q0q3) + z[1] * (0.5f - q1q1 - q3q3) + z[2] * (q2q3 - q0q1));
+  float horizontal2 = hx * hx + hy * hy;
+  if (horizontal2 < 1e-4f)
+  {
+    // Pointing straight up or down, there is no heading in it.
+    return;
+  }
+
+  // Earth z in the sensor frame, a rotation of dtheta about the body axes turns the heading by v.dtheta.
+  const float v[3] = {
+      2.0f * (q1q3 - q0q2),
+      2.0f * (q0q1 + q2q3),
+      2.0f * (0.5f - q1q1 - q2q2)};
+
+  // A heading error of e shows as the field at -e from north.  The direction noise is spread over
+  // the horizontal part only, which is smaller by cos(dip).
+  float y = -atan2f(hy, hx);
+  float noise2 = ekf->config.mag_noise * ekf->config.mag_noise / horizontal2;
+
+  ekf->mag_innovation = y;
+  if (!update_rotation(ekf, y, v, noise2, ekf->config.mag_gate, &ekf->mag_nis))
+  {
+    ekf->mag_rejected++;
+  }
+}
+
+void ahrs_ekf_update(ahrs_ekf_t *ekf, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+  // Use IMU algorithm if magnetometer measurement invalid (avoids NaN in magnetometer normalisation)
+  if ((mx == 0.0f) && (my == 0.0f) && (mz == 0.0f))
+  {
+    ahrs_ekf_update_imu(ekf, gx, gy, gz, ax, ay, az);
+    return;
+  }
+
+  predict(ekf, gx, gy, gz);
+  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+  {
+    update_accel(ekf, ax, ay, az);
+  }
+  update_mag(ekf, mx, my, mz);
+}
+
+void ahrs_ekf_update_imu(ahrs_ekf_t *ekf, float gx, float gy, float gz, float ax, float ay, float az)
+{
+  predict(ekf, gx, gy, gz);
+  if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+  {
+    update_accel(ekf, ax, ay, az);
+  }
+}
+
+void ahrs_ekf_get_euler_in_degrees(const ahrs_ekf_t *ekf, float *heading, float *pitch, float *roll)
+{
+  const ahrs_t q = {.q0 = ekf->q0, .q1 = ekf->q1, .q2 = ekf->q2, .q3 = ekf->q3};
+  ahrs_filter_get_euler_in_degrees(&q, heading, pitch, roll);
+}
+
+void ahrs_ekf_get_attitude_std(const ahrs_ekf_t *ekf, float *x, float *y, float *z)
+{
+  *x = sqrtf(ekf->P[0][0]);
+  *y = sqrtf(ekf->P[1][1]);
+  *z = sqrtf(ekf->P[2][2]);
+}
+
+void ahrs_ekf_get_bias_std(const ahrs_ekf_t *ekf, float *x, float *y, float *z)
+{
+  *x = sqrtf(ekf->P[3][3]);
+  *y = sqrtf(ekf->P[4][4]);
+  *z = sqrtf(ekf->P[5][5]);
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "sdkconfig.h"
+
+extern "C" {
+    #include "ahrs.h"
+    #include "ekf.h"
+    #include "ahrs_fixed.h"
+}
+
+// Cycles per AHRS update on the target, for comparing builds with and without
+// CONFIG_AHRS_FAST_INV_SQRT (and other changes to ahrs.c).  The EKF is run too, it has to fit a
+// 200 Hz loop next to the sensor reads.  On a core without an FPU (ESP32-C3) compare mahony with
+// fixed, the same filter in Q2.30.
+#define ITERATIONS 10000
+#define TABLE_SIZE 256 // Inputs are cycled through, a power of 2
+#define SAMPLE_FREQ_Hz 200
+
+static const char *TAG = "ahrs_benchmark";
+
+// Slowly varying inputs, so the filter does real work and nothing is constant folded.
+static void inputs(int i, float g[3], float a[3], float m[3])
+{
+    float t = i * (1.0f / SAMPLE_FREQ_Hz);
+    g[0] = 0.1f * sinf(t);
+    g[1] = 0.2f * cosf(0.5f * t);
+    g[2] = 0.05f;
+    a[0] = 0.1f * sinf(0.3f * t);
+    a[1] = 0.2f;
+    a[2] = 0.97f;
+    m[0] = 0.3f;
+    m[1] = 0.1f * sinf(t);
+    m[2] = -0.4f;
+}
+
+extern "C" void app_main(void)
+{
+    static float g[TABLE_SIZE][3], a[TABLE_SIZE][3], m[TABLE_SIZE][3];
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        inputs(i, g[i], a[i], m[i]);
+    }
+
+    // The same inputs as arrays per axis, for ahrs_filter_update_block()
+    static float soa[9][TABLE_SIZE];
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        for (int k = 0; k < 3; k++) {
+            soa[k][i] = g[i][k];
+            soa[3 + k][i] = a[i][k];
+            soa[6 + k][i] = m[i][k];
+        }
+    }
+    ahrs_block_t block = {};
+    block.gx = soa[0], block.gy = soa[1], block.gz = soa[2];
+    block.ax = soa[3], block.ay = soa[4], block.az = soa[5];
+    block.mx = soa[6], block.my = soa[7], block.mz = soa[8];
+
+#ifdef CONFIG_AHRS_FAST_INV_SQRT
+    ESP_LOGI(TAG, "CONFIG_AHRS_FAST_INV_SQRT: y");
+#else
+    ESP_LOGI(TAG, "CONFIG_AHRS_FAST_INV_SQRT: n");
+#endif
+
+    ahrs_t madgwick;
+    ahrs_t mahony;
+    ahrs_filter_init(&madgwick, SAMPLE_FREQ_Hz, 0.8f);
+    ahrs_filter_init_mahony(&mahony, SAMPLE_FREQ_Hz, 0.5f, 0.05f);
+
+    ahrs_t *filters[] = {&madgwick, &mahony};
+    const char *names[] = {"madgwick", "mahony"};
+    for (int f = 0; f < 2; f++) {
+        ahrs_t *ahrs = filters[f];
+
+        // Keep the task from being switched out in the middle of a run.
+        vTaskSuspendAll();
+
+        uint32_t start = esp_cpu_get_cycle_count();
+        for (int i = 0; i < ITERATIONS; i++) {
+            int j = i & (TABLE_SIZE - 1);
+            ahrs_filter_update(ahrs, g[j][0], g[j][1], g[j][2], a[j][0], a[j][1], a[j][2], m[j][0], m[j][1], m[j][2]);
+        }
+        uint32_t ahrs_cycles = esp_cpu_get_cycle_count() - start;
+
+        start = esp_cpu_get_cycle_count();
+        for (int i = 0; i < ITERATIONS; i++) {
+            int j = i & (TABLE_SIZE - 1);
+            ahrs_filter_update_imu(ahrs, g[j][0], g[j][1], g[j][2], a[j][0], a[j][1], a[j][2]);
+        }
+        uint32_t imu_cycles = esp_cpu_get_cycle_count() - start;
+
+        start = esp_cpu_get_cycle_count();
+        for (int i = 0; i < ITERATIONS; i += TABLE_SIZE) {
+            ahrs_filter_update_block(ahrs, &block, TABLE_SIZE, NULL, 0);
+        }
+        uint32_t block_cycles = esp_cpu_get_cycle_count() - start;
+
+        xTaskResumeAll();
+
+        ESP_LOGI(TAG, "%s ahrs_filter_update:     %lu cycles", names[f], (unsigned long)(ahrs_cycles / ITERATIONS));
+        ESP_LOGI(TAG, "%s ahrs_filter_update_imu: %lu cycles", names[f], (unsigned long)(imu_cycles / ITERATIONS));
+        ESP_LOGI(TAG, "%s ahrs_filter_update_block: %lu cycles a sample", names[f],
+                 (unsigned long)(block_cycles / ((ITERATIONS + TABLE_SIZE - 1) / TABLE_SIZE * TABLE_SIZE)));
+    }
+
+    static ahrs_ekf_t ekf;
+    ahrs_ekf_config_t ekf_config = AHRS_EKF_DEFAULT_CONFIG();
+    ahrs_ekf_init(&ekf, SAMPLE_FREQ_Hz, &ekf_config);
+
+    vTaskSuspendAll();
+
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int j = i & (TABLE_SIZE - 1);
+        ahrs_ekf_update(&ekf, g[j][0], g[j][1], g[j][2], a[j][0], a[j][1], a[j][2], m[j][0], m[j][1], m[j][2]);
+    }
+    uint32_t ekf_cycles = esp_cpu_get_cycle_count() - start;
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int j = i & (TABLE_SIZE - 1);
+        ahrs_ekf_update_imu(&ekf, g[j][0], g[j][1], g[j][2], a[j][0], a[j][1], a[j][2]);
+    }
+    uint32_t ekf_imu_cycles = esp_cpu_get_cycle_count() - start;
+
+    xTaskResumeAll();
+
+    ESP_LOGI(TAG, "ekf ahrs_ekf_update:       %lu cycles", (unsigned long)(ekf_cycles / ITERATIONS));
+    ESP_LOGI(TAG, "ekf ahrs_ekf_update_imu:   %lu cycles", (unsigned long)(ekf_imu_cycles / ITERATIONS));
+
+    // The fixed point inputs: gyro Q16.16 rad/s, accel and mag in any scale
+    static int32_t gi[TABLE_SIZE][3], ai[TABLE_SIZE][3], mi[TABLE_SIZE][3];
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        for (int k = 0; k < 3; k++) {
+            gi[i][k] = AHRS_FIXED_Q16(g[i][k]);
+            ai[i][k] = (int32_t)(a[i][k] * 16384.0f);
+            mi[i][k] = (int32_t)(m[i][k] * 16384.0f);
+        }
+    }
+
+    ahrs_fixed_t fixed;
+    ahrs_fixed_init(&fixed, SAMPLE_FREQ_Hz, 0.5f, 0.05f);
+
+    vTaskSuspendAll();
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int j = i & (TABLE_SIZE - 1);
+        ahrs_fixed_update(&fixed, gi[j][0], gi[j][1], gi[j][2], ai[j][0], ai[j][1], ai[j][2], mi[j][0], mi[j][1], mi[j][2]);
+    }
+    uint32_t fixed_cycles = esp_cpu_get_cycle_count() - start;
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int j = i & (TABLE_SIZE - 1);
+        ahrs_fixed_update_imu(&fixed, gi[j][0], gi[j][1], gi[j][2], ai[j][0], ai[j][1], ai[j][2]);
+    }
+    uint32_t fixed_imu_cycles = esp_cpu_get_cycle_count() - start;
+
+    xTaskResumeAll();
+
+    ESP_LOGI(TAG, "fixed ahrs_fixed_update:   %lu cycles", (unsigned long)(fixed_cycles / ITERATIONS));
+    ESP_LOGI(TAG, "fixed ahrs_fixed_update_imu: %lu cycles", (unsigned long)(fixed_imu_cycles / ITERATIONS));
+
+    float heading, pitch, roll;
+    ahrs_filter_get_euler_in_degrees(&mahony, &heading, &pitch, &roll);
+    ESP_LOGI(TAG, "heading: %2.3f°, pitch: %2.3f°, roll: %2.3f°", heading, pitch, roll);
+}
@@ -0,0 +1,207 @@
+//=====================================================================================================
+// test_ahrs_fixed.c
+//=====================================================================================================
+//
+// Host test of the fixed point Mahony engine against the float one, see ahrs_fixed.h.  Built by the
+// host branch of util_ahrs/CMakeLists.txt, once as is and once with CONFIG_AHRS_FAST_INV_SQRT:
+//
+//   cmake -S util_ahrs -B build && cmake --build build && ctest --test-dir build
+//
+//=====================================================================================================
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ahrs.h"
+#include "ahrs_fixed.h"
+
+#define FS (200.0f)
+#define SAMPLES (200000)
+#define Q30_TO_DOUBLE (1.0 / 1073741824.0)
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+  {
+    failures++;
+  }
+}
+
+// Small deterministic generator, so the result is the same on every host.
+static uint32_t rng_state = 1;
+
+static float randn(void)
+{
+  float u[2];
+  for (int i = 0; i < 2; i++)
+  {
+    rng_state = rng_state * 1664525u + 1013904223u;
+    u[i] = ((rng_state >> 8) + 1.0f) / 16777218.0f;
+  }
+  return sqrtf(-2.0f * logf(u[0])) * cosf(6.2831853f * u[1]);
+}
+
+// Earth frame vector e seen in the sensor frame of q
+static void earth_to_sensor(const float q[4], const float e[3], float s[3])
+{
+  float w = q[0], x = q[1], y = q[2], z = q[3];
+  const float r[3][3] = {
+      {1 - 2 * (y * y + z * z), 2 * (x * y - w * z), 2 * (x * z + w * y)},
+      {2 * (x * y + w * z), 1 - 2 * (x * x + z * z), 2 * (y * z - w * x)},
+      {2 * (x * z - w * y), 2 * (y * z + w * x), 1 - 2 * (x * x + y * y)}};
+  for (int i = 0; i < 3; i++)
+  {
+    s[i] = r[0][i] * e[0] + r[1][i] * e[1] + r[2][i] * e[2];
+  }
+}
+
+static double norm2(const ahrs_fixed_t *x)
+{
+  return ((double)x->q0 * x->q0 + (double)x->q1 * x->q1 + (double)x->q2 * x->q2 + (double)x->q3 * x->q3) *
+         Q30_TO_DOUBLE * Q30_TO_DOUBLE;
+}
+
+/**
+ * Both engines fed the same quantised samples of a tumbling device, up to 4 rad/s on each axis, with
+ * gyro bias and noise.  The bound is the one stated in ahrs_fixed.h.
+ */
+static void test_against_float(bool use_mag)
+{
+  const float ge[3] = {0.0f, 0.0f, 1.0f};
+  const float me[3] = {0.4f, 0.0f, -0.9f};
+  const float bias[3] = {0.02f, -0.015f, 0.01f};
+  float q[4] = {1.0f, 0.0f, 0.0f, 0.0f};
+
+  ahrs_t f;
+  ahrs_fixed_t x;
+  ahrs_filter_init_mahony(&f, FS, 0.5f, 0.05f);
+  ahrs_fixed_init(&x, FS, 0.5f, 0.05f);
+
+  double max_err = 0.0, sum_err2 = 0.0, max_norm_err = 0.0;
+  for (int i = 0; i < SAMPLES; i++)
+  {
+    float t = i / FS;
+    const float w[3] = {3.0f * sinf(0.5f * t), 2.0f * sinf(0.33f * t + 1.0f), 4.0f * sinf(0.21f * t + 2.0f)};
+
+    // Raw counts: gyro Q16.16 rad/s, accel 16384 / g, mag 333 / field
+    float a[3], m[3];
+    int32_t gi[3], ai[3], mi[3];
+    float g[3];
+    earth_to_sensor(q, ge, a);
+    earth_to_sensor(q, me, m);
+    for (int k = 0; k < 3; k++)
+    {
+      gi[k] = (int32_t)lroundf((w[k] + bias[k] + 0.005f * randn()) * 65536.0f);
+      ai[k] = (int32_t)lroundf((a[k] + 0.05f * randn()) * 16384.0f);
+      mi[k] = (int32_t)lroundf((m[k] + 0.02f * randn()) * 333.0f);
+      g[k] = gi[k] / 65536.0f;
+      a[k] = ai[k] / 16384.0f;
+      m[k] = mi[k] / 333.0f;
+    }
+
+    if (use_mag)
+    {
+      ahrs_filter_update(&f, g[0], g[1], g[2], a[0], a[1], a[2], m[0], m[1], m[2]);
+      ahrs_fixed_update(&x, gi[0], gi[1], gi[2], ai[0], ai[1], ai[2], mi[0], mi[1], mi[2]);
+    }
+    else
+    {
+      ahrs_filter_update_imu(&f, g[0], g[1], g[2], a[0], a[1], a[2]);
+      ahrs_fixed_update_imu(&x, gi[0], gi[1], gi[2], ai[0], ai[1], ai[2]);
+    }
+
+    // Divided by both norms, the float quaternion is only unit to about 5e-6 with the fast inverse
+    // square root, which would otherwise read as a 0.3 deg error
+    double f2 = (double)f.q0 * f.q0 + (double)f.q1 * f.q1 + (double)f.q2 * f.q2 + (double)f.q3 * f.q3;
+    double d = fabs(((double)f.q0 * x.q0 + (double)f.q1 * x.q1 + (double)f.q2 * x.q2 + (double)f.q3 * x.q3) *
+                    Q30_TO_DOUBLE / sqrt(f2 * norm2(&x)));
+    double err = d >= 1.0 ? 0.0 : 2.0 * acos(d) * 180.0 / M_PI;
+    if (err > max_err)
+      max_err = err;
+    sum_err2 += err * err;
+    if (fabs(norm2(&x) - 1.0) > max_norm_err)
+      max_norm_err = fabs(norm2(&x) - 1.0);
+
+    // Truth
+    float hx = 0.5f * w[0] / FS, hy = 0.5f * w[1] / FS, hz = 0.5f * w[2] / FS;
+    float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    q[0] += -q1 * hx - q2 * hy - q3 * hz;
+    q[1] += q0 * hx + q2 * hz - q3 * hy;
+    q[2] += q0 * hy - q1 * hz + q3 * hx;
+    q[3] += q0 * hz + q1 * hy - q2 * hx;
+    float n = 1.0f / sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    for (int k = 0; k < 4; k++)
+      q[k] *= n;
+  }
+
+  double rms = sqrt(sum_err2 / SAMPLES);
+  printf("%s: max %.4f deg, rms %.4f deg, max ||q|^2 - 1| %.2e\n", use_mag ? "MARG" : "IMU", max_err, rms, max_norm_err);
+  check(max_err < 0.1, use_mag ? "MARG within 0.1 deg of float" : "IMU within 0.1 deg of float");
+  check(rms < 0.02, use_mag ? "MARG under 0.02 deg RMS" : "IMU under 0.02 deg RMS");
+  check(max_norm_err < 1e-6, use_mag ? "MARG quaternion stays unit" : "IMU quaternion stays unit");
+}
+
+/**
+ * Gyro inputs no sensor can produce must still leave a unit quaternion.
+ */
+static void test_saturated_gyro(void)
+{
+  ahrs_fixed_t x;
+  ahrs_fixed_init(&x, 50.0f, 0.5f, 0.05f);
+  double worst = 0.0;
+  for (int i = 0; i < 1000; i++)
+  {
+    ahrs_fixed_update_imu(&x, INT32_MAX, INT32_MAX, INT32_MAX, 0, 0, 16384);
+    if (fabs(norm2(&x) - 1.0) > worst)
+      worst = fabs(norm2(&x) - 1.0);
+  }
+  for (int i = 0; i < 1000; i++)
+  {
+    ahrs_fixed_update_imu(&x, INT32_MIN, INT32_MAX, INT32_MIN, 0, 0, 16384);
+    if (fabs(norm2(&x) - 1.0) > worst)
+      worst = fabs(norm2(&x) - 1.0);
+  }
+  printf("saturated gyro: max ||q|^2 - 1| %.2e\n", worst);
+  check(worst < 1e-6, "saturated gyro keeps a unit quaternion");
+}
+
+/**
+ * 2000 dps, the MPU-9250's full scale, at a low sample rate.  No accel, so the rotation is pure gyro.
+ */
+static void test_full_scale_rate(void)
+{
+  const float rate = 2000.0f * (float)M_PI / 180.0f;
+  const float fs = 50.0f;
+
+  ahrs_fixed_t x;
+  ahrs_fixed_init(&x, fs, 0.5f, 0.0f);
+  double worst = 0.0;
+  for (int i = 0; i < 5000; i++)
+  {
+    ahrs_fixed_update_imu(&x, AHRS_FIXED_Q16(rate), 0, 0, 0, 0, 0);
+    if (fabs(norm2(&x) - 1.0) > worst)
+      worst = fabs(norm2(&x) - 1.0);
+  }
+  printf("2000 dps at 50 Hz: max ||q|^2 - 1| %.2e\n", worst);
+  check(worst < 1e-6, "2000 dps at 50 Hz keeps a unit quaternion");
+}
+
+int main(void)
+{
+  test_against_float(false);
+  test_against_float(true);
+  test_saturated_gyro();
+  test_full_scale_rate();
+
+  printf("%d failure(s)\n", failures);
+  return failures == 0 ? 0 : 1;
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
@@ -1,27 +1,258 @@
-//=====================================================================================================
-// ahrs.h
-//=====================================================================================================
-//
-// Implementation of Madgwick's IMU and AHRS algorithms.
-// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
-//
-// Date			Author          Notes
-// 29/09/2011	SOH Madgwick    Initial release
-// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
-//
-//=====================================================================================================
-#ifndef AHRS_H
-#define AHRS_H
-
-//---------------------------------------------------------------------------------------------------
-// Function declarations
-
-void ahrs_init(float sampleFreqDef, float betaDef);
-void ahrs_update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
-void ahrs_update_imu(float gx, float gy, float gz, float ax, float ay, float az);
-void ahrs_get_euler_in_degrees(float *heading, float *pitch, float *roll);
-
-#endif // AHRS_H
-//=====================================================================================================
-// End of file
-//=====================================================================================================
+//=====================================================================================================
+// ahrs.h
+//=====================================================================================================
+//
+// Implementation of Madgwick's and Mahony's IMU and AHRS algorithms.
+// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
+//
+// Date			Author          Notes
+// 29/09/2011	SOH Madgwick    Initial release
+// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
+//
+//=====================================================================================================
+#ifndef AHRS_H
+#define AHRS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//---------------------------------------------------------------------------------------------------
+// Filter state, one per filter.  Several can run side by side, e.g. one per IMU.
+
+typedef enum
+{
+  AHRS_ENGINE_MADGWICK = 0, // Gradient descent, one gain (beta)
+  AHRS_ENGINE_MAHONY,       // PI complementary filter, the integral term tracks the gyro bias
+} ahrs_engine_t;
+
+/**
+ * Gain scheduling, see ahrs_filter_set_gain_schedule().  The configured gains (beta, or kp and ki)
+ * are the steady state gains, scaled by:
+ *   - initial_gain at start, held there while the tilt (from the accel) or heading (from the mag)
+ *     error is over error_threshold, then ramping down to 1 over convergence_time.
+ *   - initial_gain again, once converged, when the error has been over error_threshold for
+ *     restart_time, with the accel magnitude within accel_tolerance and the gyro below
+ *     rotation_threshold the whole time.  So after the estimate was thrown off it re-converges at
+ *     the high gain.  A sideways acceleration hardly changes the accel magnitude and looks like a
+ *     tilt error, so restart_time should be longer than any such acceleration lasts.
+ *   - 1 to 0 as the accel magnitude moves from accel_tolerance to accel_rejection away from gravity,
+ *     so linear acceleration doesn't pull the attitude.  This scales the mag feedback as well.
+ */
+typedef struct
+{
+  float initial_gain;     // Multiple of the steady gain, e.g. 20
+  float convergence_time; // s, to ramp down from initial_gain
+  float error_threshold;  // rad, 0 for only the ramp from the start
+  float restart_time;     // s the error has to last for before the gain is raised again
+  float rotation_threshold; // rad/s, the error only counts while the gyro is below this
+  float gravity;          // Accel magnitude at rest, in the accel units (1 for g)
+  float accel_tolerance;  // Fraction of gravity, full gain inside this
+  float accel_rejection;  // Fraction of gravity, no gain past this
+} ahrs_gain_schedule_t;
+
+#define AHRS_GAIN_SCHEDULE_DEFAULT_CONFIG() \
+  {                                         \
+    .initial_gain = 20.0f,                  \
+    .convergence_time = 6.0f,               \
+    .error_threshold = 0.1f,                \
+    .restart_time = 3.0f,                   \
+    .rotation_threshold = 0.1f,             \
+    .gravity = 1.0f,                        \
+    .accel_tolerance = 0.05f,               \
+    .accel_rejection = 0.2f,                \
+  }
+
+/**
+ * Magnetic disturbance rejection, see ahrs_filter_set_mag_rejection().  The field is checked against
+ * the expected magnitude and inclination (angle to the accel), and while it is off by more than the
+ * tolerances, or hasn't been back within them for recovery_time, the mag is skipped and the update
+ * is IMU only.  The reference is taken once the field has stayed consistent (within the tolerances
+ * of its own mean) for recovery_time, the mag is skipped until then.  It follows slow changes while
+ * the field is undisturbed, so a disturbance that builds up slower than learn_time isn't seen.  A
+ * field that is off the reference but has been consistent for reseed_time becomes the new
+ * reference, so starting next to a motor or steel isn't locked in.  The same goes for a disturbance
+ * that stays put for that long, the heading then follows it.
+ */
+typedef struct
+{
+  float field;                 // Expected magnitude in the mag units, 0 to learn it
+  float magnitude_tolerance;   // Fraction of the expected magnitude
+  float inclination_tolerance; // rad
+  float learn_time;            // s, time constant of the reference following the field
+  float recovery_time;         // s
+  float reseed_time;           // s a consistent field off the reference takes to replace it
+} ahrs_mag_rejection_t;
+
+#define AHRS_MAG_REJECTION_DEFAULT_CONFIG() \
+  {                                         \
+    .field = 0.0f,                          \
+    .magnitude_tolerance = 0.1f,            \
+    .inclination_tolerance = 0.1f,          \
+    .learn_time = 30.0f,                    \
+    .recovery_time = 1.0f,                  \
+    .reseed_time = 10.0f,                   \
+  }
+
+/**
+ * The latest orientation of an instance, for other tasks on either core, see
+ * ahrs_filter_set_publication().  A seqlock: the update never waits, a reader that raced it reads
+ * again.  Only accessed with atomics, use the ahrs_publication_* functions.
+ */
+#define AHRS_PUBLICATION_WORDS (6) // q0 to q3, timestamp low and high
+typedef struct
+{
+  uint32_t sequence; // Odd while being written
+  uint32_t words[AHRS_PUBLICATION_WORDS];
+} ahrs_publication_t;
+
+typedef struct
+{
+  ahrs_engine_t engine;
+  float q0, q1, q2, q3; // quaternion of sensor frame relative to auxiliary frame
+  float beta;           // Madgwick: 2 * proportional gain (Kp)
+  float two_kp, two_ki; // Mahony: 2 * proportional gain (Kp), 2 * integral gain (Ki)
+  float integral_x, integral_y, integral_z; // Mahony: integral error terms scaled by Ki, rad/s
+  float sample_freq;    // Hz
+  float sample_period;  // s, 1 / sample_freq, the dt of the fixed rate updates
+
+  // Timestamp updates: dt from the previous timestamp, clamped to [dt_min, dt_max].  Init sets a
+  // quarter and four times the sample period.
+  float dt_min, dt_max;
+  int64_t last_timestamp_us;
+  bool has_timestamp;
+
+  // Gain scheduling, the gains are scaled by kp_scale and ki_scale (1 without a schedule)
+  bool scheduled;
+  ahrs_gain_schedule_t schedule;
+  float gain;                 // Current multiple of the steady gain, before accel gating
+  float gain_ramp;            // per s
+  float recip_gravity2;       // 1 / gravity^2
+  float cos2_error_threshold; // cos^2(error_threshold)
+  float error_time;           // s the error has been over the threshold
+  float kp_scale, ki_scale;
+
+  // Mag disturbance rejection
+  bool mag_rejection;
+  ahrs_mag_rejection_t mag_config;
+  float mag_dot_tolerance; // sin(inclination_tolerance)
+  bool mag_reference_valid;
+  float mag_reference_norm; // Expected |m|
+  float mag_reference_dot;  // Expected cosine of the angle between the field and the accel
+  float mag_clean_time;     // s the field has been within the tolerances
+  float mag_candidate_norm; // Mean |m| since the field last jumped
+  float mag_candidate_dot;  // Mean cosine since the field last jumped
+  float mag_candidate_time; // s the field has been within the tolerances of the candidate
+  bool mag_disturbed;
+
+  ahrs_publication_t *publication; // NULL if not published
+  int64_t time_us;                 // Time of the last published sample
+} ahrs_t;
+
+typedef struct
+{
+  float q0, q1, q2, q3;
+} ahrs_quaternion_t;
+
+// A block of samples, e.g. from the MPU9250 FIFO, one array per axis (structure of arrays).  Same
+// units as ahrs_filter_update().
+typedef struct
+{
+  const float *gx, *gy, *gz;
+  const float *ax, *ay, *az;
+  const float *mx, *my, *mz;   // NULL for IMU only updates
+  const int64_t *timestamp_us; // NULL to use the sample period
+} ahrs_block_t;
+
+//---------------------------------------------------------------------------------------------------
+// Function declarations
+
+void ahrs_filter_init(ahrs_t *ahrs, float sampleFreqDef, float betaDef);
+
+/**
+ * Use the Mahony filter for this instance, it is cheaper per update than Madgwick.  The update,
+ * update_imu and get functions are the same for both.  With ki = 0 there is no bias estimation.
+ */
+void ahrs_filter_init_mahony(ahrs_t *ahrs, float sampleFreqDef, float kp, float ki);
+/**
+ * Schedule the gains of this instance, NULL to go back to the fixed gains.  Starts the convergence
+ * ramp, so call it after init, or to re-converge.
+ */
+void ahrs_filter_set_gain_schedule(ahrs_t *ahrs, const ahrs_gain_schedule_t *schedule);
+
+/**
+ * Skip the mag while the field is disturbed, NULL to always use it.  Restarts learning the reference.
+ */
+void ahrs_filter_set_mag_rejection(ahrs_t *ahrs, const ahrs_mag_rejection_t *rejection);
+
+/**
+ * True while the mag is being skipped, the heading is then gyro only and will drift.
+ */
+bool ahrs_filter_get_mag_disturbed(const ahrs_t *ahrs);
+
+void ahrs_filter_update(ahrs_t *ahrs, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+void ahrs_filter_update_imu(ahrs_t *ahrs, float gx, float gy, float gz, float ax, float ay, float az);
+
+/**
+ * As ahrs_filter_update() and ahrs_filter_update_imu(), integrating over the given dt in seconds
+ * instead of the fixed sample period.
+ */
+void ahrs_filter_update_dt(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+void ahrs_filter_update_imu_dt(ahrs_t *ahrs, float dt, float gx, float gy, float gz, float ax, float ay, float az);
+
+/**
+ * As above with dt from the time since the previous timestamp update, e.g. esp_timer_get_time() taken
+ * when the sample was read.  The dt is clamped to [dt_min, dt_max], so a stalled loop or a timestamp
+ * going backwards doesn't throw the attitude.  The first call, and the first after an update without
+ * a timestamp, uses the sample period.
+ */
+void ahrs_filter_update_timestamp(ahrs_t *ahrs, int64_t timestamp_us, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+void ahrs_filter_update_imu_timestamp(ahrs_t *ahrs, int64_t timestamp_us, float gx, float gy, float gz, float ax, float ay, float az);
+
+/**
+ * Run the filter over `n` samples in one loop, the filter state is kept in locals throughout.  With
+ * timestamps, dt is worked out as in ahrs_filter_update_timestamp().
+ * @param out NULL, or room for n / decimation orientations, the state after every `decimation`th
+ *            sample.  The final orientation is always left in `ahrs`.
+ * @return The number of orientations written to `out`.
+ */
+size_t ahrs_filter_update_block(ahrs_t *ahrs, const ahrs_block_t *block, size_t n, ahrs_quaternion_t *out, size_t decimation);
+
+/**
+ * Publish every update of this instance, NULL to stop.  The block update publishes once, at the end
+ * of the block.  The timestamp is the sample's for timestamp updates, otherwise the time summed from
+ * dt since the publication was set or the last timestamp update.
+ */
+void ahrs_publication_init(ahrs_publication_t *publication);
+void ahrs_filter_set_publication(ahrs_t *ahrs, ahrs_publication_t *publication);
+
+/**
+ * Read the latest published orientation, from any task.  Never blocks the updating task.
+ * @param timestamp_us NULL if not needed
+ */
+void ahrs_publication_read(const ahrs_publication_t *publication, ahrs_quaternion_t *q, int64_t *timestamp_us);
+void ahrs_publication_get_euler_in_degrees(const ahrs_publication_t *publication, float *heading, float *pitch, float *roll);
+
+void ahrs_filter_get_euler_in_degrees(const ahrs_t *ahrs, float *heading, float *pitch, float *roll);
+
+/**
+ * Mahony only: the gyro bias estimated by the integral term, in rad/s.  Zero for Madgwick.
+ */
+void ahrs_filter_get_gyro_bias(const ahrs_t *ahrs, float *bx, float *by, float *bz);
+
+// The functions below work on a default instance, returned by ahrs_default().  It is published, so
+// ahrs_get_euler_in_degrees() can be called from any task.  ahrs_init() keeps the publication, but
+// ahrs_filter_init() or ahrs_filter_init_mahony() on ahrs_default() detaches it.  The default
+// instance is then read directly, only safe from the updating task, until a publication is set
+// again with ahrs_filter_set_publication().
+ahrs_t *ahrs_default(void);
+
+void ahrs_init(float sampleFreqDef, float betaDef);
+void ahrs_update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+void ahrs_update_imu(float gx, float gy, float gz, float ax, float ay, float az);
+void ahrs_get_euler_in_degrees(float *heading, float *pitch, float *roll);
+
+#endif // AHRS_H
+//=====================================================================================================
+// End of file
+//=====================================================================================================
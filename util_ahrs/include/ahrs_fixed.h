@@ -0,0 +1,44 @@
+//=====================================================================================================
+// ahrs_fixed.h
+//=====================================================================================================
+//
+// Fixed point Mahony AHRS, for cores without an FPU (ESP32-C3), where every float operation in ahrs.c
+// is a soft-float call.  Same algorithm as the AHRS_ENGINE_MAHONY engine of ahrs.c.
+//
+// The quaternion is Q2.30, gyro rates are Q16.16 rad/s.  Accel and mag can be in any units, e.g. the
+// raw sensor counts, only the direction is used.  Fed the same samples as the float engine, the
+// attitude stays within 0.1 degrees of it (0.02 RMS, simulated at up to 4 rad/s).  The rotation per
+// update is limited to 1 rad about each axis, far beyond any real gyro and sample rate.
+//
+// host_test/test_ahrs_fixed.c checks these bounds, build util_ahrs with plain CMake to run it.
+//
+//=====================================================================================================
+#ifndef AHRS_FIXED_H
+#define AHRS_FIXED_H
+
+#include <stdint.h>
+
+#define AHRS_FIXED_Q30(x) ((int32_t)((x) * 1073741824.0f)) // |x| < 2
+#define AHRS_FIXED_Q16(x) ((int32_t)((x) * 65536.0f))      // |x| < 32768
+
+typedef struct
+{
+  int32_t q0, q1, q2, q3;                     // Q2.30, quaternion of sensor frame relative to auxiliary frame
+  int32_t two_kp, two_ki;                     // Q16.16, 2 * proportional gain (Kp), 2 * integral gain (Ki)
+  int32_t integral_x, integral_y, integral_z; // Q2.30 rad/s, integral error terms scaled by Ki
+  int32_t sample_period;                      // Q2.30 s
+} ahrs_fixed_t;
+
+//---------------------------------------------------------------------------------------------------
+// Function declarations
+
+// Float arguments are only converted here, the updates are integer only.
+void ahrs_fixed_init(ahrs_fixed_t *ahrs, float sampleFreqDef, float kp, float ki);
+void ahrs_fixed_update(ahrs_fixed_t *ahrs, int32_t gx, int32_t gy, int32_t gz, int32_t ax, int32_t ay, int32_t az, int32_t mx, int32_t my, int32_t mz);
+void ahrs_fixed_update_imu(ahrs_fixed_t *ahrs, int32_t gx, int32_t gy, int32_t gz, int32_t ax, int32_t ay, int32_t az);
+void ahrs_fixed_get_euler_in_degrees(const ahrs_fixed_t *ahrs, float *heading, float *pitch, float *roll);
+
+#endif // AHRS_FIXED_H
+//=====================================================================================================
+// End of file
+//=====================================================================================================
@@ -0,0 +1,86 @@
+//=====================================================================================================
+// ekf.h
+//=====================================================================================================
+//
+// Multiplicative error-state extended Kalman filter for attitude and gyro bias.
+//
+// The nominal state is the same quaternion as ahrs_t (sensor frame relative to the earth frame) and a
+// gyro bias.  The error state is a small body frame rotation and a bias error, 6 states, with a
+// fixed size covariance and no heap.  The inputs are the same as ahrs_filter_update(): gyro in
+// rad/s, accel and mag in any units (only the direction is used).
+//
+//=====================================================================================================
+#ifndef AHRS_EKF_H
+#define AHRS_EKF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define AHRS_EKF_STATES (6) // Attitude error (3), gyro bias (3)
+
+typedef struct
+{
+  float gyro_noise;        // Gyro white noise, rad/s/sqrt(Hz)
+  float gyro_bias_walk;    // Gyro bias random walk, rad/s/sqrt(s)
+  float accel_noise;       // Noise of the normalised accel direction, includes vibration
+  float mag_noise;         // Noise of the normalised mag direction
+  float gate;              // Reject an accel update with NIS above this, 0 for no gate
+  float mag_gate;          // Reject a heading update with NIS above this, 0 for no gate
+  float init_attitude_std; // rad
+  float init_bias_std;     // rad/s
+} ahrs_ekf_config_t;
+
+#define AHRS_EKF_DEFAULT_CONFIG()  \
+  {                                \
+    .gyro_noise = 0.01f,           \
+    .gyro_bias_walk = 0.0005f,     \
+    .accel_noise = 0.1f,           \
+    .mag_noise = 0.05f,            \
+    .gate = 16.27f,                \
+    .mag_gate = 10.83f,            \
+    .init_attitude_std = 0.5f,     \
+    .init_bias_std = 0.05f,        \
+  }
+
+typedef struct
+{
+  ahrs_ekf_config_t config;
+  float sample_freq; // Hz
+
+  float q0, q1, q2, q3; // quaternion of sensor frame relative to auxiliary frame
+  float bias[3];        // rad/s, subtracted from the gyro
+  float P[AHRS_EKF_STATES][AHRS_EKF_STATES];
+
+  // From the last update of each sensor.  The NIS (normalised innovation squared) averages the
+  // degrees of freedom of the innovation if the noise settings are right, much more means they are
+  // too small.  The accel innovation is the difference of two unit vectors, which is nearly
+  // perpendicular to gravity, so it has about 2 DOF (1.5 in simulation).  The default gate of 16.27
+  // is the 0.999 chi-square point for 3 DOF, a little looser than the 13.82 for 2 DOF, so a good
+  // update is rejected about 3 times in 10000.  The mag only corrects heading, its innovation is
+  // the heading error in rad with 1 DOF, gated at 10.83 (0.999 for 1 DOF).
+  float accel_innovation[3];
+  float accel_nis;
+  float mag_innovation;
+  float mag_nis;
+  uint32_t accel_rejected; // Updates over the gate
+  uint32_t mag_rejected;
+} ahrs_ekf_t;
+
+//---------------------------------------------------------------------------------------------------
+// Function declarations
+
+void ahrs_ekf_init(ahrs_ekf_t *ekf, float sampleFreqDef, const ahrs_ekf_config_t *config);
+void ahrs_ekf_update(ahrs_ekf_t *ekf, float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+void ahrs_ekf_update_imu(ahrs_ekf_t *ekf, float gx, float gy, float gz, float ax, float ay, float az);
+void ahrs_ekf_get_euler_in_degrees(const ahrs_ekf_t *ekf, float *heading, float *pitch, float *roll);
+
+/**
+ * One sigma attitude error about the body axes and gyro bias error, from the covariance diagonal.
+ */
+void ahrs_ekf_get_attitude_std(const ahrs_ekf_t *ekf, float *x, float *y, float *z);
+void ahrs_ekf_get_bias_std(const ahrs_ekf_t *ekf, float *x, float *y, float *z);
+
+#endif // AHRS_EKF_H
+//=====================================================================================================
+// End of file
+//=====================================================================================================
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+
+#include "calstore.h"
+
+static const char *TAG = "calstore";
+
+#define CALSTORE_NAMESPACE "calstore"
+#define CALSTORE_MAGIC (0x4C41430A) // "\nCAL"
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; // sizeof(calstore_data_t) when written
+  uint32_t crc;  // CRC32 of the payload
+} calstore_header_t;
+
+typedef struct
+{
+  calstore_header_t header;
+  calstore_data_t data;
+} calstore_blob_t;
+
+static uint32_t payload_crc(const calstore_data_t *data)
+{
+  return esp_rom_crc32_le(0, (const uint8_t *)data, sizeof(calstore_data_t));
+}
+
+esp_err_t calstore_device_id(char id[CALSTORE_ID_LEN])
+{
+  uint8_t mac[6];
+  esp_err_t ret = esp_efuse_mac_get_default(mac);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  snprintf(id, CALSTORE_ID_LEN, "c%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return ESP_OK;
+}
+
+esp_err_t calstore_load(const char *id, calstore_data_t *data)
+{
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(CALSTORE_NAMESPACE, NVS_READONLY, &handle);
+  if (ret == ESP_ERR_NVS_NOT_FOUND)
+  {
+    // The namespace is only created by the first save.
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  calstore_blob_t blob;
+  size_t len = sizeof(blob);
+  ret = nvs_get_blob(handle, id, &blob, &len);
+  nvs_close(handle);
+
+  if (ret == ESP_ERR_NVS_NOT_FOUND)
+  {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (ret == ESP_ERR_NVS_INVALID_LENGTH)
+  {
+    // Bigger than this firmware's layout, so from a different version.
+    return ESP_ERR_INVALID_VERSION;
+  }
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  if (len < sizeof(calstore_header_t) || blob.header.magic != CALSTORE_MAGIC)
+  {
+    ESP_LOGW(TAG, "%s: not a calibration blob", id);
+    return ESP_ERR_INVALID_CRC;
+  }
+  if (blob.header.version != CALSTORE_VERSION || blob.header.size != sizeof(calstore_data_t) || len != sizeof(blob))
+  {
+    ESP_LOGW(TAG, "%s: stored version %u, this firmware uses %u", id, blob.header.version, CALSTORE_VERSION);
+    return ESP_ERR_INVALID_VERSION;
+  }
+  if (blob.header.crc != payload_crc(&blob.data))
+  {
+    ESP_LOGW(TAG, "%s: CRC mismatch", id);
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  *data = blob.data;
+  ESP_LOGI(TAG, "%s: loaded (sections 0x%x)", id, (unsigned)data->sections);
+  return ESP_OK;
+}
+
+esp_err_t calstore_save(const char *id, const calstore_data_t *data)
+{
+  calstore_blob_t blob;
+  memset(&blob, 0, sizeof(blob));
+  blob.header.magic = CALSTORE_MAGIC;
+  blob.header.version = CALSTORE_VERSION;
+  blob.header.size = sizeof(calstore_data_t);
+  blob.data = *data;
+  blob.header.crc = payload_crc(&blob.data);
+
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(CALSTORE_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  ret = nvs_set_blob(handle, id, &blob, sizeof(blob));
+  if (ret == ESP_OK)
+  {
+    ret = nvs_commit(handle);
+  }
+  nvs_close(handle);
+
+  if (ret == ESP_OK)
+  {
+    ESP_LOGI(TAG, "%s: saved (sections 0x%x)", id, (unsigned)data->sections);
+  }
+  return ret;
+}
+
+esp_err_t calstore_erase(const char *id)
+{
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(CALSTORE_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+
+  ret = nvs_erase_key(handle, id);
+  if (ret == ESP_OK)
+  {
+    ret = nvs_commit(handle);
+  }
+  nvs_close(handle);
+
+  return ret == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : ret;
+}
@@ -0,0 +1,74 @@
+#ifndef CALSTORE_H
+#define CALSTORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "mpu9250.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Calibration store.  All the calibration for one unit is kept in a single NVS blob, keyed by a
+ * device ID, so a boot is one nvs_get_blob() and units don't need a rebuild per board.
+ *
+ * Each blob has a header with a magic number, the layout version and a CRC32 of the payload.  A
+ * blob that fails any of these checks is never returned, the caller keeps its compiled-in defaults.
+ *
+ * Saving writes the whole blob with one nvs_set_blob() and commits.  NVS only drops the old entry
+ * once the new one is completely written, so a power cut during a save leaves either the old or the
+ * new calibration, never a mix.
+ *
+ * nvs_flash_init() must have been called first.
+ */
+
+// Bump this whenever calstore_data_t or anything in it (e.g. calibration_t) changes layout.
+#define CALSTORE_VERSION (1)
+
+#define CALSTORE_ID_LEN (14) // Device ID string, including the terminator, fits an NVS key
+
+// Bits in calstore_data_t.sections for the parts that hold a calibration
+#define CALSTORE_HAS_IMU (1 << 0)
+#define CALSTORE_HAS_MAG (1 << 1)
+#define CALSTORE_HAS_TOF (1 << 2)
+
+typedef struct
+{
+  uint32_t sections; // CALSTORE_HAS_* bits
+
+  // MPU9250 / AK8963
+  calibration_t imu;
+
+  // QMC5883L, see qmc5883l_set_calibration()
+  float mag_offset[3];
+  float mag_soft_iron[3][3];
+
+  // VL53L0X part to part range offset, see vl53l0x_setOffsetMicrometers()
+  int32_t tof_offset_um;
+} calstore_data_t;
+
+/**
+ * The default device ID, from the factory MAC address, e.g. "c240ac4a1b2c3".
+ */
+esp_err_t calstore_device_id(char id[CALSTORE_ID_LEN]);
+
+/**
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if nothing is stored for `id`, ESP_ERR_INVALID_VERSION if the
+ *         stored layout is from another firmware version, or ESP_ERR_INVALID_CRC if it is corrupt.
+ *         `data` is only written on ESP_OK.
+ */
+esp_err_t calstore_load(const char *id, calstore_data_t *data);
+
+esp_err_t calstore_save(const char *id, const calstore_data_t *data);
+
+esp_err_t calstore_erase(const char *id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CALSTORE_H
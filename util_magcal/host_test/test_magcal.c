@@ -0,0 +1,266 @@
+//=====================================================================================================
+// test_magcal.c
+//=====================================================================================================
+//
+// Host test of the streaming ellipsoid fit, see magcal.h.  Built by the host branch of
+// util_magcal/CMakeLists.txt:
+//
+//   cmake -S util_magcal -B build && cmake --build build && ctest --test-dir build
+//
+//=====================================================================================================
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "magcal.h"
+
+#define GATE (0.25f)        // As calibrate_mag()
+#define SOLVE_EVERY (100)   // As calibrate_mag()
+#define NOISE (0.005f)      // Relative to the field
+
+// The distortion: raw = DISTORTION * field + OFFSET, with a unit field
+static const float OFFSET[3] = {0.3f, -0.2f, 0.5f};
+static const float DISTORTION[3][3] = {
+    {1.20f, 0.10f, -0.05f},
+    {0.10f, 0.90f, 0.08f},
+    {-0.05f, 0.08f, 1.05f}};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (!ok)
+  {
+    failures++;
+  }
+}
+
+// Small deterministic generator, so the result is the same on every host.
+static uint32_t rng_state = 1;
+
+static float randn(void)
+{
+  float u[2];
+  for (int i = 0; i < 2; i++)
+  {
+    rng_state = rng_state * 1664525u + 1013904223u;
+    u[i] = ((rng_state >> 8) + 1.0f) / 16777218.0f;
+  }
+  return sqrtf(-2.0f * logf(u[0])) * cosf(6.2831853f * u[1]);
+}
+
+// A random unit vector
+static void random_direction(float v[3])
+{
+  float n;
+  do
+  {
+    for (int k = 0; k < 3; k++)
+      v[k] = randn();
+    n = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  } while (n < 1e-3f);
+  for (int k = 0; k < 3; k++)
+    v[k] /= n;
+}
+
+static float uniform(void)
+{
+  rng_state = rng_state * 1664525u + 1013904223u;
+  return (rng_state >> 8) / 16777216.0f;
+}
+
+// A random unit vector within `angle` rad of +z
+static void random_in_cap(float angle, float v[3])
+{
+  float z = 1.0f - (1.0f - cosf(angle)) * uniform();
+  float r = sqrtf(1.0f - z * z);
+  float phi = 6.2831853f * uniform();
+  v[0] = r * cosf(phi);
+  v[1] = r * sinf(phi);
+  v[2] = z;
+}
+
+// The raw reading of a unit field in direction `v`, with noise
+static void raw_sample(const float v[3], float raw[3])
+{
+  for (int i = 0; i < 3; i++)
+  {
+    raw[i] = OFFSET[i] + NOISE * randn();
+    for (int k = 0; k < 3; k++)
+      raw[i] += DISTORTION[i][k] * v[k];
+  }
+}
+
+static float offset_error(const magcal_result_t *r)
+{
+  float e2 = 0.0f;
+  for (int k = 0; k < 3; k++)
+    e2 += (r->offset[k] - OFFSET[k]) * (r->offset[k] - OFFSET[k]);
+  return sqrtf(e2);
+}
+
+/**
+ * RMS relative radius error of the corrected samples over fresh, noise free directions.  Only
+ * small if the soft iron matrix undoes the distortion, not just the offset.
+ */
+static float shape_error(const magcal_result_t *r)
+{
+  double sum2 = 0.0;
+  const float noise_free_samples = 1000;
+  for (int i = 0; i < noise_free_samples; i++)
+  {
+    float v[3], raw[3], out[3];
+    random_direction(v);
+    for (int j = 0; j < 3; j++)
+    {
+      raw[j] = OFFSET[j];
+      for (int k = 0; k < 3; k++)
+        raw[j] += DISTORTION[j][k] * v[k];
+    }
+    magcal_apply(r, raw, out);
+    double e = sqrt(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]) / r->field_strength - 1.0;
+    sum2 += e * e;
+  }
+  return (float)sqrt(sum2 / noise_free_samples);
+}
+
+/**
+ * Random orientations of a tilted, offset ellipsoid with noise, solving as calibrate_mag() does,
+ * and one outlier once the gate is armed.
+ */
+static void test_tilted_ellipsoid(void)
+{
+  magcal_t mc;
+  magcal_result_t result = {0};
+  magcal_init(&mc, GATE);
+
+  bool outlier_rejected = false;
+  for (int i = 0; i < 2000; i++)
+  {
+    float v[3], raw[3];
+    random_direction(v);
+    raw_sample(v, raw);
+    if (i == 1000)
+    {
+      check(mc.gate_armed, "the gate is armed after 1000 samples");
+      for (int k = 0; k < 3; k++)
+        raw[k] = OFFSET[k] + 3.0f * v[k];
+      outlier_rejected = !magcal_add_sample(&mc, raw[0], raw[1], raw[2]);
+    }
+    else
+    {
+      magcal_add_sample(&mc, raw[0], raw[1], raw[2]);
+    }
+    if (i % SOLVE_EVERY == SOLVE_EVERY - 1)
+      magcal_solve(&mc, &result);
+  }
+
+  bool solved = magcal_solve(&mc, &result);
+  printf("tilted ellipsoid: offset error %.4f, shape error %.4f, fit error %.4f, %u samples, %u rejected\n",
+         offset_error(&result), shape_error(&result), result.fit_error, (unsigned)result.samples,
+         (unsigned)result.rejected);
+  check(solved, "the fit solves");
+  check(offset_error(&result) < 0.01f, "offset recovered within 0.01");
+  check(shape_error(&result) < 0.005f, "soft iron undoes the distortion within 0.5%");
+  check(outlier_rejected && result.rejected == 1, "the outlier is rejected, nothing else");
+  check(result.fit_error > 0.5f * NOISE && result.fit_error < 2.0f * NOISE, "fit error matches the noise");
+}
+
+/**
+ * A slow start: the first 300 samples are from a cap of 70 deg around +z, less than a hemisphere.
+ * They fit with a low error and an offset 0.27 off, which must not arm the gate and reject the rest
+ * of the sphere.
+ */
+static void test_patch_then_sphere(void)
+{
+  magcal_t mc;
+  magcal_result_t result = {0};
+  magcal_init(&mc, GATE);
+
+  for (int i = 0; i < 2000; i++)
+  {
+    float v[3], raw[3];
+    if (i < 300)
+      random_in_cap(1.2f, v);
+    else
+      random_direction(v);
+    raw_sample(v, raw);
+    magcal_add_sample(&mc, raw[0], raw[1], raw[2]);
+    if (i == 299)
+    {
+      bool patch_solved = magcal_solve(&mc, &result);
+      printf("patch: fit error %.4f, radius %.3f, offset error %.3f\n", result.fit_error, result.field_strength,
+             offset_error(&result));
+      check(patch_solved && result.fit_error < 0.5f * GATE, "the patch fits with a low error");
+      check(!mc.gate_armed, "the patch doesn't arm the gate");
+    }
+    else if (i % SOLVE_EVERY == SOLVE_EVERY - 1)
+    {
+      magcal_solve(&mc, &result);
+    }
+  }
+
+  bool solved = magcal_solve(&mc, &result);
+  printf("patch then sphere: offset error %.4f, %u rejected\n", offset_error(&result), (unsigned)mc.rejected);
+  check(solved, "the fit solves after a slow start");
+  check(mc.rejected == 0, "nothing is rejected after a slow start");
+  check(offset_error(&result) < 0.01f, "offset recovered within 0.01 after a slow start");
+}
+
+/**
+ * Spikes of 50% to 150% of the field once the gate is armed.
+ */
+static void test_spikes(void)
+{
+  magcal_t mc;
+  magcal_result_t result = {0};
+  magcal_init(&mc, GATE);
+
+  int spikes = 0, rejected = 0;
+  for (int i = 0; i < 2000; i++)
+  {
+    float v[3], raw[3];
+    random_direction(v);
+    raw_sample(v, raw);
+    bool spike = i >= 1000 && i % 50 == 0;
+    if (spike)
+    {
+      float size = 0.5f + (i % 3) * 0.5f;
+      for (int k = 0; k < 3; k++)
+        raw[k] += size * randn();
+    }
+    bool used = magcal_add_sample(&mc, raw[0], raw[1], raw[2]);
+    if (spike)
+    {
+      spikes++;
+      rejected += !used;
+    }
+    if (i % SOLVE_EVERY == SOLVE_EVERY - 1)
+      magcal_solve(&mc, &result);
+  }
+
+  bool solved = magcal_solve(&mc, &result);
+  printf("spikes: %d of %d rejected, %u rejected in all, offset error %.4f\n", rejected, spikes, (unsigned)mc.rejected,
+         offset_error(&result));
+  check(solved, "the fit solves with spikes");
+  check(rejected >= spikes / 2, "most spikes are rejected");
+  check(mc.rejected == (uint32_t)rejected, "only spikes are rejected");
+  check(offset_error(&result) < 0.02f, "offset recovered within 0.02 with spikes");
+}
+
+int main(void)
+{
+  test_tilted_ellipsoid();
+  test_patch_then_sphere();
+  test_spikes();
+
+  printf("%d failure(s)\n", failures);
+  return failures == 0 ? 0 : 1;
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
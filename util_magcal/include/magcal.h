@@ -0,0 +1,81 @@
+#ifndef MAGCAL_H
+#define MAGCAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Streaming ellipsoid fit for magnetometer calibration.
+ *
+ * Each sample adds to the normal equations of the general ellipsoid
+ *   a x^2 + b y^2 + c z^2 + 2f yz + 2g xz + 2h xy + 2p x + 2q y + 2r z = 1
+ * so memory is constant and no samples are stored.  magcal_solve() turns the sums into a hard iron
+ * offset and a symmetric 3x3 soft iron matrix such that
+ *   corrected = soft_iron * (raw - offset)
+ * lies on a sphere of radius field_strength (same units as raw).
+ *
+ * No platform dependencies, so recorded logs can be fitted on a host with the same code.
+ */
+
+#define MAGCAL_N (9)
+
+typedef struct
+{
+  float offset[3];        // Hard iron offset, in raw units
+  float soft_iron[3][3];  // Symmetric soft iron correction
+  float field_strength;   // Radius of the corrected sphere, in raw units
+  float fit_error;        // Approximate RMS relative radius error, e.g. 0.01 is 1%
+  uint32_t samples;       // Samples used in the fit
+  uint32_t rejected;      // Samples rejected by the outlier gate
+} magcal_result_t;
+
+typedef struct
+{
+  double scale;                 // Inputs are scaled by this to keep the sums well conditioned
+  double dtd[MAGCAL_N][MAGCAL_N]; // Upper triangle of D'D
+  double dt1[MAGCAL_N];           // D'1
+  uint32_t n;
+  uint32_t rejected;
+
+  float gate;                   // Reject samples this far (relative) from the last fit, 0 disables
+  bool gate_armed;              // The last fit is good enough to gate against
+  magcal_result_t fit;
+} magcal_t;
+
+/**
+ * @param gate Once a trusted fit exists, samples whose corrected radius differs by more than this
+ *             fraction from field_strength are rejected.  A fit is trusted when it has at least 200
+ *             samples, a fit_error under half the gate, and samples spread over about a hemisphere;
+ *             until then every sample is used.  0.0 disables the gate.
+ */
+void magcal_init(magcal_t *mc, float gate);
+
+/**
+ * Add one raw sample.  Constant time.
+ * @return false if the sample was rejected as an outlier.
+ */
+bool magcal_add_sample(magcal_t *mc, float x, float y, float z);
+
+/**
+ * Solve the fit from the current sums.  Bounded time: one 9x9 Cholesky and a fixed number of
+ * Jacobi sweeps.  Solving also arms the outlier gate, or disarms it if the new fit is no longer
+ * trusted, so call it periodically while collecting.  Rejected samples are not kept, so a gate
+ * armed by a fit that later turns out wrong loses what it rejected in the meantime.
+ * @return false if the samples don't describe an ellipsoid yet (e.g. not enough rotation).
+ */
+bool magcal_solve(magcal_t *mc, magcal_result_t *result);
+
+/**
+ * Apply a result to a raw sample.
+ */
+void magcal_apply(const magcal_result_t *result, const float raw[3], float out[3]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MAGCAL_H
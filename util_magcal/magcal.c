@@ -0,0 +1,355 @@
+#include <math.h>
+#include <string.h>
+
+#include "magcal.h"
+
+#define JACOBI_SWEEPS (10)
+
+// The outlier gate is only armed by a fit that is good enough to judge samples against.  An early
+// fit from a small patch of the sphere can have a low fit error and still be wrong, and would then
+// reject the samples that would correct it.
+#define GATE_MIN_SAMPLES (200)   // Samples in the fit
+#define GATE_MAX_ERROR (0.5f)    // fit_error, as a fraction of the gate
+#define GATE_MIN_SPREAD (0.05)   // Smallest sample variance in any direction, as a fraction of radius^2
+
+void magcal_init(magcal_t *mc, float gate)
+{
+  memset(mc, 0, sizeof(magcal_t));
+  mc->gate = gate;
+}
+
+static void design_row(const magcal_t *mc, float x, float y, float z, double d[MAGCAL_N])
+{
+  double xs = x * mc->scale;
+  double ys = y * mc->scale;
+  double zs = z * mc->scale;
+
+  d[0] = xs * xs;
+  d[1] = ys * ys;
+  d[2] = zs * zs;
+  d[3] = 2.0 * ys * zs;
+  d[4] = 2.0 * xs * zs;
+  d[5] = 2.0 * xs * ys;
+  d[6] = 2.0 * xs;
+  d[7] = 2.0 * ys;
+  d[8] = 2.0 * zs;
+}
+
+bool magcal_add_sample(magcal_t *mc, float x, float y, float z)
+{
+  if (mc->scale == 0.0)
+  {
+    double norm = sqrt((double)x * x + (double)y * y + (double)z * z);
+    if (norm == 0.0)
+    {
+      return false;
+    }
+    mc->scale = 1.0 / norm;
+  }
+
+  if (mc->gate_armed)
+  {
+    float raw[3] = {x, y, z};
+    float out[3];
+    magcal_apply(&mc->fit, raw, out);
+    float r = sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
+    if (fabsf(r - mc->fit.field_strength) > mc->gate * mc->fit.field_strength)
+    {
+      mc->rejected += 1;
+      return false;
+    }
+  }
+
+  double d[MAGCAL_N];
+  design_row(mc, x, y, z, d);
+  for (int i = 0; i < MAGCAL_N; i++)
+  {
+    for (int j = i; j < MAGCAL_N; j++)
+    {
+      mc->dtd[i][j] += d[i] * d[j];
+    }
+    mc->dt1[i] += d[i];
+  }
+  mc->n += 1;
+
+  return true;
+}
+
+/**
+ * Solve the normal equations with a Cholesky factorisation of the upper triangle.
+ */
+static bool cholesky_solve(const double a_upper[MAGCAL_N][MAGCAL_N], const double b[MAGCAL_N], double x[MAGCAL_N])
+{
+  double l[MAGCAL_N][MAGCAL_N];
+  double y[MAGCAL_N];
+
+  for (int i = 0; i < MAGCAL_N; i++)
+  {
+    for (int j = 0; j <= i; j++)
+    {
+      double sum = a_upper[j][i];
+      for (int k = 0; k < j; k++)
+      {
+        sum -= l[i][k] * l[j][k];
+      }
+      if (i == j)
+      {
+        if (sum <= 1e-12 * a_upper[i][i])
+        {
+          return false;
+        }
+        l[i][i] = sqrt(sum);
+      }
+      else
+      {
+        l[i][j] = sum / l[j][j];
+      }
+    }
+  }
+
+  for (int i = 0; i < MAGCAL_N; i++)
+  {
+    double sum = b[i];
+    for (int k = 0; k < i; k++)
+    {
+      sum -= l[i][k] * y[k];
+    }
+    y[i] = sum / l[i][i];
+  }
+  for (int i = MAGCAL_N - 1; i >= 0; i--)
+  {
+    double sum = y[i];
+    for (int k = i + 1; k < MAGCAL_N; k++)
+    {
+      sum -= l[k][i] * x[k];
+    }
+    x[i] = sum / l[i][i];
+  }
+
+  return true;
+}
+
+static bool invert3(const double m[3][3], double inv[3][3])
+{
+  double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  if (fabs(det) < 1e-30)
+  {
+    return false;
+  }
+
+  inv[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+  inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+  inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+  inv[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) / det;
+  inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+  inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+  inv[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) / det;
+  inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) / det;
+  inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+  return true;
+}
+
+/**
+ * Eigen decomposition of a symmetric 3x3 matrix, cyclic Jacobi with a fixed number of sweeps.
+ * On return `a` is diagonal (the eigenvalues) and the columns of `v` are the eigenvectors.
+ */
+static void jacobi3(double a[3][3], double v[3][3])
+{
+  memset(v, 0, sizeof(double) * 9);
+  v[0][0] = v[1][1] = v[2][2] = 1.0;
+
+  for (int sweep = 0; sweep < JACOBI_SWEEPS; sweep++)
+  {
+    double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+    if (off < 1e-30)
+    {
+      break;
+    }
+
+    for (int p = 0; p < 2; p++)
+    {
+      for (int q = p + 1; q < 3; q++)
+      {
+        if (a[p][q] == 0.0)
+        {
+          continue;
+        }
+        double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+        double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+        double c = 1.0 / sqrt(t * t + 1.0);
+        double s = t * c;
+
+        for (int k = 0; k < 3; k++)
+        {
+          double akp = a[k][p];
+          double akq = a[k][q];
+          a[k][p] = c * akp - s * akq;
+          a[k][q] = s * akp + c * akq;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+          double apk = a[p][k];
+          double aqk = a[q][k];
+          a[p][k] = c * apk - s * aqk;
+          a[q][k] = s * apk + c * aqk;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+          double vkp = v[k][p];
+          double vkq = v[k][q];
+          v[k][p] = c * vkp - s * vkq;
+          v[k][q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * The smallest variance of the (scaled) samples in any direction, from the sums.  Small when the
+ * samples only cover a patch or a band of the sphere.
+ */
+static double min_spread(const magcal_t *mc)
+{
+  double n = (double)mc->n;
+  double mean[3] = {mc->dt1[6] / (2.0 * n), mc->dt1[7] / (2.0 * n), mc->dt1[8] / (2.0 * n)};
+  double cov[3][3] = {
+      {mc->dt1[0] / n, mc->dt1[5] / (2.0 * n), mc->dt1[4] / (2.0 * n)},
+      {mc->dt1[5] / (2.0 * n), mc->dt1[1] / n, mc->dt1[3] / (2.0 * n)},
+      {mc->dt1[4] / (2.0 * n), mc->dt1[3] / (2.0 * n), mc->dt1[2] / n}};
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      cov[i][j] -= mean[i] * mean[j];
+    }
+  }
+
+  double v[3][3];
+  jacobi3(cov, v);
+  return fmin(cov[0][0], fmin(cov[1][1], cov[2][2]));
+}
+
+bool magcal_solve(magcal_t *mc, magcal_result_t *result)
+{
+  if (mc->n < MAGCAL_N)
+  {
+    return false;
+  }
+
+  double v[MAGCAL_N];
+  if (!cholesky_solve(mc->dtd, mc->dt1, v))
+  {
+    return false;
+  }
+
+  // Algebraic residual from the sums: |Dv - 1|^2 = v'D'Dv - 2v'D'1 + n
+  double res = (double)mc->n;
+  for (int i = 0; i < MAGCAL_N; i++)
+  {
+    double row = 0.0;
+    for (int j = 0; j < MAGCAL_N; j++)
+    {
+      row += (i <= j ? mc->dtd[i][j] : mc->dtd[j][i]) * v[j];
+    }
+    res += v[i] * row - 2.0 * v[i] * mc->dt1[i];
+  }
+
+  double a[3][3] = {
+      {v[0], v[5], v[4]},
+      {v[5], v[1], v[3]},
+      {v[4], v[3], v[2]}};
+  double u[3] = {v[6], v[7], v[8]};
+
+  double a_inv[3][3];
+  if (!invert3(a, a_inv))
+  {
+    return false;
+  }
+
+  // Centre c = -A^-1 u, then (x - c)' A (x - c) = 1 + c' A c
+  double c[3];
+  for (int i = 0; i < 3; i++)
+  {
+    c[i] = -(a_inv[i][0] * u[0] + a_inv[i][1] * u[1] + a_inv[i][2] * u[2]);
+  }
+  double k = 1.0;
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      k += c[i] * a[i][j] * c[j];
+    }
+  }
+  // k is negative when the origin is outside the ellipsoid, A is then negative definite too.
+  if (fabs(k) < 1e-12)
+  {
+    return false;
+  }
+
+  double m[3][3];
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      m[i][j] = a[i][j] / k;
+    }
+  }
+
+  double eig[3][3];
+  jacobi3(m, eig);
+  double lambda[3] = {m[0][0], m[1][1], m[2][2]};
+  if (lambda[0] <= 0.0 || lambda[1] <= 0.0 || lambda[2] <= 0.0)
+  {
+    // Hyperboloid, not an ellipsoid
+    return false;
+  }
+
+  // Keep the geometric mean radius so the output stays in raw units: radius = (l0 l1 l2)^(-1/6)
+  double radius = pow(lambda[0] * lambda[1] * lambda[2], -1.0 / 6.0);
+
+  // soft_iron = radius * V sqrt(L) V'
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 3; j++)
+    {
+      double sum = 0.0;
+      for (int e = 0; e < 3; e++)
+      {
+        sum += eig[i][e] * sqrt(lambda[e]) * eig[j][e];
+      }
+      result->soft_iron[i][j] = (float)(sum * radius);
+    }
+    result->offset[i] = (float)(c[i] / mc->scale);
+  }
+  result->field_strength = (float)(radius / mc->scale);
+
+  // Dv - 1 = k ((x - c)' M (x - c) - 1), which near the surface is 2k times the relative radius error.
+  result->fit_error = (float)(0.5 * sqrt(fmax(res, 0.0) / mc->n) / fabs(k));
+  result->samples = mc->n;
+  result->rejected = mc->rejected;
+
+  // Arm the gate only while the fit is trusted, it is checked again on every solve.
+  mc->fit = *result;
+  mc->gate_armed = mc->gate > 0.0f &&
+                   result->samples >= GATE_MIN_SAMPLES &&
+                   result->fit_error < GATE_MAX_ERROR * mc->gate &&
+                   min_spread(mc) >= GATE_MIN_SPREAD * radius * radius;
+
+  return true;
+}
+
+void magcal_apply(const magcal_result_t *result, const float raw[3], float out[3])
+{
+  float d[3] = {
+      raw[0] - result->offset[0],
+      raw[1] - result->offset[1],
+      raw[2] - result->offset[2]};
+
+  for (int i = 0; i < 3; i++)
+  {
+    out[i] = result->soft_iron[i][0] * d[0] + result->soft_iron[i][1] * d[1] + result->soft_iron[i][2] * d[2];
+  }
+}
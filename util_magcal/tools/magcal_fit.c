@@ -0,0 +1,108 @@
+//=====================================================================================================
+// magcal_fit.c
+//=====================================================================================================
+//
+// Fit a recorded magnetometer log on a host, with the same code as calibrate_mag().  Built by the host
+// branch of util_magcal/CMakeLists.txt:
+//
+//   magcal_fit [-g gate] log.csv
+//
+// One sample per line, the first three comma (or space) separated numbers are x, y and z in any
+// units.  Lines that don't start with three numbers, e.g. a header, are skipped.  "-" reads stdin.
+// Prints the hard iron offset, the soft iron matrix and the fit error, in the calibration_t layout
+// calibrate_mag() prints.
+//
+//=====================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "magcal.h"
+
+#define GATE_DEFAULT (0.25f) // As calibrate_mag()
+#define SOLVE_EVERY (100)    // As calibrate_mag(), the gate is only armed by a solve
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-g gate] log.csv\n", name);
+  fprintf(stderr, "  -g gate  reject samples this far (relative) from a trusted fit, 0 disables, default %.2f\n",
+          GATE_DEFAULT);
+}
+
+int main(int argc, char **argv)
+{
+  float gate = GATE_DEFAULT;
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+    {
+      gate = strtof(argv[++i], NULL);
+    }
+    else if (path == NULL && (argv[i][0] != '-' || argv[i][1] == '\0'))
+    {
+      path = argv[i];
+    }
+    else
+    {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (path == NULL)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  magcal_t mc;
+  magcal_result_t result = {0};
+  magcal_init(&mc, gate);
+
+  char line[256];
+  unsigned long lines = 0, skipped = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    float x, y, z;
+    lines++;
+    if (sscanf(line, "%f%*[, \t]%f%*[, \t]%f", &x, &y, &z) != 3)
+    {
+      skipped++;
+      continue;
+    }
+    magcal_add_sample(&mc, x, y, z);
+    if ((lines - skipped) % SOLVE_EVERY == 0)
+      magcal_solve(&mc, &result);
+  }
+  if (f != stdin)
+    fclose(f);
+
+  if (!magcal_solve(&mc, &result))
+  {
+    fprintf(stderr, "%s: no fit from %lu samples, the log needs more orientations\n", path, lines - skipped);
+    return 1;
+  }
+
+  printf("Fit error %0.2f%%, %u samples, %u rejected, %lu lines skipped\n", result.fit_error * 100.0f,
+         (unsigned)result.samples, (unsigned)result.rejected, skipped);
+  printf("Field strength %f\n", result.field_strength);
+  printf("    .mag_offset = {.x = %f, .y = %f, .z = %f},\n", result.offset[0], result.offset[1], result.offset[2]);
+  printf("    .mag_scale = {.x = 1.0, .y = 1.0, .z = 1.0},\n");
+  printf("    .mag_soft_iron = {{%f, %f, %f}, {%f, %f, %f}, {%f, %f, %f}},\n",
+         result.soft_iron[0][0], result.soft_iron[0][1], result.soft_iron[0][2],
+         result.soft_iron[1][0], result.soft_iron[1][1], result.soft_iron[1][2],
+         result.soft_iron[2][0], result.soft_iron[2][1], result.soft_iron[2][2]);
+  return 0;
+}
+
+//====================================================================================================
+// END OF CODE
+//====================================================================================================
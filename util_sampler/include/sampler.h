@@ -0,0 +1,78 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Deadline statistics.  Errors are measured as (wake time - deadline), so they are always >= 0
+ * and show how late the sampling task actually ran.
+ */
+typedef struct
+{
+  uint32_t samples;       // Number of deadlines the task woke up for
+  uint32_t missed;        // Deadlines that passed while the task was still busy
+  int32_t last_error_us;  // Lateness of the most recent wake up
+  int32_t max_error_us;   // Worst lateness seen
+  float mean_error_us;    // Average lateness
+  float mean_period_us;   // Measured average period between wake ups
+} sampler_stats_t;
+
+/**
+ * A periodic sampler.  Deadlines are absolute (start + n * period), like vTaskDelayUntil(), but
+ * are driven by esp_timer so the rate is not limited to the FreeRTOS tick.
+ */
+typedef struct
+{
+  uint32_t period_us;
+  esp_timer_handle_t timer;
+  TaskHandle_t task;
+  bool running;
+
+  int64_t first_wake_us;
+  int64_t first_deadline_us;
+  int64_t deadline_us;
+  int64_t error_sum_us;
+  sampler_stats_t stats;
+} sampler_t;
+
+/**
+ * @brief Create the sampler timer.  Does not start it.
+ * @param s       The sampler
+ * @param rate_hz Sample rate, 1 Hz up to a few kHz.  The period is 1000000 / rate_hz us rounded
+ *                down, so a rate that doesn't divide 1 MHz runs slightly fast.
+ * @return ESP_OK on success
+ */
+esp_err_t sampler_init(sampler_t *s, uint32_t rate_hz);
+
+/**
+ * @brief Start the deadlines.  The calling task is the one that will be woken by sampler_wait().
+ */
+esp_err_t sampler_start(sampler_t *s);
+
+/**
+ * @brief Block until the next deadline.
+ * @return ESP_OK, or ESP_ERR_TIMEOUT if the timer stopped firing.
+ */
+esp_err_t sampler_wait(sampler_t *s);
+
+esp_err_t sampler_stop(sampler_t *s);
+void sampler_deinit(sampler_t *s);
+
+void sampler_get_stats(const sampler_t *s, sampler_stats_t *stats);
+void sampler_reset_stats(sampler_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SAMPLER_H
@@ -0,0 +1,143 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "sampler.h"
+
+static const char *TAG = "sampler";
+
+static void IRAM_ATTR sampler_timer_cb(void *arg)
+{
+  sampler_t *s = (sampler_t *)arg;
+#ifdef CONFIG_SAMPLER_ISR_DISPATCH
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(s->task, &woken);
+  if (woken == pdTRUE)
+  {
+    esp_timer_isr_dispatch_need_yield();
+  }
+#else
+  xTaskNotifyGive(s->task);
+#endif
+}
+
+esp_err_t sampler_init(sampler_t *s, uint32_t rate_hz)
+{
+  if (rate_hz == 0 || rate_hz > 1000000)
+  {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  memset(s, 0, sizeof(sampler_t));
+  s->period_us = 1000000 / rate_hz;
+
+  const esp_timer_create_args_t args = {
+      .callback = sampler_timer_cb,
+      .arg = s,
+#ifdef CONFIG_SAMPLER_ISR_DISPATCH
+      .dispatch_method = ESP_TIMER_ISR,
+#else
+      .dispatch_method = ESP_TIMER_TASK,
+#endif
+      .name = "sampler",
+      .skip_unhandled_events = false};
+
+  return esp_timer_create(&args, &s->timer);
+}
+
+esp_err_t sampler_start(sampler_t *s)
+{
+  if (s->running)
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Throw away any notification left over from a previous run.
+  ulTaskNotifyTake(pdTRUE, 0);
+
+  s->task = xTaskGetCurrentTaskHandle();
+  s->first_wake_us = 0;
+  s->deadline_us = esp_timer_get_time();
+
+  // esp_timer re-arms each period from the previous alarm time, not from when the callback ran, so
+  // the deadlines never drift.
+  esp_err_t ret = esp_timer_start_periodic(s->timer, s->period_us);
+  if (ret != ESP_OK)
+  {
+    return ret;
+  }
+  s->running = true;
+
+  ESP_LOGD(TAG, "Started with a period of %u us", (unsigned)s->period_us);
+  return ESP_OK;
+}
+
+esp_err_t sampler_wait(sampler_t *s)
+{
+  // Allow a few periods, and at least two ticks, before giving up on the timer.
+  TickType_t timeout = pdMS_TO_TICKS((4 * s->period_us) / 1000) + 2;
+
+  uint32_t n = ulTaskNotifyTake(pdTRUE, timeout);
+  int64_t now = esp_timer_get_time();
+  if (n == 0)
+  {
+    return ESP_ERR_TIMEOUT;
+  }
+
+  // More than one pending notification means we overran and deadlines went by.
+  s->deadline_us += (int64_t)s->period_us * n;
+  s->stats.missed += n - 1;
+
+  int32_t error = (int32_t)(now - s->deadline_us);
+  if (s->stats.samples == 0)
+  {
+    s->first_wake_us = now;
+    s->first_deadline_us = s->deadline_us;
+  }
+  s->stats.samples += 1;
+  s->stats.last_error_us = error;
+  if (error > s->stats.max_error_us)
+  {
+    s->stats.max_error_us = error;
+  }
+  s->error_sum_us += error;
+  s->stats.mean_error_us = (float)s->error_sum_us / s->stats.samples;
+  int64_t periods = (s->deadline_us - s->first_deadline_us) / s->period_us;
+  if (periods > 0)
+  {
+    s->stats.mean_period_us = (float)(now - s->first_wake_us) / periods;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t sampler_stop(sampler_t *s)
+{
+  if (!s->running)
+  {
+    return ESP_ERR_INVALID_STATE;
+  }
+  s->running = false;
+  return esp_timer_stop(s->timer);
+}
+
+void sampler_deinit(sampler_t *s)
+{
+  if (s->running)
+  {
+    sampler_stop(s);
+  }
+  esp_timer_delete(s->timer);
+  s->timer = NULL;
+}
+
+void sampler_get_stats(const sampler_t *s, sampler_stats_t *stats)
+{
+  *stats = s->stats;
+}
+
+void sampler_reset_stats(sampler_t *s)
+{
+  memset(&s->stats, 0, sizeof(sampler_stats_t));
+  s->error_sum_us = 0;
+  s->first_wake_us = 0;
+}